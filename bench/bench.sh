@@ -0,0 +1,109 @@
+#!/bin/sh
+#
+# End-to-end benchmark of metastore actions on a synthetic file tree.
+#
+# Generates a reproducible tree with mktree, then times save, compare,
+# apply and dump actions on it, printing one JSON object per run
+# (including --stats=json output of metastore) to stdout.  Then saves
+# a chain of nested directories, whose memory use must not grow with
+# each level.
+#
+# Usage: bench.sh [MKTREE_OPTION...]
+#
+# Environment:
+#   METASTORE   metastore binary to benchmark (default: metastore)
+#   MKTREE      mktree binary (default: mktree)
+#   BENCH_DIR   directory for the tree and metadata (default: temporary)
+#   BENCH_RUNS  number of runs of each action (default: 3)
+#   BENCH_DEPTH levels of the chain of directories (default: 500)
+
+METASTORE="${METASTORE:-metastore}"
+MKTREE="${MKTREE:-mktree}"
+BENCH_RUNS="${BENCH_RUNS:-3}"
+BENCH_DEPTH="${BENCH_DEPTH:-500}"
+
+case "$METASTORE" in /*) ;; */*) METASTORE="$PWD/$METASTORE" ;; esac
+case "$MKTREE" in /*) ;; */*) MKTREE="$PWD/$MKTREE" ;; esac
+
+if [ -z "$BENCH_DIR" ]; then
+	BENCH_DIR="$(mktemp -d "${TMPDIR:-/tmp}/metastore-bench.XXXXXX")" || exit 1
+	trap 'rm -rf "$BENCH_DIR"' EXIT
+fi
+
+TREE="$BENCH_DIR/tree"
+META="$BENCH_DIR/metadata"
+STATS="$BENCH_DIR/stats"
+
+exit_on_fail() {
+	"$@"
+	if [ $? -ne 0 ]; then
+		echo "Failed to execute: $@" >&2
+		exit 1
+	fi
+}
+
+now() {
+	date +%s%N
+}
+
+# Runs metastore with given arguments in the tree and prints the result
+run() {
+	NAME="$1"
+	RUN="$2"
+	shift 2
+	START=$(now)
+	(cd "$TREE" && "$METASTORE" "$@" -f "$META" --stats=json \
+		>/dev/null 2>"$STATS")
+	STATUS=$?
+	STOP=$(now)
+	WALL=$(awk -v a="$START" -v b="$STOP" 'BEGIN { printf "%.6f", (b - a) / 1e9 }')
+	RESULT="$(grep '^{' "$STATS" | tail -n 1)"
+	printf '{"action":"%s","run":%s,"status":%s,"wall":%s,"stats":%s}\n' \
+		"$NAME" "$RUN" "$STATUS" "$WALL" "${RESULT:-null}"
+}
+
+rm -rf "$TREE" "$META"
+TREEINFO="$("$MKTREE" "$@" "$TREE")" || exit 1
+printf '{"tree":%s}\n' "$TREEINFO"
+
+# Flush the generated tree, so writeback does not disturb measurements
+sync
+
+i=1
+while [ $i -le "$BENCH_RUNS" ]; do
+	run save $i -s
+	i=$((i + 1))
+done
+
+i=1
+while [ $i -le "$BENCH_RUNS" ]; do
+	run compare $i -c -m
+	i=$((i + 1))
+done
+
+i=1
+while [ $i -le "$BENCH_RUNS" ]; do
+	exit_on_fail "$MKTREE" "$@" --perturb=7 --seed=$i "$TREE" >/dev/null
+	run apply $i -a -m -e -E
+	i=$((i + 1))
+done
+
+i=1
+while [ $i -le "$BENCH_RUNS" ]; do
+	run dump $i -d
+	i=$((i + 1))
+done
+
+TREE="$BENCH_DIR/deep"
+rm -rf "$TREE" "$META"
+TREEINFO="$("$MKTREE" --depth="$BENCH_DEPTH" --fanout=1 --files=1 \
+	"$TREE")" || exit 1
+printf '{"tree":%s}\n' "$TREEINFO"
+
+i=1
+while [ $i -le "$BENCH_RUNS" ]; do
+	run save_deep $i -s
+	i=$((i + 1))
+done
+
+exit 0
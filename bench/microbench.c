@@ -0,0 +1,546 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Micro-benchmarks of metastore codec, hash and lookup primitives.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "metastore.h"
+#include "metaentry.h"
+#include "settings.h"
+#include "utils.h"
+
+/* Number of lookups done by find benchmarks (0 means one per entry) */
+static unsigned long lookups = 1000000;
+
+/* Print results as JSON lines instead of a table */
+static bool json = false;
+
+/* Settings used by mentry_compare */
+static struct metasettings settings = {
+	.metafile = METAFILE,
+	.do_mtime = true,
+	.fields = FIELDS_ALL,
+};
+
+/* Owners and groups the generated entries are spread over */
+static const char *names[] = { "root", "daemon", "bin", "users", "nobody" };
+#define NAMES (sizeof(names) / sizeof(names[0]))
+
+/* Number of threads used by the insert_mt and *_mt loading benchmarks */
+#define INSERT_THREADS 4
+
+/* Sink for computed values, so the compiler cannot drop the work */
+static volatile unsigned long sink;
+
+/* Benchmark clock */
+struct timer {
+	struct timespec start;
+};
+
+/* Starts the benchmark clock */
+static void
+timer_start(struct timer *t)
+{
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+}
+
+/* Returns nanoseconds elapsed since timer_start */
+static double
+timer_ns(const struct timer *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->start.tv_sec) * 1e9 +
+	       (now.tv_nsec - t->start.tv_nsec);
+}
+
+/* Prints the result of a single benchmark */
+static void
+report(const char *name, unsigned long n, unsigned long ops, double ns,
+       double bytes)
+{
+	if (json) {
+		printf("{\"bench\":\"%s\",\"entries\":%lu,\"ops\":%lu,"
+		       "\"ns_per_op\":%.2f,\"bytes_per_op\":%.2f}\n",
+		       name, n, ops, ops ? ns / ops : 0.0,
+		       ops ? bytes / ops : 0.0);
+	} else {
+		printf("%-16s %10lu %10lu %12.2f %12.2f\n",
+		       name, n, ops, ops ? ns / ops : 0.0,
+		       ops ? bytes / ops : 0.0);
+	}
+	fflush(stdout);
+}
+
+/* Exits if an allocation failed, returns ptr otherwise */
+static void *
+need(void *ptr)
+{
+	if (!ptr) {
+		fprintf(stderr, "microbench: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	return ptr;
+}
+
+/* Creates a synthetic metaentry number i */
+static struct metaentry *
+entry_generate(unsigned long i)
+{
+	struct metaentry *mentry;
+	char path[64];
+
+	snprintf(path, sizeof(path), "./d%03lu/d%03lu/f%lu",
+	         i % 997, (i / 997) % 991, i);
+
+	mentry = need(xmalloc(sizeof(struct metaentry), STATS_MEM_ENTRY));
+	memset(mentry, 0, sizeof(struct metaentry));
+	mentry->path = need(xstrdup(path, STATS_MEM_PATH));
+	mentry->pathlen = strlen(path);
+	mentry->owner = need(xstrdup(names[i % NAMES], STATS_MEM_NAME));
+	mentry->group = need(xstrdup(names[(i / NAMES) % NAMES],
+	                             STATS_MEM_NAME));
+	mentry->mode = (i % 8 ? S_IFREG | 0644 : S_IFDIR | 0755);
+	mentry->mtime = 1000000000 + (time_t)(i * 7919 % 500000000);
+	mentry->mtimensec = (long)(i * 104729 % 1000000000);
+
+	/* Every 16th entry has an xattr */
+	if (i % 16 == 0) {
+		mentry->xattrs = 1;
+		mentry->xattr_names = need(xmalloc(sizeof(char *),
+		                                   STATS_MEM_ENTRY));
+		mentry->xattr_lvalues = need(xmalloc(sizeof(ssize_t),
+		                                     STATS_MEM_ENTRY));
+		mentry->xattr_values = need(xmalloc(sizeof(char *),
+		                                    STATS_MEM_ENTRY));
+		mentry->xattr_names[0] = need(xstrdup("user.comment",
+		                                      STATS_MEM_XNAME));
+		mentry->xattr_lvalues[0] = 32;
+		mentry->xattr_values[0] = need(xmalloc(32, STATS_MEM_XVALUE));
+		memset(mentry->xattr_values[0], 'a' + (int)(i % 26), 32);
+	}
+
+	return mentry;
+}
+
+/* Fills array with entries of mhash, in bucket order (reversed if asked) */
+static void
+entries_collect(const struct metahash *mhash, struct metaentry **array,
+                bool reverse)
+{
+	struct metaentry *mentry;
+	unsigned long base = 0, len, j;
+	int key;
+
+	for (key = 0; key < HASH_INDEXES; key++) {
+		len = 0;
+		for (mentry = mhash->bucket[key]; mentry; mentry = mentry->next)
+			len++;
+		j = 0;
+		for (mentry = mhash->bucket[key]; mentry; mentry = mentry->next) {
+			array[base + (reverse ? len - 1 - j : j)] = mentry;
+			j++;
+		}
+		base += len;
+	}
+}
+
+/* Opens an in-memory stream, exits on failure */
+static FILE *
+memstream_open(char **buf, size_t *size)
+{
+	FILE *stream;
+
+	stream = open_memstream(buf, size);
+	if (!stream) {
+		perror("open_memstream");
+		exit(EXIT_FAILURE);
+	}
+	return stream;
+}
+
+/* Benchmarks write_int and read_int */
+static void
+bench_int(unsigned long n)
+{
+	struct timer t;
+	FILE *stream;
+	char *buf, *ptr;
+	size_t size;
+	unsigned long i, sum = 0;
+
+	stream = memstream_open(&buf, &size);
+	timer_start(&t);
+	for (i = 0; i < n; i++)
+		write_int((uint64_t)i * 2654435761U, 8, stream);
+	fflush(stream);
+	report("write_int", n, n, timer_ns(&t), size);
+	fclose(stream);
+
+	ptr = buf;
+	timer_start(&t);
+	for (i = 0; i < n; i++)
+		sum += read_int(&ptr, 8, buf + size);
+	report("read_int", n, n, timer_ns(&t), ptr - buf);
+	sink = sum;
+
+	free(buf);
+}
+
+/* Benchmarks write_string and read_string */
+static void
+bench_string(struct metaentry **entries, unsigned long n)
+{
+	struct timer t;
+	FILE *stream;
+	char *buf, *ptr, *str;
+	size_t size;
+	unsigned long i, sum = 0;
+
+	stream = memstream_open(&buf, &size);
+	timer_start(&t);
+	for (i = 0; i < n; i++)
+		write_string(entries[i]->path, stream);
+	fflush(stream);
+	report("write_string", n, n, timer_ns(&t), size);
+	fclose(stream);
+
+	ptr = buf;
+	timer_start(&t);
+	for (i = 0; i < n; i++) {
+		str = need(read_string(&ptr, buf + size, STATS_MEM_OTHER));
+		sum += (unsigned char)*str;
+		xfree(str);
+	}
+	report("read_string", n, n, timer_ns(&t), ptr - buf);
+	sink = sum;
+
+	free(buf);
+}
+
+/* Slice of entries inserted by one thread */
+struct insert_job {
+	struct metaentry **entries;
+	unsigned long n;
+	struct metahash *mhash;
+	pthread_t thread;
+};
+
+/* Inserts a slice of entries */
+static void *
+insert_slice(void *arg)
+{
+	struct insert_job *job = arg;
+	unsigned long i;
+
+	for (i = 0; i < job->n; i++)
+		mentry_insert(job->entries[i], job->mhash);
+	return NULL;
+}
+
+/* Benchmarks mentry_insert done by several threads into one table */
+static void
+bench_insert_mt(struct metaentry **entries, unsigned long n)
+{
+	struct insert_job jobs[INSERT_THREADS];
+	struct metahash *mhash;
+	struct timer t;
+	unsigned long per = (n + INSERT_THREADS - 1) / INSERT_THREADS;
+	unsigned i;
+
+	mhash = need(mhash_alloc());
+	timer_start(&t);
+	for (i = 0; i < INSERT_THREADS; i++) {
+		jobs[i].entries = entries + i * per;
+		jobs[i].n = i * per >= n ? 0 : n - i * per < per ? n - i * per : per;
+		jobs[i].mhash = mhash;
+		if (pthread_create(&jobs[i].thread, NULL, insert_slice,
+		                   &jobs[i])) {
+			fprintf(stderr, "microbench: failed to create thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < INSERT_THREADS; i++)
+		pthread_join(jobs[i].thread, NULL);
+	report("insert_mt", n, n, timer_ns(&t), 0);
+
+	if (mhash->count != n) {
+		fprintf(stderr, "microbench: inserted %u of %lu entries\n",
+		        mhash->count, n);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Entries are inserted again by the single-threaded benchmark */
+	mhash_free(mhash);
+}
+
+/* Benchmarks mhash_key and mentry_find */
+static void
+bench_hash(struct metaentry **entries, struct metahash *mhash,
+           unsigned long n)
+{
+	struct timer t;
+	char path[64];
+	unsigned long i, ops, sum = 0;
+
+	timer_start(&t);
+	for (i = 0; i < n; i++)
+		sum += mhash_key(entries[i]->path);
+	report("hash", n, n, timer_ns(&t), 0);
+
+	/* Spread lookups evenly over all entries */
+	ops = lookups && lookups < n ? lookups : n;
+	timer_start(&t);
+	for (i = 0; i < ops; i++)
+		sum += !!mentry_find(entries[i * (n / ops)]->path, mhash);
+	report("find_hit", n, ops, timer_ns(&t), 0);
+
+	timer_start(&t);
+	for (i = 0; i < ops; i++) {
+		snprintf(path, sizeof(path), "./missing/f%lu", i);
+		sum += !!mentry_find(path, mhash);
+	}
+	report("find_miss", n, ops, timer_ns(&t), 0);
+	sink = sum;
+}
+
+/* Benchmarks loading with given threads, which must match loaded */
+static void
+bench_fromfile_as(const char *name, unsigned threads,
+                  const struct metahash *loaded, char *buf, size_t size,
+                  unsigned long n)
+{
+	struct timer t;
+	struct metahash *mhash = NULL;
+	struct metaentry *a, *b;
+	int key;
+
+	mentries_threads(threads);
+	timer_start(&t);
+	mentries_frombuffer(&mhash, buf, size, "memory");
+	report(name, n, n, timer_ns(&t), size);
+
+	for (key = 0; mhash && key < HASH_INDEXES; key++) {
+		for (a = loaded->bucket[key], b = mhash->bucket[key]; a && b;
+		     a = a->next, b = b->next)
+			if (strcmp(a->path, b->path) ||
+			    mentry_compare(a, b, &settings))
+				break;
+		if (a || b)
+			break;
+	}
+	if (!mhash || key < HASH_INDEXES) {
+		fprintf(stderr, "microbench: %s loaded different entries\n",
+		        name);
+		exit(EXIT_FAILURE);
+	}
+
+	mentries_free(mhash);
+}
+
+/* Benchmarks mentries_tostream, mentries_frombuffer and mentry_compare */
+static void
+bench_file(struct metaentry **entries, struct metahash *mhash,
+           unsigned long n)
+{
+	struct timer t;
+	struct metahash *loaded = NULL, *loaded1 = NULL;
+	struct metaentry **lentries, *a, *b;
+	FILE *stream;
+	char *buf, *buf1;
+	size_t size, size1;
+	unsigned long i, sum = 0;
+
+	stream = memstream_open(&buf, &size);
+	timer_start(&t);
+	mentries_tostream(mhash, stream, 0);
+	fflush(stream);
+	report("tofile", n, n, timer_ns(&t), size);
+	fclose(stream);
+
+	mentries_threads(1);
+	timer_start(&t);
+	mentries_frombuffer(&loaded, buf, size, "memory");
+	report("fromfile", n, n, timer_ns(&t), size);
+
+	bench_fromfile_as("fromfile_mt", INSERT_THREADS, loaded, buf, size, n);
+
+	/* Checksummed files are sorted by path, so only entries must match */
+	stream = memstream_open(&buf1, &size1);
+	timer_start(&t);
+	mentries_tostream(mhash, stream, 1);
+	fflush(stream);
+	report("tofile_v1", n, n, timer_ns(&t), size1);
+	fclose(stream);
+
+	mentries_threads(1);
+	timer_start(&t);
+	mentries_frombuffer(&loaded1, buf1, size1, "memory");
+	report("fromfile_v1", n, n, timer_ns(&t), size1);
+	for (i = 0; loaded && loaded1 && i < HASH_INDEXES; i++) {
+		for (a = loaded->bucket[i]; a; a = a->next) {
+			b = mentry_find(a->path, loaded1);
+			if (!b || mentry_compare(a, b, &settings))
+				break;
+		}
+		if (a)
+			break;
+	}
+	if (!loaded || !loaded1 || i < HASH_INDEXES ||
+	    loaded1->count != loaded->count) {
+		fprintf(stderr, "microbench: fromfile_v1 loaded different "
+		        "entries\n");
+		exit(EXIT_FAILURE);
+	}
+
+	bench_fromfile_as("fromfile_v1_mt", INSERT_THREADS, loaded1, buf1,
+	                  size1, n);
+	mentries_free(loaded1);
+	free(buf1);
+
+	if (!loaded || loaded->count != n) {
+		fprintf(stderr, "microbench: loaded %u of %lu entries\n",
+		        loaded ? loaded->count : 0, n);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Loading reverses the order of entries within each bucket */
+	entries_collect(mhash, entries, false);
+	lentries = need(xmalloc(n * sizeof(struct metaentry *),
+	                        STATS_MEM_OTHER));
+	entries_collect(loaded, lentries, true);
+
+	timer_start(&t);
+	for (i = 0; i < n; i++)
+		sum += mentry_compare(entries[i], lentries[i], &settings);
+	report("compare", n, n, timer_ns(&t), 0);
+
+	if (sum) {
+		fprintf(stderr, "microbench: loaded entries differ\n");
+		exit(EXIT_FAILURE);
+	}
+
+	xfree(lentries);
+	mentries_free(loaded);
+	free(buf);
+}
+
+/* Runs all benchmarks on a dataset of n entries */
+static void
+bench_run(unsigned long n)
+{
+	struct timer t;
+	struct metahash *mhash;
+	struct metaentry **entries;
+	unsigned long i;
+
+	entries = need(xmalloc(n * sizeof(struct metaentry *),
+	                        STATS_MEM_OTHER));
+	for (i = 0; i < n; i++)
+		entries[i] = entry_generate(i);
+
+	bench_int(n);
+	bench_string(entries, n);
+
+	bench_insert_mt(entries, n);
+
+	mhash = need(mhash_alloc());
+	timer_start(&t);
+	for (i = 0; i < n; i++)
+		mentry_insert(entries[i], mhash);
+	report("insert", n, n, timer_ns(&t), 0);
+
+	bench_hash(entries, mhash, n);
+	bench_file(entries, mhash, n);
+
+	mentries_free(mhash);
+	xfree(entries);
+}
+
+/* Prints usage message and exits */
+static void
+usage(const char *arg0, int status)
+{
+	fprintf(status ? stderr : stdout,
+"Usage: %s [OPTION...] [ENTRIES...]\n"
+"\n"
+"Benchmarks metastore primitives on generated datasets of given sizes\n"
+"(10000 100000 1000000 by default) and reports ns/op and bytes/op.\n"
+"\n"
+"  -l, --lookups=N  Lookups done by find benchmarks, 0 for all (%lu)\n"
+"  -j, --json       Print results as JSON lines\n",
+	        arg0, lookups);
+	exit(status);
+}
+
+/* Options */
+static struct option long_options[] = {
+	{ "lookups", required_argument, NULL, 'l' },
+	{ "json",    no_argument,       NULL, 'j' },
+	{ "help",    no_argument,       NULL, 'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/* Main function */
+int
+main(int argc, char **argv)
+{
+	static const unsigned long defaults[] = { 10000, 100000, 1000000 };
+	unsigned long n;
+	unsigned i;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "l:jh",
+	                        long_options, NULL)) != -1) {
+		switch (c) {
+		case 'l': lookups = strtoul(optarg, NULL, 0);  break;
+		case 'j': json = true;                         break;
+		case 'h': usage(argv[0], EXIT_SUCCESS);        break;
+		default:  usage(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (!json)
+		printf("%-16s %10s %10s %12s %12s\n",
+		       "bench", "entries", "ops", "ns/op", "bytes/op");
+
+	if (optind == argc) {
+		for (i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++)
+			bench_run(defaults[i]);
+		return EXIT_SUCCESS;
+	}
+
+	for (; optind < argc; optind++) {
+		n = strtoul(argv[optind], NULL, 0);
+		if (!n)
+			usage(argv[0], EXIT_FAILURE);
+		bench_run(n);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,309 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Generator of reproducible synthetic file trees for benchmarking.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if !defined(NO_XATTR) || !(NO_XATTR+0)
+# include <sys/xattr.h>
+#endif /* !NO_XATTR */
+
+#ifndef PATH_MAX
+# define PATH_MAX 4096
+#endif
+
+/* Generator parameters */
+struct params {
+	unsigned depth;      /* levels of subdirectories */
+	unsigned fanout;     /* subdirectories per directory */
+	unsigned files;      /* files per directory */
+	unsigned xattrs;     /* xattrs per file */
+	unsigned xattrsize;  /* size of each xattr value */
+	unsigned hardlinks;  /* percentage of files being hardlinks */
+	unsigned owners;     /* number of distinct owners/groups to use */
+	unsigned perturb;    /* change every Nth file instead of creating */
+	uint64_t seed;       /* seed of the pseudo-random generator */
+};
+
+static struct params params = {
+	.depth = 3,
+	.fanout = 4,
+	.files = 32,
+	.xattrs = 0,
+	.xattrsize = 16,
+	.hardlinks = 0,
+	.owners = 1,
+	.perturb = 0,
+	.seed = 1,
+};
+
+/* Owners and groups to choose from */
+static uid_t *uids;
+static gid_t *gids;
+static unsigned nowners;
+
+/* Statistics of the generated tree */
+static unsigned long ndirs, nfiles, nlinks, nchanged;
+
+/* Path of the last created regular file, used as hardlink target */
+static char lastfile[PATH_MAX];
+
+/* Returns next pseudo-random number (xorshift64*) */
+static uint64_t
+rnd(void)
+{
+	params.seed ^= params.seed >> 12;
+	params.seed ^= params.seed << 25;
+	params.seed ^= params.seed >> 27;
+	return params.seed * 2685821657736338717ULL;
+}
+
+/* Exits with an error message about path */
+static void
+die(const char *what, const char *path)
+{
+	fprintf(stderr, "mktree: %s failed for %s: %s\n",
+	        what, path, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+/* Collects existing users and groups, so metastore can resolve them */
+static void
+collect_owners(void)
+{
+	struct passwd *pw;
+	struct group *gr;
+	unsigned n, have;
+
+	nowners = 1;
+	if (params.owners > 1 && geteuid() == 0)
+		nowners = params.owners;
+	else if (params.owners > 1)
+		fprintf(stderr, "mktree: not root, using a single owner\n");
+
+	uids = malloc(nowners * sizeof(uid_t));
+	gids = malloc(nowners * sizeof(gid_t));
+	if (!uids || !gids) {
+		fprintf(stderr, "mktree: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Reuse the first ones if there are not enough of them */
+	uids[0] = geteuid();
+	setpwent();
+	for (n = 1; n < nowners && (pw = getpwent()); n++)
+		uids[n] = pw->pw_uid;
+	endpwent();
+	for (have = n; n < nowners; n++)
+		uids[n] = uids[n % have];
+
+	gids[0] = getegid();
+	setgrent();
+	for (n = 1; n < nowners && (gr = getgrent()); n++)
+		gids[n] = gr->gr_gid;
+	endgrent();
+	for (have = n; n < nowners; n++)
+		gids[n] = gids[n % have];
+}
+
+/* Sets pseudo-random metadata of path */
+static void
+set_metadata(const char *path, bool dir)
+{
+	struct timespec times[2];
+	unsigned owner;
+#if !defined(NO_XATTR) || !(NO_XATTR+0)
+	char name[32];
+	char *value;
+	unsigned i, j;
+#endif /* !NO_XATTR */
+
+	if (chmod(path, (dir ? 0700 : 0600) | (rnd() % 2 ? 0044 : 0) |
+	                (rnd() % 4 ? 0 : 0011)))
+		die("chmod", path);
+
+	owner = rnd() % nowners;
+	if (nowners > 1 && lchown(path, uids[owner], gids[owner]))
+		die("lchown", path);
+
+#if !defined(NO_XATTR) || !(NO_XATTR+0)
+	if (!dir && params.xattrs) {
+		value = malloc(params.xattrsize + 1);
+		if (!value) {
+			fprintf(stderr, "mktree: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < params.xattrs; i++) {
+			for (j = 0; j < params.xattrsize; j++)
+				value[j] = 'a' + rnd() % 26;
+			snprintf(name, sizeof(name), "user.mktree%u", i);
+			if (lsetxattr(path, name, value, params.xattrsize, 0))
+				die("lsetxattr", path);
+		}
+		free(value);
+	}
+#endif /* !NO_XATTR */
+
+	times[0].tv_sec = times[1].tv_sec = 1000000000 + rnd() % 500000000;
+	times[0].tv_nsec = times[1].tv_nsec = rnd() % 1000000000;
+	if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW))
+		die("utimensat", path);
+}
+
+/* Creates (or perturbs) a single file */
+static void
+make_file(const char *path)
+{
+	int fd;
+
+	nfiles++;
+	if (params.perturb) {
+		if (nfiles % params.perturb)
+			return;
+		set_metadata(path, false);
+		nchanged++;
+		return;
+	}
+
+	if (*lastfile && rnd() % 100 < params.hardlinks) {
+		if (link(lastfile, path))
+			die("link", path);
+		nlinks++;
+		return;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		die("open", path);
+	close(fd);
+	set_metadata(path, false);
+	snprintf(lastfile, sizeof(lastfile), "%s", path);
+}
+
+/* Creates a directory with its files and subdirectories */
+static void
+make_dir(const char *path, unsigned depth)
+{
+	char tpath[PATH_MAX];
+	unsigned i;
+
+	ndirs++;
+	if (!params.perturb && mkdir(path, 0700) && errno != EEXIST)
+		die("mkdir", path);
+
+	for (i = 0; i < params.files; i++) {
+		snprintf(tpath, sizeof(tpath), "%s/f%06u", path, i);
+		make_file(tpath);
+	}
+
+	if (depth < params.depth) {
+		for (i = 0; i < params.fanout; i++) {
+			snprintf(tpath, sizeof(tpath), "%s/d%04u", path, i);
+			make_dir(tpath, depth + 1);
+		}
+	}
+
+	if (!params.perturb)
+		set_metadata(path, true);
+}
+
+/* Prints usage message and exits */
+static void
+usage(const char *arg0, int status)
+{
+	fprintf(status ? stderr : stdout,
+"Usage: %s [OPTION...] DIR\n"
+"\n"
+"Creates a reproducible synthetic file tree in DIR.\n"
+"\n"
+"  -D, --depth=N       Levels of subdirectories (%u)\n"
+"  -F, --fanout=N      Subdirectories per directory (%u)\n"
+"  -n, --files=N       Files per directory (%u)\n"
+"  -x, --xattrs=N      Xattrs per file (%u)\n"
+"  -S, --xattr-size=N  Size of each xattr value (%u)\n"
+"  -l, --hardlinks=P   Percentage of files being hardlinks (%u)\n"
+"  -o, --owners=N      Distinct owners and groups, needs root (%u)\n"
+"  -p, --perturb=N     Change metadata of every Nth file of existing tree\n"
+"  -s, --seed=N        Seed of the pseudo-random generator (%llu)\n",
+	        arg0, params.depth, params.fanout, params.files, params.xattrs,
+	        params.xattrsize, params.hardlinks, params.owners,
+	        (unsigned long long)params.seed);
+	exit(status);
+}
+
+/* Options */
+static struct option long_options[] = {
+	{ "depth",      required_argument, NULL, 'D' },
+	{ "fanout",     required_argument, NULL, 'F' },
+	{ "files",      required_argument, NULL, 'n' },
+	{ "xattrs",     required_argument, NULL, 'x' },
+	{ "xattr-size", required_argument, NULL, 'S' },
+	{ "hardlinks",  required_argument, NULL, 'l' },
+	{ "owners",     required_argument, NULL, 'o' },
+	{ "perturb",    required_argument, NULL, 'p' },
+	{ "seed",       required_argument, NULL, 's' },
+	{ "help",       no_argument,       NULL, 'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/* Main function */
+int
+main(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt_long(argc, argv, "D:F:n:x:S:l:o:p:s:h",
+	                        long_options, NULL)) != -1) {
+		switch (c) {
+		case 'D': params.depth = atoi(optarg);                  break;
+		case 'F': params.fanout = atoi(optarg);                 break;
+		case 'n': params.files = atoi(optarg);                  break;
+		case 'x': params.xattrs = atoi(optarg);                 break;
+		case 'S': params.xattrsize = atoi(optarg);              break;
+		case 'l': params.hardlinks = atoi(optarg);              break;
+		case 'o': params.owners = atoi(optarg);                 break;
+		case 'p': params.perturb = atoi(optarg);                break;
+		case 's': params.seed = strtoull(optarg, NULL, 0) | 1;  break;
+		case 'h': usage(argv[0], EXIT_SUCCESS);                 break;
+		default:  usage(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(argv[0], EXIT_FAILURE);
+
+	umask(0);
+	collect_owners();
+	make_dir(argv[optind], 0);
+
+	printf("{\"dirs\":%lu,\"files\":%lu,\"hardlinks\":%lu,\"changed\":%lu}\n",
+	       ndirs, nfiles, nlinks, nchanged);
+	return EXIT_SUCCESS;
+}
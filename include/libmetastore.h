@@ -0,0 +1,187 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Library interface to metastore metadata files and file trees.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * All functions are thread-safe, as long as a single handle is not used
+ * by multiple threads at the same time.  They never terminate the process
+ * nor print anything; failures (I/O errors, corrupt files, out of memory)
+ * are reported by returning NULL or -1 with errno set, and a description
+ * is available from metastore_last_error().  Problems with single files
+ * during a walk (e.g. permission denied) are skipped, leaving the last one
+ * in metastore_last_error().
+ */
+
+#ifndef LIBMETASTORE_H
+#define LIBMETASTORE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__) && __GNUC__ >= 4
+# define METASTORE_API __attribute__((visibility("default")))
+#else
+# define METASTORE_API
+#endif
+
+/* Flags selecting handled metadata fields and walk behaviour */
+#define METASTORE_OWNER       0x0001 /* owner names */
+#define METASTORE_GROUP       0x0002 /* group names */
+#define METASTORE_MODE        0x0004 /* permissions */
+#define METASTORE_MTIME       0x0008 /* modification times */
+#define METASTORE_XATTR       0x0010 /* extended attributes */
+#define METASTORE_FIELDS      0x001F /* all of the above */
+#define METASTORE_GIT         0x0100 /* walk into .git directories */
+#define METASTORE_CACHEDATTRS 0x0200 /* allow cached attributes (e.g. NFS) */
+
+/* Differences reported by metastore_compare */
+#define METASTORE_DIFF_OWNER 0x01
+#define METASTORE_DIFF_GROUP 0x02
+#define METASTORE_DIFF_MODE  0x04
+#define METASTORE_DIFF_TYPE  0x08
+#define METASTORE_DIFF_MTIME 0x10
+#define METASTORE_DIFF_XATTR 0x20
+#define METASTORE_DIFF_ADDED 0x40
+#define METASTORE_DIFF_DELE  0x80
+
+/* Metadata of a single file, directory, etc. */
+typedef struct metastore_entry metastore_entry;
+
+/* Set of entries, loaded from a metadata file or collected from a tree */
+typedef struct metastore_set metastore_set;
+
+/* Iterator over a set */
+typedef struct metastore_iter metastore_iter;
+
+/* Streaming reader of a metadata file, which does not load it whole */
+typedef struct metastore_reader metastore_reader;
+
+/* Streaming writer of a metadata file */
+typedef struct metastore_writer metastore_writer;
+
+/* Called for each walked entry, non-zero return value stops the walk */
+typedef int (*metastore_walk_cb)(const metastore_entry *entry, void *arg);
+
+/*
+ * Called for each compared pair of entries with METASTORE_DIFF_* bitmask
+ * of differences (real is NULL for deleted and stored for added entries)
+ */
+typedef void (*metastore_diff_cb)(const metastore_entry *real,
+                                  const metastore_entry *stored,
+                                  int diff, void *arg);
+
+/* Returns version of the library */
+METASTORE_API const char *metastore_version(void);
+
+/*
+ * Returns description of the last error or warning in the calling thread,
+ * or an empty string if there was none
+ */
+METASTORE_API const char *metastore_last_error(void);
+
+/* Entry accessors, returned strings are valid as long as the entry */
+METASTORE_API const char *metastore_entry_path(const metastore_entry *entry);
+METASTORE_API const char *metastore_entry_owner(const metastore_entry *entry);
+METASTORE_API const char *metastore_entry_group(const metastore_entry *entry);
+METASTORE_API mode_t metastore_entry_mode(const metastore_entry *entry);
+METASTORE_API time_t metastore_entry_mtime(const metastore_entry *entry,
+                                           long *nsec);
+METASTORE_API unsigned metastore_entry_xattrs(const metastore_entry *entry);
+METASTORE_API const char *metastore_entry_xattr(const metastore_entry *entry,
+                                                unsigned n,
+                                                const char **value,
+                                                size_t *len);
+
+/* Loads a metadata file into a new set */
+METASTORE_API metastore_set *metastore_open(const char *path);
+
+/* Collects metadata of the tree at path (with METASTORE_* flags) */
+METASTORE_API metastore_set *metastore_scan(const char *path, unsigned flags);
+
+/* Frees a set and all its entries */
+METASTORE_API void metastore_close(metastore_set *set);
+
+/* Returns number of entries in a set */
+METASTORE_API size_t metastore_count(const metastore_set *set);
+
+/* Finds the entry for path (e.g. "./dir/file"), returns NULL if absent */
+METASTORE_API const metastore_entry *metastore_lookup(const metastore_set *set,
+                                                      const char *path);
+
+/* Creates an iterator over all entries of a set, in unspecified order */
+METASTORE_API metastore_iter *metastore_iter_new(const metastore_set *set);
+
+/* Returns the next entry of an iterator, or NULL at the end */
+METASTORE_API const metastore_entry *metastore_iter_next(metastore_iter *iter);
+
+/* Frees an iterator */
+METASTORE_API void metastore_iter_free(metastore_iter *iter);
+
+/* Opens a metadata file for reading entries one by one */
+METASTORE_API metastore_reader *metastore_reader_open(const char *path);
+
+/*
+ * Returns the next entry of a reader, valid until the next call, or NULL
+ * at the end (with errno set to 0) or on failure
+ */
+METASTORE_API const metastore_entry *
+metastore_reader_next(metastore_reader *reader);
+
+/* Closes a reader */
+METASTORE_API void metastore_reader_close(metastore_reader *reader);
+
+/*
+ * Walks the tree at path (with METASTORE_* flags) and calls cb for each
+ * entry, which is valid only during the call
+ * - returns non-zero value returned by cb, 0 or -1 on failure
+ */
+METASTORE_API int metastore_walk(const char *path, unsigned flags,
+                                 metastore_walk_cb cb, void *arg);
+
+/*
+ * Compares real and stored sets (with METASTORE_* flags) and calls cb for
+ * each pair of entries
+ */
+METASTORE_API int metastore_compare(const metastore_set *real,
+                                    const metastore_set *stored,
+                                    unsigned flags,
+                                    metastore_diff_cb cb, void *arg);
+
+/* Creates a metadata file (of version 0) for writing entries one by one */
+METASTORE_API metastore_writer *metastore_writer_open(const char *path);
+
+/* Adds an entry to a metadata file */
+METASTORE_API int metastore_writer_add(metastore_writer *writer,
+                                       const metastore_entry *entry);
+
+/* Finishes writing of a metadata file, returns -1 if anything failed */
+METASTORE_API int metastore_writer_close(metastore_writer *writer);
+
+/*
+ * Stores all entries of a set to a metadata file, in the version of the
+ * file it replaces (checksummed or not)
+ */
+METASTORE_API int metastore_save(const metastore_set *set, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBMETASTORE_H */
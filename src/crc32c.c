@@ -0,0 +1,142 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * CRC-32C (Castagnoli) checksums.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Without CRC instructions, 8 bytes are processed at a time using 8
+ * tables (slicing-by-8), which are computed once on first use. Whether
+ * the CPU has SSE4.2 is checked at the same time, so the binary still
+ * runs on older x86 CPUs.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+# define HAVE_CRC32C_SSE42 1
+# include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+# define HAVE_CRC32C_ARM 1
+# include <arm_acle.h>
+#endif
+
+/* Reversed Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78
+
+static uint32_t crc32c_table[8][256];
+static bool crc32c_hw = false;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* Computes tables and checks for CRC instructions */
+static void
+crc32c_init(void)
+{
+	uint32_t crc;
+	unsigned i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+			    crc32c_table[0][crc32c_table[j - 1][i] & 0xFF];
+
+#ifdef HAVE_CRC32C_SSE42
+	crc32c_hw = __builtin_cpu_supports("sse4.2");
+#elif defined(HAVE_CRC32C_ARM)
+	crc32c_hw = true;
+#endif
+}
+
+/* Updates inverted crc with len bytes at p using tables */
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t word;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		/* Bytes are taken in memory order on any host */
+		word = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+		              (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+		crc = crc32c_table[7][word & 0xFF] ^
+		      crc32c_table[6][(word >> 8) & 0xFF] ^
+		      crc32c_table[5][(word >> 16) & 0xFF] ^
+		      crc32c_table[4][word >> 24] ^
+		      crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]] ^
+		      crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+	}
+	while (len--)
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+
+	return crc;
+}
+
+#ifdef HAVE_CRC32C_SSE42
+/* Updates inverted crc with len bytes at p using SSE4.2 */
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw_update(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t word, crc64 = crc;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&word, p, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = (uint32_t)crc64;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+#elif defined(HAVE_CRC32C_ARM)
+/* Updates inverted crc with len bytes at p using ARMv8 CRC instructions */
+static uint32_t
+crc32c_hw_update(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t word;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&word, p, 8);
+		crc = __crc32cd(crc, word);
+	}
+	while (len--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+#endif
+
+/* Updates crc with len bytes at buf */
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+
+	crc = ~crc;
+#if defined(HAVE_CRC32C_SSE42) || defined(HAVE_CRC32C_ARM)
+	if (crc32c_hw)
+		return ~crc32c_hw_update(crc, buf, len);
+#endif
+	return ~crc32c_sw(crc, buf, len);
+}
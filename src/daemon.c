@@ -0,0 +1,465 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Resident daemon keeping metadata in memory and its clients.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Protocol: client sends a single request line - action name ("compare",
+ * "save" or "dump") optionally followed by space-separated modifiers
+ * ("mtime", "real") - and the daemon answers with output of the action,
+ * a NUL byte and the exit status in decimal, then closes the connection.
+ */
+
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+#include "metastore.h"
+#include "watch.h"
+#include "utils.h"
+
+/* How long a client may take to send its request */
+#define REQUEST_TIMEOUT 5
+
+/* State of the daemon */
+struct mdaemon {
+	struct metasettings st;
+	struct mwatch *mwatch;
+	struct metahash *real;   /* live view of the tree */
+	struct metahash *stored; /* contents of st.metafile, NULL if invalid */
+	struct stat metastat;    /* st.metafile when stored was loaded */
+	bool rescan;             /* were changes lost? */
+};
+
+/* Set by signal handlers to stop serving */
+static volatile sig_atomic_t daemon_stop = 0;
+
+/* Stops the daemon on SIGINT and SIGTERM */
+static void
+daemon_signal(int sig)
+{
+	(void)sig;
+	daemon_stop = 1;
+}
+
+/*
+ * Inserts mentry into the live view, replacing the old one, and watches
+ * directories - for use in mentries_walk
+ */
+static int
+daemon_insert(struct metaentry *mentry, void *arg)
+{
+	struct mdaemon *d = arg;
+	bool isdir = S_ISDIR(mentry->mode);
+
+	mentry_free(mentry_remove(mentry->path, d->real));
+	mentry_insert(mentry, d->real);
+
+	/* Directory removed in the meantime is going to be reported later */
+	if (isdir && mwatch_add(d->mwatch, mentry->path) && errno != ENOENT)
+		return -1;
+	return 0;
+}
+
+/* Replaces the live view with a full scan of the tree */
+static int
+daemon_rescan(struct mdaemon *d)
+{
+	mentries_free(d->real);
+	d->real = mhash_alloc();
+	d->rescan = false;
+	if (!d->real)
+		return -1;
+
+	msg(MSG_DEBUG, "Scanning the whole tree\n");
+	return mentries_walk(".", &d->st, daemon_insert, d);
+}
+
+/* Updates the live view after a change of path - for use in mwatch_read */
+static void
+daemon_change(const char *path, unsigned flags, void *arg)
+{
+	struct mdaemon *d = arg;
+
+	/* Changes were lost, so everything has to be rescanned anyway */
+	if (!path)
+		d->rescan = true;
+	if (d->rescan)
+		return;
+
+	msg(MSG_DEBUG, "%s:\tchanged (0x%x)\n", path, flags);
+	mwatch_update(d->real, path, flags, &d->st, daemon_insert, d);
+}
+
+/* Applies all pending changes to the live view, returns -1 on failure */
+static int
+daemon_update(struct mdaemon *d)
+{
+	if (mwatch_read(d->mwatch, daemon_change, d) < 0)
+		return -1;
+	if (d->rescan && daemon_rescan(d))
+		return -1;
+	return 0;
+}
+
+/* (Re)loads stored metadata if the metadata file has changed */
+static void
+daemon_load(struct mdaemon *d)
+{
+	struct stat sbuf;
+
+	if (stat(d->st.metafile, &sbuf)) {
+		mentries_free(d->stored);
+		d->stored = NULL;
+		return;
+	}
+
+	if (d->stored &&
+	    sbuf.st_dev == d->metastat.st_dev &&
+	    sbuf.st_ino == d->metastat.st_ino &&
+	    sbuf.st_size == d->metastat.st_size &&
+	    sbuf.st_mtim.tv_sec == d->metastat.st_mtim.tv_sec &&
+	    sbuf.st_mtim.tv_nsec == d->metastat.st_mtim.tv_nsec &&
+	    sbuf.st_ctim.tv_sec == d->metastat.st_ctim.tv_sec &&
+	    sbuf.st_ctim.tv_nsec == d->metastat.st_ctim.tv_nsec)
+		return;
+
+	msg(MSG_DEBUG, "Loading %s\n", d->st.metafile);
+	mentries_free(d->stored);
+	d->stored = NULL;
+	if (mentries_fromfile(&d->stored, d->st.metafile)) {
+		mentries_free(d->stored);
+		d->stored = NULL;
+		return;
+	}
+	d->metastat = sbuf;
+}
+
+/* Reads a request line from fd, returns -1 on failure */
+static int
+daemon_read_request(int fd, char *buf, size_t size)
+{
+	size_t len = 0;
+	ssize_t ret;
+	char *end;
+
+	while (len < size - 1) {
+		ret = read(fd, buf + len, size - 1 - len);
+		if (ret <= 0)
+			break;
+		len += ret;
+		buf[len] = '\0';
+		end = strchr(buf, '\n');
+		if (end) {
+			*end = '\0';
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* Serves a single request of the client connected at fd */
+static void
+daemon_serve(struct mdaemon *d, int fd, daemon_action perform)
+{
+	struct metasettings st = d->st;
+	struct timeval timeout = { REQUEST_TIMEOUT, 0 };
+	char request[256];
+	char *word, *save;
+	int action = 0;
+	bool real = false;
+	int saved, ret;
+
+	/* A stalled client must not block the daemon in either direction */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	if (daemon_read_request(fd, request, sizeof(request))) {
+		msg(MSG_ERROR, "Failed to read request\n");
+		return;
+	}
+	msg(MSG_DEBUG, "Serving request %s\n", request);
+
+	for (word = strtok_r(request, " ", &save); word;
+	     word = strtok_r(NULL, " ", &save)) {
+		if (!strcmp(word, "compare") && !action)
+			action = ACTION_DIFF;
+		else if (!strcmp(word, "save") && !action)
+			action = ACTION_SAVE;
+		else if (!strcmp(word, "dump") && !action)
+			action = ACTION_DUMP;
+		else if (!strcmp(word, "mtime") && action)
+			st.do_mtime = true;
+		else if (!strcmp(word, "real") && action == ACTION_DUMP)
+			real = true;
+		else
+			action = -1;
+	}
+
+	ret = -1;
+	if (action <= 0) {
+		msg(MSG_ERROR, "Invalid request\n");
+		goto out;
+	}
+
+	if (daemon_update(d)) {
+		msg(MSG_ERROR, "Failed to update metadata of the tree\n");
+		goto out;
+	}
+
+	if (action == ACTION_DIFF || (action == ACTION_DUMP && !real)) {
+		daemon_load(d);
+		if (!d->stored) {
+			msg(MSG_CRITICAL, "Failed to load metadata from %s\n",
+			    st.metafile);
+			goto out;
+		}
+	}
+
+	/* Send all output of the action to the client */
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	if (saved < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+		msg(MSG_ERROR, "Failed to redirect output: %s\n",
+		    strerror(errno));
+		if (saved >= 0)
+			close(saved);
+		goto out;
+	}
+	ret = perform(action,
+	              action == ACTION_DUMP && !real ? NULL : d->real,
+	              d->stored, &st);
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+
+out:
+	dprintf(fd, "%c%d\n", '\0', ret ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/* Creates a listening socket at sockpath, returns -1 on failure */
+static int
+daemon_listen(const char *sockpath)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int fd, ret;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+		msg(MSG_CRITICAL, "Socket path %s is too long\n", sockpath);
+		return -1;
+	}
+	strcpy(addr.sun_path, sockpath);
+
+	/* Do not steal the socket of a running daemon */
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		goto err;
+	if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		msg(MSG_CRITICAL, "Daemon is already running at %s\n",
+		    sockpath);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	if (errno == ECONNREFUSED)
+		unlink(sockpath);
+
+	/* Only the owner may connect, whatever the umask is */
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		goto err;
+	mask = umask(0077);
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret || chmod(sockpath, 0600) || listen(fd, 16)) {
+		close(fd);
+		goto err;
+	}
+
+	return fd;
+
+err:
+	msg(MSG_CRITICAL, "Failed to listen on %s: %s\n",
+	    sockpath, strerror(errno));
+	return -1;
+}
+
+/*
+ * Keeps metadata of the tree and of st->metafile up to date in memory and
+ * serves requests on the UNIX socket sockpath until terminated by a signal
+ */
+int
+daemon_run(const char *sockpath, msettings *st, daemon_action perform)
+{
+	struct mdaemon d;
+	struct sigaction sa;
+	struct pollfd pfd[2];
+	int sfd, cfd;
+	int ret = -1;
+
+	memset(&d, 0, sizeof(d));
+	d.st = *st;
+	d.st.planfile = NULL;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	/* Listen first, so the socket is a part of the scanned tree */
+	sfd = daemon_listen(sockpath);
+	if (sfd < 0)
+		return -1;
+
+	d.mwatch = mwatch_open();
+	if (!d.mwatch || daemon_rescan(&d)) {
+		msg(MSG_CRITICAL,
+		    "Failed to load metadata from file system\n");
+		goto out;
+	}
+
+	daemon_load(&d);
+	msg(MSG_NORMAL, "Serving %u entries on %s\n", d.real->count, sockpath);
+	fflush(stdout);
+
+	pfd[0].fd = sfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = mwatch_fd(d.mwatch);
+	pfd[1].events = POLLIN;
+
+	while (!daemon_stop) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			msg(MSG_CRITICAL, "poll failed: %s\n", strerror(errno));
+			goto out;
+		}
+
+		if (pfd[1].revents && daemon_update(&d)) {
+			msg(MSG_CRITICAL,
+			    "Failed to update metadata of the tree\n");
+			goto out;
+		}
+
+		if (pfd[0].revents) {
+			cfd = accept(sfd, NULL, NULL);
+			if (cfd < 0)
+				continue;
+			daemon_serve(&d, cfd, perform);
+			close(cfd);
+		}
+	}
+	ret = 0;
+
+out:
+	close(sfd);
+	unlink(sockpath);
+	mwatch_close(d.mwatch);
+	mentries_free(d.real);
+	mentries_free(d.stored);
+	return ret;
+}
+
+/*
+ * Asks the daemon at sockpath to perform action and copies its output to
+ * stdout, returns exit status of the request or -1 if it failed
+ */
+int
+daemon_request(const char *sockpath, int action, bool mtime, bool real)
+{
+	struct sockaddr_un addr;
+	char request[64];
+	char buf[65536];
+	char status[16];
+	size_t slen = 0;
+	bool done = false;
+	ssize_t len;
+	char *end;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+		msg(MSG_CRITICAL, "Socket path %s is too long\n", sockpath);
+		return -1;
+	}
+	strcpy(addr.sun_path, sockpath);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		msg(MSG_CRITICAL, "Failed to connect to daemon at %s: %s\n",
+		    sockpath, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	snprintf(request, sizeof(request), "%s%s%s\n",
+	         action == ACTION_DIFF ? "compare" :
+	         action == ACTION_SAVE ? "save" : "dump",
+	         mtime ? " mtime" : "", real ? " real" : "");
+	len = strlen(request);
+	if (write(fd, request, len) != len) {
+		msg(MSG_CRITICAL, "Failed to send request to %s: %s\n",
+		    sockpath, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	/* Output is terminated by NUL followed by the exit status */
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		if (done) {
+			end = buf;
+		} else {
+			end = memchr(buf, '\0', len);
+			fwrite(buf, 1, end ? (size_t)(end - buf) : (size_t)len,
+			       stdout);
+			if (!end)
+				continue;
+			done = true;
+			end++;
+		}
+		while (end < buf + len && slen < sizeof(status) - 1)
+			status[slen++] = *end++;
+	}
+	close(fd);
+	fflush(stdout);
+	status[slen] = '\0';
+
+	if (len < 0 || !done || !slen) {
+		msg(MSG_CRITICAL, "Daemon at %s did not complete the request\n",
+		    sockpath);
+		return -1;
+	}
+
+	return atoi(status);
+}
@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Resident daemon keeping metadata in memory and its clients.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "settings.h"
+#include "metaentry.h"
+
+/*
+ * Performs action on real and stored metadata with settings st, printing
+ * results to stdout, returns -1 on failure
+ */
+typedef int (*daemon_action)(int action, struct metahash *real,
+                             struct metahash *stored, msettings *st);
+
+/*
+ * Keeps metadata of the tree at the current directory and of st->metafile
+ * up to date in memory and serves requests on the UNIX socket sockpath
+ * until terminated by a signal
+ * - returns -1 on failure
+ */
+int daemon_run(const char *sockpath, msettings *st, daemon_action perform);
+
+/*
+ * Asks the daemon at sockpath to perform action (with mtime or real view
+ * if requested) and copies its output to stdout
+ * - returns exit status of the request or -1 if the daemon is unreachable
+ */
+int daemon_request(const char *sockpath, int action, bool mtime, bool real);
+
+#endif /* DAEMON_H */
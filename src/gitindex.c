@@ -0,0 +1,393 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Paths tracked by git, read from the git index.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Index (see gitformat-index(5)) starts with "DIRC", version (2 to 4) and
+ * number of entries, all 32-bit big-endian, followed by sorted entries:
+ * - 40 bytes of stat data (ctime, mtime, dev, ino, mode, uid, gid, size)
+ * - object name (20 bytes for SHA-1, 32 for SHA-256)
+ * - 16-bit flags
+ * - since version 3, 16 more bits of flags if flags & 0x4000
+ * - version 2 and 3: path, NUL-padded to a multiple of 8 bytes
+ * - version 4: number of bytes to remove from the end of the previous
+ *   path (varint) and NUL-terminated string to append to it
+ * Extensions (signature, 32-bit size and data) and checksum follow, only
+ * the split index extension ("link") matters, as it leaves entries out.
+ */
+
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "gitindex.h"
+#include "metaentry.h"
+#include "utils.h"
+
+#ifndef PATH_MAX
+# define PATH_MAX 4096
+#endif
+
+#define INDEX_SIGNATURE   "DIRC"
+#define INDEX_HEADERLEN   12
+#define INDEX_STATLEN     40
+#define INDEX_EXTENDED    0x4000
+
+/* Tracked path */
+struct gitpath {
+	struct gitpath *next;
+	char path[];
+};
+
+/* Set of tracked paths */
+struct gitindex {
+	size_t mask;              /* number of buckets - 1 */
+	struct gitpath **paths;
+};
+
+/* Generates a hash key (using djb2) */
+static size_t
+gitindex_key(const char *path, size_t len)
+{
+	size_t hash = 5381;
+
+	while (len--)
+		hash = ((hash << 5) + hash) + (unsigned char)*path++;
+
+	return hash;
+}
+
+/* Finds the bucket entry for len bytes of path */
+static struct gitpath **
+gitindex_find(const struct gitindex *gi, const char *path, size_t len)
+{
+	struct gitpath **cur;
+
+	cur = &gi->paths[gitindex_key(path, len) & gi->mask];
+	for (; *cur; cur = &(*cur)->next)
+		if (!strncmp((*cur)->path, path, len) && !(*cur)->path[len])
+			break;
+
+	return cur;
+}
+
+/*
+ * Adds path (of the form "./name") and its parent directories
+ * - returns -1 if out of memory
+ */
+static int
+gitindex_add(struct gitindex *gi, const char *path)
+{
+	struct gitpath **cur;
+	size_t len = strlen(path);
+
+	/* Parents of a known path are known as well */
+	while (len > 1 && !*(cur = gitindex_find(gi, path, len))) {
+		*cur = xmalloc(sizeof(struct gitpath) + len + 1,
+		               STATS_MEM_HASH);
+		if (!*cur)
+			return -1;
+		memcpy((*cur)->path, path, len);
+		(*cur)->path[len] = '\0';
+		(*cur)->next = NULL;
+
+		while (path[--len] != '/')
+			;
+	}
+
+	return 0;
+}
+
+/* Reads 32-bit big-endian int */
+static uint32_t
+gitindex_int(const unsigned char *ptr)
+{
+	return (uint32_t)ptr[0] << 24 | (uint32_t)ptr[1] << 16 |
+	       (uint32_t)ptr[2] << 8 | ptr[3];
+}
+
+/*
+ * Finds git directory of the repository at the current directory
+ * - returns NULL (with a message) on failure
+ */
+static char *
+gitindex_gitdir(void)
+{
+	char buf[PATH_MAX + 8];
+	const char *env;
+	FILE *file;
+	size_t len;
+
+	env = getenv("GIT_DIR");
+	if (env)
+		return xstrdup(env, STATS_MEM_OTHER);
+
+	/* Worktrees and submodules have a file pointing to the directory */
+	file = fopen(".git", "r");
+	if (!file)
+		return xstrdup(".git", STATS_MEM_OTHER);
+	len = fread(buf, 1, sizeof(buf) - 1, file);
+	fclose(file);
+	buf[len] = '\0';
+
+	/* Reading .git directory either fails or returns nothing */
+	if (!len)
+		return xstrdup(".git", STATS_MEM_OTHER);
+	if (strncmp(buf, "gitdir: ", 8)) {
+		msg(MSG_CRITICAL, "Invalid .git file\n");
+		return NULL;
+	}
+	buf[strcspn(buf, "\r\n")] = '\0';
+	return xstrdup(buf + 8, STATS_MEM_OTHER);
+}
+
+/* Checks whether the repository in gitdir uses SHA-256 object names */
+static bool
+gitindex_sha256(const char *gitdir)
+{
+	char path[PATH_MAX], line[PATH_MAX];
+	bool sha256 = false;
+	FILE *file;
+	size_t len;
+	int ret;
+
+	/* Worktrees share config of the main repository */
+	snprintf(path, sizeof(path), "%s/commondir", gitdir);
+	file = fopen(path, "r");
+	if (file) {
+		len = fread(line, 1, sizeof(line) - 1, file);
+		fclose(file);
+		line[len] = '\0';
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '/')
+			ret = snprintf(path, sizeof(path), "%s/config", line);
+		else
+			ret = snprintf(path, sizeof(path), "%s/%s/config",
+			               gitdir, line);
+	} else {
+		ret = snprintf(path, sizeof(path), "%s/config", gitdir);
+	}
+
+	if (ret < 0 || (size_t)ret >= sizeof(path))
+		return false;
+	file = fopen(path, "r");
+	if (!file)
+		return false;
+	while (fgets(line, sizeof(line), file))
+		if (strstr(line, "objectformat") && strstr(line, "sha256"))
+			sha256 = true;
+	fclose(file);
+
+	return sha256;
+}
+
+/*
+ * Parses entries of the index in buf
+ * - returns -1 if invalid (EINVAL) or out of memory (ENOMEM)
+ */
+static int
+gitindex_parse(struct gitindex *gi, const unsigned char *buf, size_t size,
+               size_t hashlen)
+{
+	const unsigned char *ptr, *max = buf + size;
+	char path[PATH_MAX + 2] = "./";
+	uint32_t version, count, i;
+	size_t len, strip, namelen;
+	unsigned flags;
+	unsigned char c;
+
+	version = gitindex_int(buf + 4);
+	count = gitindex_int(buf + 8);
+
+	errno = EINVAL;
+	len = 2;
+	ptr = buf + INDEX_HEADERLEN;
+	for (i = 0; i < count; i++) {
+		const unsigned char *entry = ptr;
+
+		if ((size_t)(max - ptr) < INDEX_STATLEN + hashlen + 2)
+			return -1;
+		ptr += INDEX_STATLEN + hashlen;
+		flags = (unsigned)ptr[0] << 8 | ptr[1];
+		ptr += 2;
+		if (version >= 3 && flags & INDEX_EXTENDED) {
+			if (max - ptr < 2)
+				return -1;
+			ptr += 2;
+		}
+
+		if (version == 4) {
+			/* Offset encoding, as in git's decode_varint() */
+			if (ptr >= max)
+				return -1;
+			c = *ptr++;
+			strip = c & 0x7F;
+			while (c & 0x80) {
+				if (ptr >= max || strip > PATH_MAX)
+					return -1;
+				c = *ptr++;
+				strip = ((strip + 1) << 7) | (c & 0x7F);
+			}
+			if (strip > len - 2)
+				return -1;
+			len -= strip;
+		} else {
+			len = 2;
+		}
+
+		namelen = strnlen((const char *)ptr, max - ptr);
+		if (ptr + namelen >= max || len + namelen > PATH_MAX)
+			return -1;
+		memcpy(path + len, ptr, namelen);
+		len += namelen;
+		path[len] = '\0';
+		ptr += namelen + 1;
+
+		/* Entries of version 2 and 3 are padded to 8 bytes */
+		if (version < 4)
+			ptr = entry + ((ptr - entry + 7) & ~(size_t)7);
+
+		/* Directories of sparse index end with a slash */
+		if (len > 2 && path[len - 1] == '/')
+			path[--len] = '\0';
+		if (len > 2 && gitindex_add(gi, path))
+			return -1;
+	}
+
+	while ((size_t)(max - ptr) >= 8 + hashlen) {
+		/* Entries of split index are elsewhere */
+		if (!memcmp(ptr, "link", 4)) {
+			msg(MSG_CRITICAL, "Split git index is not supported\n");
+			return -1;
+		}
+		if (gitindex_int(ptr + 4) > (size_t)(max - ptr) - 8)
+			return -1;
+		ptr += 8 + gitindex_int(ptr + 4);
+	}
+
+	return 0;
+}
+
+/* Reads paths tracked in the git repository at the current directory */
+struct gitindex *
+gitindex_load(void)
+{
+	struct gitindex *gi = NULL;
+	char *gitdir = NULL, *buf = NULL;
+	char path[PATH_MAX];
+	const char *index;
+	size_t size, buckets;
+	uint32_t version, count;
+	int fd = -1;
+
+	/* Needed even with GIT_INDEX_FILE, to know the object name length */
+	gitdir = gitindex_gitdir();
+	if (!gitdir)
+		goto err;
+	index = getenv("GIT_INDEX_FILE");
+	if (!index) {
+		snprintf(path, sizeof(path), "%s/index", gitdir);
+		index = path;
+	}
+
+	buf = mfile_map(index, INDEX_HEADERLEN, &size, &fd);
+	if (!buf)
+		goto err;
+	if (memcmp(buf, INDEX_SIGNATURE, 4)) {
+		msg(MSG_CRITICAL, "%s is not a git index\n", index);
+		goto err;
+	}
+	version = gitindex_int((const unsigned char *)buf + 4);
+	if (version < 2 || version > 4) {
+		msg(MSG_CRITICAL, "Unsupported version %u of git index %s\n",
+		    (unsigned)version, index);
+		goto err;
+	}
+
+	/* Twice as many buckets as entries, to account for directories */
+	count = gitindex_int((const unsigned char *)buf + 8);
+	for (buckets = 64; buckets < (size_t)count * 2; buckets *= 2)
+		;
+
+	gi = xmalloc(sizeof(struct gitindex), STATS_MEM_HASH);
+	if (!gi)
+		goto nomem;
+	gi->mask = buckets - 1;
+	gi->paths = xmalloc(buckets * sizeof(struct gitpath *),
+	                    STATS_MEM_HASH);
+	if (!gi->paths) {
+		xfree(gi);
+		gi = NULL;
+		goto nomem;
+	}
+	memset(gi->paths, 0, buckets * sizeof(struct gitpath *));
+
+	if (gitindex_parse(gi, (const unsigned char *)buf, size,
+	                   gitindex_sha256(gitdir) ? 32 : 20)) {
+		if (errno == ENOMEM)
+			goto nomem;
+		msg(MSG_CRITICAL, "Corrupt git index %s\n", index);
+		goto err;
+	}
+
+	mfile_unmap(buf, size, fd);
+	xfree(gitdir);
+	return gi;
+
+nomem:
+	msg(MSG_CRITICAL, "Failed to read %s: %s\n", index, strerror(ENOMEM));
+err:
+	gitindex_free(gi);
+	if (buf)
+		mfile_unmap(buf, size, fd);
+	xfree(gitdir);
+	return NULL;
+}
+
+/* Frees a set of tracked paths */
+void
+gitindex_free(struct gitindex *gi)
+{
+	struct gitpath *cur, *next;
+	size_t i;
+
+	if (!gi)
+		return;
+
+	for (i = 0; i <= gi->mask; i++) {
+		for (cur = gi->paths[i]; cur; cur = next) {
+			next = cur->next;
+			xfree(cur);
+		}
+	}
+	xfree(gi->paths);
+	xfree(gi);
+}
+
+/* Checks whether path is tracked or contains tracked paths */
+bool
+gitindex_tracked(const struct gitindex *gi, const char *path)
+{
+	if (!strcmp(path, "."))
+		return true;
+
+	return *gitindex_find(gi, path, strlen(path)) != NULL;
+}
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Paths tracked by git, read from the git index.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GITINDEX_H
+#define GITINDEX_H
+
+#include <stdbool.h>
+
+/* Set of tracked paths, opaque */
+struct gitindex;
+
+/*
+ * Reads paths tracked in the git repository at the current directory
+ * (honouring GIT_DIR and GIT_INDEX_FILE) and their parent directories
+ * - returns NULL on failure
+ */
+struct gitindex *gitindex_load(void);
+
+/* Frees a set of tracked paths */
+void gitindex_free(struct gitindex *gi);
+
+/*
+ * Checks whether path (relative to the current directory and starting
+ * with ".", as produced by the walk) is tracked or contains tracked paths
+ */
+bool gitindex_tracked(const struct gitindex *gi, const char *path);
+
+#endif /* GITINDEX_H */
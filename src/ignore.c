@@ -0,0 +1,384 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Gitignore-style patterns of paths to skip.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Patterns are sorted by kind when added, so that a path is matched
+ * against most of them with a hash lookup instead of one by one:
+ * - literal names (e.g. "node_modules") and paths (e.g. "build/out")
+ * - literal suffixes (e.g. "*.o", "*.tar.gz")
+ * - everything else is a glob matched in turn, newest first, after a quick
+ *   check of its literal prefix (e.g. "lib" of "lib?.so")
+ * Later patterns take precedence, so the search stops at the first glob
+ * older than the best match found in the hash tables.
+ */
+
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "ignore.h"
+#include "stats.h"
+#include "utils.h"
+
+#ifndef PATH_MAX
+# define PATH_MAX 4096
+#endif
+
+#define IGNORE_INDEXES 256
+
+/* Pattern flags */
+#define PAT_NEGATE 0x01 /* pattern includes paths (starts with "!") */
+#define PAT_DIR    0x02 /* pattern only matches directories (ends with "/") */
+#define PAT_PATH   0x04 /* pattern matches the path, not the name */
+
+/* Compiled pattern */
+struct pattern {
+	struct pattern *next;
+	unsigned prio;           /* order in which patterns were added */
+	unsigned flags;
+	size_t prefix;           /* length of literal start of glob */
+	char glob[];
+};
+
+/* Compiled set of patterns, all lists are ordered newest first */
+struct mignore {
+	unsigned count;
+	struct pattern *names[IGNORE_INDEXES];
+	struct pattern *paths[IGNORE_INDEXES];
+	struct pattern *suffixes[IGNORE_INDEXES];
+	struct pattern *globs;
+};
+
+/* Generates a hash key (using djb2) */
+static unsigned
+mignore_key(const char *str)
+{
+	unsigned hash = 5381;
+	int c;
+
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + c;
+
+	return hash % IGNORE_INDEXES;
+}
+
+/* Creates an empty set of patterns */
+struct mignore *
+mignore_new(void)
+{
+	struct mignore *mi;
+
+	mi = xmalloc(sizeof(struct mignore), STATS_MEM_OTHER);
+	if (mi)
+		memset(mi, 0, sizeof(struct mignore));
+	return mi;
+}
+
+/* Frees a list of patterns */
+static void
+mignore_free_list(struct pattern *p)
+{
+	struct pattern *next;
+
+	for (; p; p = next) {
+		next = p->next;
+		xfree(p);
+	}
+}
+
+/* Frees a set of patterns */
+void
+mignore_free(struct mignore *mi)
+{
+	int i;
+
+	if (!mi)
+		return;
+
+	for (i = 0; i < IGNORE_INDEXES; i++) {
+		mignore_free_list(mi->names[i]);
+		mignore_free_list(mi->paths[i]);
+		mignore_free_list(mi->suffixes[i]);
+	}
+	mignore_free_list(mi->globs);
+	xfree(mi);
+}
+
+/* Adds pattern in gitignore syntax */
+int
+mignore_add(struct mignore *mi, const char *pattern, bool include)
+{
+	struct pattern *p, **list;
+	unsigned flags = include ? PAT_NEGATE : 0;
+	size_t len;
+
+	if (*pattern == '#')
+		return 0;
+	if (*pattern == '!') {
+		flags ^= PAT_NEGATE;
+		pattern++;
+	}
+
+	/* Trailing spaces are ignored unless escaped */
+	len = strlen(pattern);
+	while (len && pattern[len - 1] == ' ' &&
+	       !(len > 1 && pattern[len - 2] == '\\'))
+		len--;
+
+	if (len && pattern[len - 1] == '/') {
+		flags |= PAT_DIR;
+		len--;
+	}
+	if (memchr(pattern, '/', len))
+		flags |= PAT_PATH;
+	if (len && *pattern == '/') {
+		pattern++;
+		len--;
+	}
+	if (!len)
+		return 0;
+
+	p = xmalloc(sizeof(struct pattern) + len + 1, STATS_MEM_OTHER);
+	if (!p)
+		return -1;
+	memcpy(p->glob, pattern, len);
+	p->glob[len] = '\0';
+	p->prio = ++mi->count;
+	p->flags = flags;
+	p->prefix = strcspn(p->glob, "*?[\\");
+
+	if (!strpbrk(p->glob, "*?[\\")) {
+		list = flags & PAT_PATH ? &mi->paths[mignore_key(p->glob)]
+		                        : &mi->names[mignore_key(p->glob)];
+	} else if (p->glob[0] == '*' && p->glob[1] == '.' &&
+	           !strpbrk(p->glob + 1, "*?[\\/")) {
+		/* Only the literal suffix is needed */
+		memmove(p->glob, p->glob + 1, len);
+		list = &mi->suffixes[mignore_key(p->glob)];
+	} else {
+		list = &mi->globs;
+	}
+
+	p->next = *list;
+	*list = p;
+	return 0;
+}
+
+/* Adds patterns from file at path */
+int
+mignore_load(struct mignore *mi, const char *path)
+{
+	char line[PATH_MAX];
+	unsigned count = mi->count;
+	FILE *file;
+	int ret = 0;
+
+	file = fopen(path, "r");
+	if (!file) {
+		if (errno == ENOENT)
+			return 0;
+		msg(MSG_CRITICAL, "Failed to open %s: %s\n",
+		    path, strerror(errno));
+		return -1;
+	}
+
+	while (!ret && fgets(line, sizeof(line), file)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		ret = mignore_add(mi, line, false);
+	}
+
+	if (!ret && ferror(file)) {
+		msg(MSG_CRITICAL, "Failed to read %s\n", path);
+		ret = -1;
+	}
+	fclose(file);
+	return ret ? -1 : (int)(mi->count - count);
+}
+
+/*
+ * Matches character c against bracket expression at p (after "[")
+ * - returns pointer after the closing "]" or NULL if there is none
+ */
+static const char *
+glob_class(const char *p, char c, bool *match)
+{
+	bool negate = false, found = false, first = true;
+	unsigned char lo, hi;
+
+	if (*p == '!' || *p == '^') {
+		negate = true;
+		p++;
+	}
+
+	while (*p && (first || *p != ']')) {
+		first = false;
+		lo = *p++;
+		if (lo == '\\' && *p)
+			lo = *p++;
+		hi = lo;
+		if (*p == '-' && p[1] && p[1] != ']') {
+			hi = p[1];
+			p += 2;
+			if (hi == '\\' && *p)
+				hi = *p++;
+		}
+		if ((unsigned char)c >= lo && (unsigned char)c <= hi)
+			found = true;
+	}
+
+	if (!*p)
+		return NULL;
+	*match = found != negate;
+	return p + 1;
+}
+
+/* Matches string s against glob p, "*" does not match "/", "**" does */
+static bool
+glob_match(const char *p, const char *s)
+{
+	const char *next;
+	bool match;
+
+	for (; *p; p++, s++) {
+		switch (*p) {
+		case '*':
+			if (p[1] == '*') {
+				while (*p == '*')
+					p++;
+				if (!*p)
+					return true;
+				/* "**" followed by "/" matches any directories */
+				if (*p == '/') {
+					for (p++;; s++) {
+						if (glob_match(p, s))
+							return true;
+						s = strchr(s, '/');
+						if (!s)
+							return false;
+					}
+				}
+			} else {
+				p++;
+			}
+			for (;; s++) {
+				if (glob_match(p, s))
+					return true;
+				if (!*s || *s == '/')
+					return false;
+			}
+		case '?':
+			if (!*s || *s == '/')
+				return false;
+			break;
+		case '[':
+			next = glob_class(p + 1, *s, &match);
+			if (next) {
+				if (!*s || *s == '/' || !match)
+					return false;
+				p = next - 1;
+				break;
+			}
+			/* Unterminated bracket is an ordinary character */
+			if (*s != '[')
+				return false;
+			break;
+		case '\\':
+			if (p[1])
+				p++;
+			/* FALLTHROUGH */
+		default:
+			if (*p != *s)
+				return false;
+		}
+	}
+
+	return !*s;
+}
+
+/* Checks whether pattern p may match path of type as in mignore_excluded */
+static bool
+mignore_type(const struct pattern *p, const char *path, int *type)
+{
+	struct stat sbuf;
+
+	if (!(p->flags & PAT_DIR))
+		return true;
+
+	if (*type < 0) {
+		stats_count(STATS_LSTAT);
+		*type = !lstat(path, &sbuf) && S_ISDIR(sbuf.st_mode);
+	}
+	return *type == 1;
+}
+
+/* Finds the newest literal pattern equal to str in list */
+static const struct pattern *
+mignore_find(const struct pattern *p, const char *str, const char *path,
+             int *type)
+{
+	for (; p; p = p->next)
+		if (!strcmp(p->glob, str) && mignore_type(p, path, type))
+			return p;
+
+	return NULL;
+}
+
+/* Checks whether path is excluded by the patterns */
+bool
+mignore_excluded(const struct mignore *mi, const char *path, int type)
+{
+	const struct pattern *best, *p;
+	const char *rel, *name, *dot, *str;
+
+	/* Patterns are relative to the current directory */
+	if (!strcmp(path, "."))
+		return false;
+	rel = strncmp(path, "./", 2) ? path : path + 2;
+	name = strrchr(rel, '/');
+	name = name ? name + 1 : rel;
+
+	best = mignore_find(mi->names[mignore_key(name)], name, path, &type);
+
+	p = mignore_find(mi->paths[mignore_key(rel)], rel, path, &type);
+	if (p && (!best || p->prio > best->prio))
+		best = p;
+
+	for (dot = strchr(name, '.'); dot; dot = strchr(dot + 1, '.')) {
+		p = mignore_find(mi->suffixes[mignore_key(dot)], dot,
+		                 path, &type);
+		if (p && (!best || p->prio > best->prio))
+			best = p;
+	}
+
+	for (p = mi->globs; p && (!best || p->prio > best->prio); p = p->next) {
+		str = p->flags & PAT_PATH ? rel : name;
+		if (!strncmp(p->glob, str, p->prefix) &&
+		    glob_match(p->glob + p->prefix, str + p->prefix) &&
+		    mignore_type(p, path, &type)) {
+			best = p;
+			break;
+		}
+	}
+
+	return best && !(best->flags & PAT_NEGATE);
+}
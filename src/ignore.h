@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Gitignore-style patterns of paths to skip.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IGNORE_H
+#define IGNORE_H
+
+#include <stdbool.h>
+
+/* Default file with patterns, in the current directory */
+#define IGNOREFILE "./.metastoreignore"
+
+/* Compiled set of patterns, opaque */
+struct mignore;
+
+/* Creates an empty set of patterns, returns NULL if out of memory */
+struct mignore *mignore_new(void);
+
+/* Frees a set of patterns */
+void mignore_free(struct mignore *mi);
+
+/*
+ * Adds pattern in gitignore syntax (e.g. "build/", "*.o", "!keep.o"), which
+ * takes precedence over patterns added before
+ * - include negates the pattern, as if prefixed with "!"
+ * - returns -1 if out of memory
+ */
+int mignore_add(struct mignore *mi, const char *pattern, bool include);
+
+/*
+ * Adds patterns from file at path, one per line, a missing file is fine
+ * - returns number of patterns added or -1 on failure
+ */
+int mignore_load(struct mignore *mi, const char *path);
+
+/*
+ * Checks whether path (as produced by the walk, e.g. "./dir/name") is
+ * excluded by the patterns
+ * - type is 1 for a directory, 0 for anything else or -1 if unknown, in
+ *   which case path is only stat'ed if a directory-only pattern matches
+ */
+bool mignore_excluded(const struct mignore *mi, const char *path, int type);
+
+#endif /* IGNORE_H */
@@ -0,0 +1,666 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Journal of metadata changes made to a tree between runs.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Journal is a text file written by the watcher, one line per record:
+ * - "metastore journal PID ROOT" - header, PID of the watcher of tree ROOT
+ * - "FLAGS PATH" - change of PATH with MWATCH_* FLAGS (hexadecimal)
+ * - "overflow" - changes were lost, journal cannot be used until restarted
+ * - "sync" - all changes made before the watcher got SIGUSR1 are recorded
+ * - "base DEV INO SIZE SEC NSEC PID OFFSET" - appended by metastore after
+ *   saving the metadata file (identified by DEV to NSEC), which reflects
+ *   the tree up to OFFSET of the journal of the watcher PID
+ * The watcher holds an exclusive lock on the journal while it is running.
+ * Once told (by SIGUSR2) that a base was appended, it replaces the journal
+ * with one holding the header, that base (with OFFSET of itself) and the
+ * records after it, so the journal only grows with changes since the last
+ * save. Readers which synchronized with the old journal see that its inode
+ * changed and scan the whole tree instead.
+ */
+
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "journal.h"
+#include "watch.h"
+#include "utils.h"
+
+#ifndef PATH_MAX
+# define PATH_MAX 4096
+#endif
+
+#define JOURNAL_HEADER "metastore journal "
+
+/* How long to wait for the watcher to record pending changes */
+#define SYNC_TIMEOUT_MS 2000
+
+/* State of the watcher */
+struct jwatch {
+	int fd;               /* journal */
+	struct mwatch *mwatch;
+	msettings *st;
+	const char *path;
+	const char *name;     /* basename of the journal */
+	char tmp[PATH_MAX];   /* new journal while compacting */
+	const char *tmpname;  /* basename of tmp */
+	dev_t dev;            /* device and inode of the journal */
+	ino_t ino;
+	bool failed;          /* could not watch some directory? */
+};
+
+/* Self-pipe for waking the watcher up by signal handlers */
+static int jpipe[2] = { -1, -1 };
+
+/* Set by signal handlers to stop watching */
+static volatile sig_atomic_t jstop = 0;
+
+/* Watcher and journal which journal_sync has been synchronized with */
+static long synced_pid = 0;
+static dev_t synced_dev;
+static ino_t synced_ino;
+
+/*
+ * Requests sync on SIGUSR1, compaction on SIGUSR2 and stops on SIGINT and
+ * SIGTERM
+ */
+static void
+journal_signal(int sig)
+{
+	int err = errno;
+
+	if (sig != SIGUSR1 && sig != SIGUSR2)
+		jstop = 1;
+	/* Full pipe is fine, the watcher is going to wake up anyway */
+	if (write(jpipe[1], sig == SIGUSR1 ? "s" : sig == SIGUSR2 ? "c" : "q",
+	          1) < 0)
+		errno = err;
+	errno = err;
+}
+
+/* Appends a single record to the journal, returns -1 on failure */
+static int
+journal_write(int fd, const char *fmt, ...)
+{
+	char buf[PATH_MAX + 32];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (len < 0 || (size_t)len >= sizeof(buf)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	/* Single write, so records of concurrent writers do not interleave */
+	if (write(fd, buf, len) != len) {
+		msg(MSG_ERROR, "Failed to write to journal: %s\n",
+		    strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Reads the part of the journal at fd up to end, returns NULL on failure */
+static char *
+journal_read(int fd, off_t start, off_t end)
+{
+	char *buf;
+	ssize_t len;
+	off_t pos;
+
+	buf = xmalloc(end - start + 1, STATS_MEM_BUFFER);
+	if (!buf)
+		return NULL;
+
+	for (pos = start; pos < end; pos += len) {
+		len = pread(fd, buf + (pos - start), end - pos, pos);
+		if (len <= 0) {
+			xfree(buf);
+			return NULL;
+		}
+	}
+
+	buf[end - start] = '\0';
+	return buf;
+}
+
+/* Returns PID of the watcher in the header of the journal at fd, or 0 */
+static long
+journal_pid(int fd)
+{
+	char header[64];
+	ssize_t len;
+
+	len = pread(fd, header, sizeof(header) - 1, 0);
+	if (len < (ssize_t)strlen(JOURNAL_HEADER))
+		return 0;
+	header[len] = '\0';
+	if (strncmp(header, JOURNAL_HEADER, strlen(JOURNAL_HEADER)))
+		return 0;
+	return strtol(header + strlen(JOURNAL_HEADER), NULL, 10);
+}
+
+/*
+ * Reads the header of the journal at fd, returns it (ending with its
+ * newline) or NULL if it is invalid or out of memory
+ */
+static char *
+journal_header(int fd)
+{
+	char *buf, *end;
+	ssize_t len;
+
+	buf = xmalloc(PATH_MAX + 64, STATS_MEM_BUFFER);
+	if (!buf)
+		return NULL;
+	len = pread(fd, buf, PATH_MAX + 63, 0);
+	buf[len > 0 ? len : 0] = '\0';
+
+	end = strchr(buf, '\n');
+	if (!end || strncmp(buf, JOURNAL_HEADER, strlen(JOURNAL_HEADER))) {
+		xfree(buf);
+		return NULL;
+	}
+	end[1] = '\0';
+	return buf;
+}
+
+/* Watches directories - for use in mentries_walk */
+static int
+journal_add_watch(struct metaentry *mentry, void *arg)
+{
+	struct jwatch *j = arg;
+
+	if (S_ISDIR(mentry->mode) && mwatch_add(j->mwatch, mentry->path) &&
+	    errno != ENOENT)
+		j->failed = true;
+	mentry_free(mentry);
+	return 0;
+}
+
+/* Records a change of path - for use in mwatch_read */
+static void
+journal_event(const char *path, unsigned flags, void *arg)
+{
+	struct jwatch *j = arg;
+	struct stat sbuf;
+	const char *name;
+
+	/* Changes of paths which cannot be recorded are lost too */
+	if (!path || strchr(path, '\n')) {
+		journal_write(j->fd, "overflow\n");
+		return;
+	}
+
+	name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	if (!j->st->do_git && !strcmp(name, ".git"))
+		return;
+
+	/* Do not record own writes, nor the journal replaced by compaction */
+	if (!strcmp(name, j->name) && !lstat(path, &sbuf) &&
+	    sbuf.st_dev == j->dev && sbuf.st_ino == j->ino)
+		return;
+	if (!strcmp(name, j->tmpname))
+		return;
+
+	/* Watch new directories before recording them */
+	if (flags & MWATCH_DIR && flags & MWATCH_CREATED &&
+	    !lstat(path, &sbuf) && S_ISDIR(sbuf.st_mode)) {
+		mentries_walk(path, j->st, journal_add_watch, j);
+		if (j->failed) {
+			journal_write(j->fd, "overflow\n");
+			j->failed = false;
+		}
+	}
+
+	if (journal_write(j->fd, "%x %s\n", flags, path))
+		journal_write(j->fd, "overflow\n");
+}
+
+/*
+ * Replaces the journal with one holding only the header, the last base
+ * record (with OFFSET of itself) and the records after it
+ * - the new journal is locked before it is renamed into place
+ * - returns -1 on failure, the old journal is kept then
+ */
+static int
+journal_compact(struct jwatch *j)
+{
+	unsigned long long dev, ino, size, sec, nsec, offset;
+	char *header = NULL, *buf = NULL, *line, *next, *base = NULL, *to;
+	struct stat sbuf;
+	size_t hlen;
+	off_t end;
+	long bpid;
+	int fd = -1, ret = -1;
+
+	end = lseek(j->fd, 0, SEEK_END);
+	header = journal_header(j->fd);
+	if (end < 0 || !header)
+		goto out;
+	hlen = strlen(header);
+	if ((off_t)hlen >= end || !(buf = journal_read(j->fd, hlen, end)))
+		goto out;
+
+	for (line = buf; (next = strchr(line, '\n')); line = next + 1)
+		if (!strncmp(line, "base ", 5))
+			base = line;
+
+	/* Base of another watcher or already at the start is left alone */
+	ret = 0;
+	if (!base || sscanf(base, "base %llu %llu %llu %llu %llu %ld %llu",
+	                    &dev, &ino, &size, &sec, &nsec, &bpid,
+	                    &offset) != 7 ||
+	    bpid != (long)getpid() || offset <= hlen ||
+	    offset > (unsigned long long)end)
+		goto out;
+	ret = -1;
+
+	/* Records after the base are moved to the start, without bases */
+	to = buf;
+	for (line = buf + (offset - hlen); (next = strchr(line, '\n'));
+	     line = next + 1) {
+		if (strncmp(line, "base ", 5)) {
+			memmove(to, line, next + 1 - line);
+			to += next + 1 - line;
+		}
+	}
+
+	fd = open(j->tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+	if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) ||
+	    fstat(j->fd, &sbuf) || fchmod(fd, sbuf.st_mode & 07777) ||
+	    write(fd, header, hlen) != (ssize_t)hlen ||
+	    journal_write(fd, "base %llu %llu %llu %llu %llu %ld %llu\n",
+	                  dev, ino, size, sec, nsec, bpid,
+	                  (unsigned long long)hlen) ||
+	    write(fd, buf, to - buf) != to - buf ||
+	    fstat(fd, &sbuf) || rename(j->tmp, j->path)) {
+		if (fd >= 0)
+			unlink(j->tmp);
+		goto out;
+	}
+
+	close(j->fd);
+	j->fd = fd;
+	j->dev = sbuf.st_dev;
+	j->ino = sbuf.st_ino;
+	fd = -1;
+	ret = 0;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	xfree(header);
+	xfree(buf);
+	return ret;
+}
+
+/* Watches the tree and records its changes in the journal at path */
+int
+journal_watch(const char *path, msettings *st)
+{
+	struct jwatch j;
+	struct sigaction sa;
+	struct pollfd pfd[2];
+	struct stat sbuf;
+	char buf[64];
+	char *root = NULL;
+	bool sync, compact;
+	ssize_t len;
+	int ret = -1;
+
+	memset(&j, 0, sizeof(j));
+	j.st = st;
+	j.path = path;
+	j.name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	len = snprintf(j.tmp, sizeof(j.tmp), "%s.%ld.tmp", path,
+	               (long)getpid());
+	if (len < 0 || (size_t)len >= sizeof(j.tmp)) {
+		msg(MSG_CRITICAL, "Journal path %s is too long\n", path);
+		return -1;
+	}
+	j.tmpname = strrchr(j.tmp, '/') ? strrchr(j.tmp, '/') + 1 : j.tmp;
+
+	j.fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (j.fd < 0) {
+		msg(MSG_CRITICAL, "Failed to open %s: %s\n",
+		    path, strerror(errno));
+		return -1;
+	}
+
+	if (flock(j.fd, LOCK_EX | LOCK_NB)) {
+		msg(MSG_CRITICAL, "Journal %s is already being written\n", path);
+		close(j.fd);
+		return -1;
+	}
+
+	if (ftruncate(j.fd, 0) || fstat(j.fd, &sbuf)) {
+		msg(MSG_CRITICAL, "Failed to truncate %s: %s\n",
+		    path, strerror(errno));
+		close(j.fd);
+		return -1;
+	}
+	j.dev = sbuf.st_dev;
+	j.ino = sbuf.st_ino;
+
+	if (pipe(jpipe) ||
+	    fcntl(jpipe[0], F_SETFL, O_NONBLOCK) ||
+	    fcntl(jpipe[1], F_SETFL, O_NONBLOCK)) {
+		msg(MSG_CRITICAL, "Failed to create pipe: %s\n",
+		    strerror(errno));
+		goto out;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = journal_signal;
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	root = realpath(".", NULL);
+	j.mwatch = mwatch_open();
+	if (!root || !j.mwatch ||
+	    mentries_walk(".", st, journal_add_watch, &j) || j.failed) {
+		msg(MSG_CRITICAL, "Failed to watch the tree\n");
+		goto out;
+	}
+
+	/* Journal becomes usable with the header */
+	if (journal_write(j.fd, JOURNAL_HEADER "%ld %s\n", (long)getpid(),
+	                  root))
+		goto out;
+	msg(MSG_NORMAL, "Recording changes of %s in %s\n", root, path);
+	fflush(stdout);
+
+	pfd[0].fd = mwatch_fd(j.mwatch);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = jpipe[0];
+	pfd[1].events = POLLIN;
+
+	while (!jstop) {
+		if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+			msg(MSG_CRITICAL, "poll failed: %s\n", strerror(errno));
+			goto out;
+		}
+
+		sync = compact = false;
+		while ((len = read(jpipe[0], buf, sizeof(buf))) > 0) {
+			sync = sync || memchr(buf, 's', len);
+			compact = compact || memchr(buf, 'c', len);
+		}
+
+		/* Changes made before the signal are already queued */
+		if (mwatch_read(j.mwatch, journal_event, &j) < 0)
+			goto out;
+		if (sync && journal_write(j.fd, "sync\n"))
+			goto out;
+
+		/* Journal which is not compacted only keeps growing */
+		if (compact && journal_compact(&j))
+			msg(MSG_WARNING, "Failed to compact journal %s\n",
+			    path);
+	}
+	ret = 0;
+
+out:
+	mwatch_close(j.mwatch);
+	free(root);
+	if (jpipe[0] >= 0) {
+		close(jpipe[0]);
+		close(jpipe[1]);
+	}
+	close(j.fd);
+	return ret;
+}
+
+/* Makes the watcher record all changes, returns the size of journal then */
+off_t
+journal_sync(const char *path)
+{
+	struct timespec delay = { 0, 1000000 };
+	struct stat sbuf;
+	char *buf, *line;
+	off_t start, end;
+	long pid;
+	int fd, i;
+
+	synced_pid = 0;
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		msg(MSG_WARNING, "Failed to open journal %s: %s\n",
+		    path, strerror(errno));
+		return -1;
+	}
+
+	/* Watcher holds an exclusive lock while running */
+	if (!flock(fd, LOCK_SH | LOCK_NB)) {
+		msg(MSG_WARNING, "Journal %s is not being written\n", path);
+		goto err;
+	}
+
+	pid = journal_pid(fd);
+	start = lseek(fd, 0, SEEK_END);
+	if (!pid || start < 0 || fstat(fd, &sbuf) ||
+	    kill((pid_t)pid, SIGUSR1)) {
+		msg(MSG_WARNING, "Failed to notify writer of journal %s\n",
+		    path);
+		goto err;
+	}
+
+	/* Any sync record written after the signal will do */
+	for (i = 0; i < SYNC_TIMEOUT_MS; i++) {
+		end = lseek(fd, 0, SEEK_END);
+		buf = end > start ? journal_read(fd, start, end) : NULL;
+		for (line = buf; line && *line; line = strchr(line, '\n') + 1) {
+			if (!strncmp(line, "sync\n", 5)) {
+				end = start + (line - buf) + 5;
+				xfree(buf);
+				close(fd);
+				synced_pid = pid;
+				synced_dev = sbuf.st_dev;
+				synced_ino = sbuf.st_ino;
+				return end;
+			}
+			if (!strchr(line, '\n'))
+				break;
+		}
+		xfree(buf);
+		nanosleep(&delay, NULL);
+	}
+	msg(MSG_WARNING, "Writer of journal %s did not respond\n", path);
+
+err:
+	close(fd);
+	return -1;
+}
+
+/* Creates real metadata from the metadata file and the journal */
+int
+journal_replay(const char *path, off_t end, msettings *st,
+               struct metahash **real)
+{
+	unsigned long long dev, ino, size, sec, nsec, offset;
+	long pid, bpid;
+	struct stat sbuf;
+	char *header = NULL, *buf = NULL, *line, *base, *next, *root = NULL;
+	unsigned flags, changes = 0;
+	size_t hlen;
+	int fd;
+
+	*real = NULL;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		goto err;
+
+	/* Offset end is only valid in the journal which was synced */
+	if (fstat(fd, &sbuf) || sbuf.st_dev != synced_dev ||
+	    sbuf.st_ino != synced_ino) {
+		msg(MSG_WARNING, "Journal %s was compacted meanwhile\n", path);
+		goto err;
+	}
+
+	header = journal_header(fd);
+	pid = header ? strtol(header + strlen(JOURNAL_HEADER), NULL, 10) : 0;
+	line = pid ? strchr(header + strlen(JOURNAL_HEADER), ' ') : NULL;
+	next = header ? strchr(header, '\n') : NULL;
+	root = realpath(".", NULL);
+	if (!pid || !line || !next || !root ||
+	    (size_t)(next - line - 1) != strlen(root) ||
+	    strncmp(line + 1, root, strlen(root))) {
+		msg(MSG_WARNING, "Journal %s is not for this tree\n", path);
+		goto err;
+	}
+
+	/*
+	 * Records from the header on, which the watcher compacts to the last
+	 * base and changes since then after each save
+	 */
+	hlen = strlen(header);
+	if ((off_t)hlen >= end || !(buf = journal_read(fd, hlen, end)))
+		goto err;
+
+	/* Find the last saved metadata file */
+	base = NULL;
+	for (line = buf; *line; line = next + 1) {
+		next = strchr(line, '\n');
+		if (!next)
+			break;
+		if (!strncmp(line, "base ", 5))
+			base = line;
+	}
+
+	if (!base || sscanf(base, "base %llu %llu %llu %llu %llu %ld %llu",
+	                    &dev, &ino, &size, &sec, &nsec, &bpid,
+	                    &offset) != 7 ||
+	    bpid != pid || offset < hlen ||
+	    offset > (unsigned long long)end) {
+		msg(MSG_WARNING, "Journal %s has no saved metadata file\n",
+		    path);
+		goto err;
+	}
+	offset -= hlen;
+
+	if (stat(st->metafile, &sbuf) ||
+	    dev != (unsigned long long)sbuf.st_dev ||
+	    ino != (unsigned long long)sbuf.st_ino ||
+	    size != (unsigned long long)sbuf.st_size ||
+	    sec != (unsigned long long)sbuf.st_mtim.tv_sec ||
+	    nsec != (unsigned long long)sbuf.st_mtim.tv_nsec) {
+		msg(MSG_WARNING, "%s was not saved with journal %s\n",
+		    st->metafile, path);
+		goto err;
+	}
+
+	/* Journal ends with a sync record, so every line is complete */
+	for (line = buf + offset; *line; line = strchr(line, '\n') + 1) {
+		if (!strncmp(line, "overflow\n", 9)) {
+			msg(MSG_WARNING, "Journal %s has lost changes\n", path);
+			goto err;
+		}
+	}
+
+	if (mentries_fromfile(real, st->metafile))
+		goto err;
+
+	for (line = buf + offset; *line; line = next + 1) {
+		next = strchr(line, '\n');
+		*next = '\0';
+		flags = (unsigned)strtoul(line, &base, 16);
+		if (base == line || *base != ' ')
+			continue;
+		mwatch_update(*real, base + 1, flags, st, NULL, NULL);
+		changes++;
+	}
+
+	msg(MSG_DEBUG, "Replayed %u changes from journal %s\n", changes, path);
+	free(root);
+	xfree(header);
+	xfree(buf);
+	close(fd);
+	return 0;
+
+err:
+	mentries_free(*real);
+	*real = NULL;
+	free(root);
+	xfree(header);
+	xfree(buf);
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+/*
+ * Records that the metadata file reflects the tree up to offset end and
+ * has the watcher compact the journal
+ */
+int
+journal_base(const char *path, off_t end, msettings *st)
+{
+	struct stat sbuf;
+	int fd, ret;
+
+	fd = open(path, O_RDWR | O_APPEND);
+	if (fd < 0)
+		goto err;
+
+	/* Journal recreated or compacted since does not match offset end */
+	if (!synced_pid || journal_pid(fd) != synced_pid ||
+	    fstat(fd, &sbuf) || sbuf.st_dev != synced_dev ||
+	    sbuf.st_ino != synced_ino || stat(st->metafile, &sbuf)) {
+		close(fd);
+		goto err;
+	}
+
+	ret = journal_write(fd, "base %llu %llu %llu %llu %llu %ld %llu\n",
+	                    (unsigned long long)sbuf.st_dev,
+	                    (unsigned long long)sbuf.st_ino,
+	                    (unsigned long long)sbuf.st_size,
+	                    (unsigned long long)sbuf.st_mtim.tv_sec,
+	                    (unsigned long long)sbuf.st_mtim.tv_nsec,
+	                    synced_pid, (unsigned long long)end);
+	close(fd);
+	if (!ret) {
+		/* Journal which is not compacted is only longer */
+		kill((pid_t)synced_pid, SIGUSR2);
+		return 0;
+	}
+
+err:
+	msg(MSG_WARNING, "Failed to update journal %s\n", path);
+	return -1;
+}
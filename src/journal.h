@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Journal of metadata changes made to a tree between runs.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <sys/types.h>
+
+#include "settings.h"
+#include "metaentry.h"
+
+/*
+ * Watches the tree at the current directory and records its changes in the
+ * journal at path until terminated by a signal
+ * - returns -1 on failure
+ */
+int journal_watch(const char *path, msettings *st);
+
+/*
+ * Makes the watcher record all changes made so far
+ * - returns the size of the journal including them, or -1 if the journal
+ *   cannot be used (e.g. nothing is watching the tree)
+ */
+off_t journal_sync(const char *path);
+
+/*
+ * Creates real metadata from st->metafile and changes recorded in the
+ * journal at path up to offset end (as returned by journal_sync)
+ * - returns -1 if the journal cannot be used (e.g. the metadata file was
+ *   not saved with it or changes were lost), full scan is needed then
+ */
+int journal_replay(const char *path, off_t end, msettings *st,
+                   struct metahash **real);
+
+/*
+ * Records in the journal at path that st->metafile has been saved with
+ * metadata of the tree as of offset end (as returned by journal_sync)
+ * - the watcher then drops records before end from the journal
+ * - returns -1 on failure
+ */
+int journal_base(const char *path, off_t end, msettings *st);
+
+#endif /* JOURNAL_H */
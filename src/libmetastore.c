@@ -0,0 +1,422 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Library interface to metastore metadata files and file trees.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libmetastore.h"
+#include "metastore.h"
+#include "metaentry.h"
+#include "settings.h"
+#include "utils.h"
+
+/*
+ * Public handles are internal structures in disguise:
+ * - metastore_entry is struct metaentry
+ * - metastore_set is struct metahash
+ */
+#define ENTRY(e)  ((const struct metaentry *)(e))
+#define PENTRY(m) ((const metastore_entry *)(m))
+#define HASH(s)   ((struct metahash *)(s))
+#define PSET(h)   ((metastore_set *)(h))
+
+struct metastore_iter {
+	const struct metahash *mhash;
+	const struct metaentry *next;
+	int key;
+};
+
+struct metastore_reader {
+	char *path;
+	char *mmapstart;
+	size_t size;
+	int fd;
+	struct mcursor pos;
+	struct metaentry *cur;
+};
+
+struct metastore_writer {
+	FILE *to;
+};
+
+/* Makes internal error messages available via metastore_last_error() */
+static void __attribute__((constructor))
+library_init(void)
+{
+	msg_capture_errors();
+}
+
+/* Fills settings according to METASTORE_* flags */
+static void
+settings_init(struct metasettings *st, unsigned flags)
+{
+	memset(st, 0, sizeof(*st));
+	st->fields = flags & METASTORE_FIELDS;
+	st->do_mtime = flags & METASTORE_MTIME;
+	st->do_git = flags & METASTORE_GIT;
+	st->do_cachedattrs = flags & METASTORE_CACHEDATTRS;
+}
+
+/* Returns version of the library */
+const char *
+metastore_version(void)
+{
+	return METASTORE_VER;
+}
+
+/* Returns the last error message of the calling thread */
+const char *
+metastore_last_error(void)
+{
+	return msg_last_error();
+}
+
+const char *
+metastore_entry_path(const metastore_entry *entry)
+{
+	return ENTRY(entry)->path;
+}
+
+const char *
+metastore_entry_owner(const metastore_entry *entry)
+{
+	return ENTRY(entry)->owner;
+}
+
+const char *
+metastore_entry_group(const metastore_entry *entry)
+{
+	return ENTRY(entry)->group;
+}
+
+mode_t
+metastore_entry_mode(const metastore_entry *entry)
+{
+	return ENTRY(entry)->mode;
+}
+
+time_t
+metastore_entry_mtime(const metastore_entry *entry, long *nsec)
+{
+	if (nsec)
+		*nsec = ENTRY(entry)->mtimensec;
+	return ENTRY(entry)->mtime;
+}
+
+unsigned
+metastore_entry_xattrs(const metastore_entry *entry)
+{
+	return ENTRY(entry)->xattrs;
+}
+
+const char *
+metastore_entry_xattr(const metastore_entry *entry, unsigned n,
+                      const char **value, size_t *len)
+{
+	const struct metaentry *mentry = ENTRY(entry);
+
+	if (n >= mentry->xattrs) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (value)
+		*value = mentry->xattr_values[n];
+	if (len)
+		*len = mentry->xattr_lvalues[n];
+	return mentry->xattr_names[n];
+}
+
+/* Loads a metadata file into a new set */
+metastore_set *
+metastore_open(const char *path)
+{
+	struct metahash *mhash = NULL;
+	int err;
+
+	if (mentries_fromfile(&mhash, path)) {
+		err = errno;
+		mentries_free(mhash);
+		errno = err;
+		return NULL;
+	}
+
+	return PSET(mhash);
+}
+
+/* Inserts mentry into mhash given as arg - for use in mentries_walk */
+static int
+scan_insert(struct metaentry *mentry, void *arg)
+{
+	mentry_insert(mentry, arg);
+	return 0;
+}
+
+/* Collects metadata of the tree at path */
+metastore_set *
+metastore_scan(const char *path, unsigned flags)
+{
+	struct metasettings st;
+	struct metahash *mhash;
+	int err;
+
+	settings_init(&st, flags);
+	mhash = mhash_alloc();
+	if (!mhash)
+		return NULL;
+	if (mentries_walk(path, &st, scan_insert, mhash)) {
+		err = errno;
+		mentries_free(mhash);
+		errno = err;
+		return NULL;
+	}
+
+	return PSET(mhash);
+}
+
+/* Frees a set and all its entries */
+void
+metastore_close(metastore_set *set)
+{
+	mentries_free(HASH(set));
+}
+
+/* Returns number of entries in a set */
+size_t
+metastore_count(const metastore_set *set)
+{
+	return HASH(set)->count;
+}
+
+/* Finds the entry for path, returns NULL if absent */
+const metastore_entry *
+metastore_lookup(const metastore_set *set, const char *path)
+{
+	return PENTRY(mentry_find(path, HASH(set)));
+}
+
+/* Creates an iterator over all entries of a set */
+metastore_iter *
+metastore_iter_new(const metastore_set *set)
+{
+	metastore_iter *iter;
+
+	iter = xmalloc(sizeof(*iter), STATS_MEM_OTHER);
+	if (!iter)
+		return NULL;
+	iter->mhash = HASH(set);
+	iter->next = NULL;
+	iter->key = -1;
+	return iter;
+}
+
+/* Returns the next entry of an iterator, or NULL at the end */
+const metastore_entry *
+metastore_iter_next(metastore_iter *iter)
+{
+	const struct metaentry *mentry;
+
+	while (!iter->next) {
+		if (++iter->key >= HASH_INDEXES)
+			return NULL;
+		iter->next = iter->mhash->bucket[iter->key];
+	}
+
+	mentry = iter->next;
+	iter->next = mentry->next;
+	return PENTRY(mentry);
+}
+
+/* Frees an iterator */
+void
+metastore_iter_free(metastore_iter *iter)
+{
+	xfree(iter);
+}
+
+/* Opens a metadata file for reading entries one by one */
+metastore_reader *
+metastore_reader_open(const char *path)
+{
+	metastore_reader *reader;
+
+	reader = xmalloc(sizeof(*reader), STATS_MEM_OTHER);
+	if (!reader)
+		return NULL;
+	memset(reader, 0, sizeof(*reader));
+	reader->path = xstrdup(path, STATS_MEM_OTHER);
+	if (!reader->path)
+		goto err;
+	reader->mmapstart = mfile_map(path, SIGNATURELEN + VERSIONLEN,
+	                              &reader->size, &reader->fd);
+	if (!reader->mmapstart)
+		goto err;
+
+	if (mentries_header_read(&reader->pos, reader->mmapstart,
+	                         reader->size, reader->path))
+		goto err;
+
+	return reader;
+
+err:
+	metastore_reader_close(reader);
+	return NULL;
+}
+
+/* Returns the next entry of a reader, valid until the next call */
+const metastore_entry *
+metastore_reader_next(metastore_reader *reader)
+{
+	mentry_free(reader->cur);
+	reader->cur = mentries_next(&reader->pos);
+	return PENTRY(reader->cur);
+}
+
+/* Closes a reader */
+void
+metastore_reader_close(metastore_reader *reader)
+{
+	int err = errno;
+
+	if (!reader)
+		return;
+
+	mentry_free(reader->cur);
+	if (reader->mmapstart)
+		mfile_unmap(reader->mmapstart, reader->size, reader->fd);
+	xfree(reader->path);
+	xfree(reader);
+	errno = err;
+}
+
+/* State of metastore_walk */
+struct walk {
+	metastore_walk_cb cb;
+	void *arg;
+};
+
+/* Passes mentry to the user callback and frees it - for mentries_walk */
+static int
+walk_entry(struct metaentry *mentry, void *arg)
+{
+	struct walk *walk = arg;
+	int ret;
+
+	ret = walk->cb(PENTRY(mentry), walk->arg);
+	mentry_free(mentry);
+	return ret;
+}
+
+/* Walks the tree at path and calls cb for each entry */
+int
+metastore_walk(const char *path, unsigned flags, metastore_walk_cb cb,
+               void *arg)
+{
+	struct metasettings st;
+	struct walk walk = { cb, arg };
+
+	settings_init(&st, flags);
+	return mentries_walk(path, &st, walk_entry, &walk);
+}
+
+/* State of metastore_compare */
+struct diff {
+	metastore_diff_cb cb;
+	void *arg;
+};
+
+/* Passes compare result to the user callback - for mentries_compare */
+static void
+diff_entry(struct metaentry *real, struct metaentry *stored, int cmp,
+           void *arg)
+{
+	struct diff *diff = arg;
+
+	diff->cb(PENTRY(real), PENTRY(stored), cmp, diff->arg);
+}
+
+/* Compares real and stored sets and calls cb for each pair of entries */
+int
+metastore_compare(const metastore_set *real, const metastore_set *stored,
+                  unsigned flags, metastore_diff_cb cb, void *arg)
+{
+	struct metasettings st;
+	struct diff diff = { cb, arg };
+
+	if (!real || !stored || !cb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	settings_init(&st, flags);
+	mentries_compare(HASH(real), HASH(stored), diff_entry, &diff, &st);
+	return 0;
+}
+
+/* Creates a metadata file for writing entries one by one */
+metastore_writer *
+metastore_writer_open(const char *path)
+{
+	metastore_writer *writer;
+	FILE *to;
+
+	to = fopen(path, "w");
+	if (!to)
+		return NULL;
+
+	writer = xmalloc(sizeof(*writer), STATS_MEM_OTHER);
+	if (!writer) {
+		fclose(to);
+		errno = ENOMEM;
+		return NULL;
+	}
+	writer->to = to;
+	mentries_header_write(to, 0);
+	return writer;
+}
+
+/* Adds an entry to a metadata file */
+int
+metastore_writer_add(metastore_writer *writer, const metastore_entry *entry)
+{
+	mentry_tofile(ENTRY(entry), writer->to);
+	return ferror(writer->to) ? -1 : 0;
+}
+
+/* Finishes writing of a metadata file, returns -1 if anything failed */
+int
+metastore_writer_close(metastore_writer *writer)
+{
+	int ret;
+
+	ret = ferror(writer->to) ? -1 : 0;
+	if (fclose(writer->to))
+		ret = -1;
+	xfree(writer);
+	return ret;
+}
+
+/* Stores all entries of a set to a metadata file */
+int
+metastore_save(const metastore_set *set, const char *path)
+{
+	return mentries_tofile(HASH(set), path, -1);
+}
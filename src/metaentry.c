@@ -38,6 +38,11 @@
 #include <stdint.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
+
+#ifdef __linux__
+# include <sys/vfs.h>
+#endif
 
 #include <sys/param.h>
 #ifndef BSD
@@ -46,15 +51,31 @@
 
 #include "metastore.h"
 #include "metaentry.h"
+#include "crc32c.h"
+#include "sha256.h"
+#include "gitindex.h"
+#include "ignore.h"
+#include "stats.h"
 #include "utils.h"
 
 #ifndef PATH_MAX
 # define PATH_MAX 4096
 #endif
 
-#if !defined(NO_XATTR) || !(NO_XATTR+0)
+#if defined(STATX_TYPE) && defined(AT_STATX_DONT_SYNC)
+# define HAVE_STATX 1
+# include <sys/sysmacros.h>
+#endif
+
+#ifdef __linux__
+# include <sys/syscall.h>
+# ifdef SYS_getdents64
+#  define HAVE_GETDENTS64 1
+# endif
+#endif
+
 /* Free's a metaentry and all its parameters */
-static void
+void
 mentry_free(struct metaentry *m)
 {
 	unsigned i;
@@ -62,36 +83,78 @@ mentry_free(struct metaentry *m)
 	if (!m)
 		return;
 
-	free(m->path);
-	free(m->owner);
-	free(m->group);
+	xfree(m->path);
+	xfree(m->owner);
+	xfree(m->group);
 
 	for (i = 0; i < m->xattrs; i++) {
-		free(m->xattr_names[i]);
-		free(m->xattr_values[i]);
+		xfree(m->xattr_names[i]);
+		xfree(m->xattr_values[i]);
 	}
 
-	free(m->xattr_names);
-	free(m->xattr_values);
-	free(m->xattr_lvalues);
+	xfree(m->xattr_names);
+	xfree(m->xattr_values);
+	xfree(m->xattr_lvalues);
 
-	free(m);
+	xfree(m);
 }
-#endif /* !NO_XATTR */
 
 /* Allocates an empty metahash table */
-static struct metahash *
+struct metahash *
 mhash_alloc(void)
 {
 	struct metahash *mhash;
-	mhash = xmalloc(sizeof(struct metahash));
+	int key;
+
+	mhash = xmalloc(sizeof(struct metahash), STATS_MEM_HASH);
+	if (!mhash)
+		return NULL;
 	memset(mhash, 0, sizeof(struct metahash));
+	for (key = 0; key < HASH_INDEXES; key++)
+		pthread_mutex_init(&mhash->index[key].lock, NULL);
 	return mhash;
 }
 
-/* Generates a hash key (using djb2) */
+/* Free's a metahash table and all its entries */
+void
+mentries_free(struct metahash *mhash)
+{
+	struct metaentry *mentry, *next;
+	int key;
+
+	if (!mhash)
+		return;
+
+	for (key = 0; key < HASH_INDEXES; key++) {
+		for (mentry = mhash->bucket[key]; mentry; mentry = next) {
+			next = mentry->next;
+			mentry_free(mentry);
+		}
+	}
+
+	mhash_free(mhash);
+}
+
+/* Free's a metahash table, but not its entries */
+void
+mhash_free(struct metahash *mhash)
+{
+	int key;
+
+	if (!mhash)
+		return;
+
+	for (key = 0; key < HASH_INDEXES; key++) {
+		xfree(mhash->index[key].slots);
+		pthread_mutex_destroy(&mhash->index[key].lock);
+	}
+
+	xfree(mhash);
+}
+
+/* Generates a full hash of path (using djb2) */
 static unsigned
-hash(const char *str)
+mhash_hash(const char *str)
 {
 	unsigned hash = 5381;
 	int c;
@@ -99,7 +162,14 @@ hash(const char *str)
 	while ((c = *str++))
 		hash = ((hash << 5) + hash) + c;
 
-	return hash % HASH_INDEXES;
+	return hash;
+}
+
+/* Generates a hash key (bucket index) for path */
+unsigned
+mhash_key(const char *str)
+{
+	return mhash_hash(str) % HASH_INDEXES;
 }
 
 /* Allocates an empty metaentry */
@@ -107,41 +177,231 @@ static struct metaentry *
 mentry_alloc(void)
 {
 	struct metaentry *mentry;
-	mentry = xmalloc(sizeof(struct metaentry));
-	memset(mentry, 0, sizeof(struct metaentry));
+	mentry = xmalloc(sizeof(struct metaentry), STATS_MEM_ENTRY);
+	if (mentry)
+		memset(mentry, 0, sizeof(struct metaentry));
 	return mentry;
 }
 
-/* Does a bisect search for the closest match in a metaentry list */
-static struct metaentry *
+/*
+ * Allocates empty xattr arrays of an mentry without any xattrs
+ * - returns -1 on failure, mentry_free() releases what was allocated
+ */
+static int
+mentry_alloc_xattrs(struct metaentry *mentry, unsigned xattrs)
+{
+	mentry->xattr_names   = xmalloc(xattrs * sizeof(char *),
+	                                STATS_MEM_ENTRY);
+	mentry->xattr_lvalues = xmalloc(xattrs * sizeof(ssize_t),
+	                                STATS_MEM_ENTRY);
+	mentry->xattr_values  = xmalloc(xattrs * sizeof(char *),
+	                                STATS_MEM_ENTRY);
+	if (!mentry->xattr_names || !mentry->xattr_lvalues ||
+	    !mentry->xattr_values)
+		return -1;
+
+	memset(mentry->xattr_names, 0, xattrs * sizeof(char *));
+	memset(mentry->xattr_values, 0, xattrs * sizeof(char *));
+	mentry->xattrs = xattrs;
+	return 0;
+}
+
+/* Returns the first slot to probe for hash in index */
+static unsigned
+mindex_slot(const struct metaindex *index, unsigned hash)
+{
+	/* Lower bits of hash are the same for the whole bucket */
+	return (hash / HASH_INDEXES) & index->mask;
+}
+
+/* Puts mentry into a free slot of index, which has one */
+static void
+mindex_put(struct metaindex *index, struct metaentry *mentry)
+{
+	unsigned i;
+
+	for (i = mindex_slot(index, mentry->hash); index->slots[i];
+	     i = (i + 1) & index->mask)
+		;
+	index->slots[i] = mentry;
+}
+
+/*
+ * Adds mentry to index, growing it to keep it at most half full
+ * - if out of memory, the index is dropped and lookups search the chain
+ */
+static void
+mindex_add(struct metaindex *index, struct metaentry *mentry)
+{
+	struct metaindex grown;
+	unsigned i;
+
+	if (index->nomem)
+		return;
+
+	if (!index->slots || (index->count + 1) * 2 > index->mask + 1) {
+		grown.mask = index->slots ? index->mask * 2 + 1 : 7;
+		grown.slots = xmalloc((grown.mask + 1) *
+		                      sizeof(struct metaentry *),
+		                      STATS_MEM_HASH);
+		if (!grown.slots) {
+			xfree(index->slots);
+			index->slots = NULL;
+			index->mask = 0;
+			index->count = 0;
+			index->nomem = true;
+			return;
+		}
+		memset(grown.slots, 0,
+		       (grown.mask + 1) * sizeof(struct metaentry *));
+		for (i = 0; index->slots && i <= index->mask; i++)
+			if (index->slots[i])
+				mindex_put(&grown, index->slots[i]);
+		xfree(index->slots);
+		index->slots = grown.slots;
+		index->mask = grown.mask;
+	}
+
+	mindex_put(index, mentry);
+	index->count++;
+}
+
+/* Removes mentry from index, moving back entries probed past its slot */
+static void
+mindex_del(struct metaindex *index, const struct metaentry *mentry)
+{
+	unsigned i, j, k;
+
+	if (!index->slots)
+		return;
+
+	for (i = mindex_slot(index, mentry->hash); index->slots[i] != mentry;
+	     i = (i + 1) & index->mask)
+		if (!index->slots[i])
+			return;
+
+	index->slots[i] = NULL;
+	index->count--;
+	for (j = (i + 1) & index->mask; index->slots[j];
+	     j = (j + 1) & index->mask) {
+		/* Entries whose first slot is cyclically in (i, j] stay */
+		k = mindex_slot(index, index->slots[j]->hash);
+		if (i <= j ? i < k && k <= j : i < k || k <= j)
+			continue;
+		index->slots[i] = index->slots[j];
+		index->slots[j] = NULL;
+		i = j;
+	}
+}
+
+/*
+ * Finds the metaentry for path, probing the index of its bucket (or
+ * searching the chain if the index could not grow)
+ */
+struct metaentry *
 mentry_find(const char *path, struct metahash *mhash)
 {
+	const struct metaindex *index;
 	struct metaentry *base;
-	unsigned key;
+	unsigned hash, i;
 
 	if (!mhash) {
 		msg(MSG_ERROR, "%s called with empty hash table\n", __func__);
 		return NULL;
 	}
 
-	key = hash(path);
-	for (base = mhash->bucket[key]; base; base = base->next) {
-		if (!strcmp(base->path, path))
-			return base;
+	hash = mhash_hash(path);
+	index = &mhash->index[hash % HASH_INDEXES];
+	if (!index->slots) {
+		for (base = mhash->bucket[hash % HASH_INDEXES]; base;
+		     base = base->next)
+			if (base->hash == hash && !strcmp(base->path, path))
+				return base;
+		return NULL;
 	}
 
+	for (i = mindex_slot(index, hash); (base = index->slots[i]);
+	     i = (i + 1) & index->mask)
+		if (base->hash == hash && !strcmp(base->path, path))
+			return base;
+
 	return NULL;
 }
 
-/* Inserts a metaentry into a metaentry list */
+/* Inserts a metaentry with its hash already set into a metaentry list */
 static void
-mentry_insert(struct metaentry *mentry, struct metahash *mhash)
+mentry_insert_hashed(struct metaentry *mentry, struct metahash *mhash)
 {
+	struct metaindex *index;
 	unsigned key;
 
-	key = hash(mentry->path);
+	key = mentry->hash % HASH_INDEXES;
+	index = &mhash->index[key];
+
+	pthread_mutex_lock(&index->lock);
 	mentry->next = mhash->bucket[key];
 	mhash->bucket[key] = mentry;
+	mindex_add(index, mentry);
+	pthread_mutex_unlock(&index->lock);
+
+	__atomic_fetch_add(&mhash->count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Inserts a metaentry into a metaentry list
+ * - only the bucket of the entry is locked, so threads inserting at once
+ *   rarely wait for each other
+ */
+void
+mentry_insert(struct metaentry *mentry, struct metahash *mhash)
+{
+	mentry->hash = mhash_hash(mentry->path);
+	mentry_insert_hashed(mentry, mhash);
+}
+
+/* Removes the metaentry for path from mhash, returns it or NULL if absent */
+struct metaentry *
+mentry_remove(const char *path, struct metahash *mhash)
+{
+	struct metaentry **parent, *mentry;
+	unsigned hash = mhash_hash(path);
+
+	parent = &mhash->bucket[hash % HASH_INDEXES];
+	for (; *parent; parent = &(*parent)->next) {
+		if ((*parent)->hash != hash || strcmp((*parent)->path, path))
+			continue;
+		mentry = *parent;
+		*parent = mentry->next;
+		mentry->next = NULL;
+		mindex_del(&mhash->index[hash % HASH_INDEXES], mentry);
+		mhash->count--;
+		return mentry;
+	}
+
+	return NULL;
+}
+
+/* Removes and frees all metaentries below the directory path in mhash */
+void
+mentries_remove_tree(const char *path, struct metahash *mhash)
+{
+	struct metaentry **parent, *mentry;
+	size_t len = strlen(path);
+	int key;
+
+	for (key = 0; key < HASH_INDEXES; key++) {
+		for (parent = &mhash->bucket[key]; (mentry = *parent);) {
+			if (mentry->pathlen <= len || mentry->path[len] != '/' ||
+			    strncmp(mentry->path, path, len)) {
+				parent = &mentry->next;
+				continue;
+			}
+			*parent = mentry->next;
+			mindex_del(&mhash->index[key], mentry);
+			mhash->count--;
+			mentry_free(mentry);
+		}
+	}
 }
 
 #ifdef DEBUG
@@ -191,15 +451,165 @@ mentries_print(const struct metahash *mhash)
 }
 #endif
 
-/* Creates a metaentry for the file/dir/etc at path */
-struct metaentry *
-mentry_create(const char *path)
+/*
+ * Stats path without following symlinks, using statx with a minimal mask
+ * where it is available, so network filesystems transfer less attributes
+ * and may even use cached ones (if allowed in settings)
+ */
+static int
+mentry_lstat(const char *path, struct stat *sbuf, msettings *st)
+{
+#ifdef HAVE_STATX
+	static bool nostatx = false; /* Accessed atomically */
+	struct statx stx;
+	unsigned mask;
+	int flags;
+
+	stats_count(STATS_LSTAT);
+	if (__atomic_load_n(&nostatx, __ATOMIC_RELAXED))
+		return lstat(path, sbuf);
+
+	mask = STATX_TYPE | STATX_MODE | STATX_MTIME | STATX_CTIME |
+	       STATX_INO | STATX_NLINK;
+	if (st->fields & FIELD_OWNER)
+		mask |= STATX_UID;
+	if (st->fields & FIELD_GROUP)
+		mask |= STATX_GID;
+
+	flags = AT_SYMLINK_NOFOLLOW;
+	if (st->do_cachedattrs)
+		flags |= AT_STATX_DONT_SYNC;
+
+	if (statx(AT_FDCWD, path, flags, mask, &stx)) {
+		/* Kernel (or seccomp filter) without statx support */
+		if (errno != ENOSYS && errno != EPERM)
+			return -1;
+		__atomic_store_n(&nostatx, true, __ATOMIC_RELAXED);
+		return lstat(path, sbuf);
+	}
+
+	/* Filesystem was unable to provide everything we asked for */
+	if ((stx.stx_mask & mask) != mask)
+		return lstat(path, sbuf);
+
+	memset(sbuf, 0, sizeof(*sbuf));
+	sbuf->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	sbuf->st_ino = stx.stx_ino;
+	sbuf->st_nlink = stx.stx_nlink;
+	sbuf->st_mode = stx.stx_mode;
+	sbuf->st_uid = stx.stx_uid;
+	sbuf->st_gid = stx.stx_gid;
+	sbuf->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+	sbuf->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	sbuf->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+	sbuf->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+	return 0;
+#else
+	(void)st;
+	stats_count(STATS_LSTAT);
+	return lstat(path, sbuf);
+#endif /* HAVE_STATX */
+}
+
+/* Reusable buffers for reading xattrs, big enough for typical ones */
+struct xattrbuf {
+	char  *list;
+	size_t listsize;
+	char  *value;
+	size_t valuesize;
+};
+
+#define XATTRBUF_SIZE 4096
+
+/* Frees buffers for reading xattrs */
+static void
+xattrbuf_free(struct xattrbuf *xbuf)
+{
+	xfree(xbuf->list);
+	xfree(xbuf->value);
+	memset(xbuf, 0, sizeof(*xbuf));
+}
+
+#if !defined(NO_XATTR) || !(NO_XATTR+0)
+/* Makes sure that buffer can hold at least size bytes, returns -1 if not */
+static int
+xattrbuf_reserve(char **buf, size_t *bufsize, size_t size)
+{
+	if (size < XATTRBUF_SIZE)
+		size = XATTRBUF_SIZE;
+	if (*buf && *bufsize >= size)
+		return 0;
+
+	xfree(*buf);
+	*buf = xmalloc(size, STATS_MEM_BUFFER);
+	*bufsize = *buf ? size : 0;
+	return *buf ? 0 : -1;
+}
+
+/*
+ * Lists xattrs of path into xbuf->list, asking for the needed size only
+ * when the buffer turns out to be too small
+ */
+static ssize_t
+xattrbuf_list(const char *path, struct xattrbuf *xbuf)
+{
+	ssize_t size;
+
+	if (xattrbuf_reserve(&xbuf->list, &xbuf->listsize, 0))
+		return -1;
+	stats_count(STATS_LISTXATTR);
+	while ((size = listxattr(path, xbuf->list, xbuf->listsize)) < 0) {
+		if (errno != ERANGE)
+			return size;
+		stats_count(STATS_LISTXATTR);
+		size = listxattr(path, NULL, 0);
+		if (size < 0)
+			return size;
+		if (xattrbuf_reserve(&xbuf->list, &xbuf->listsize, size))
+			return -1;
+		stats_count(STATS_LISTXATTR);
+	}
+
+	return size;
+}
+
+/*
+ * Reads value of xattr name of path into xbuf->value, asking for the needed
+ * size only when the buffer turns out to be too small
+ */
+static ssize_t
+xattrbuf_get(const char *path, const char *name, struct xattrbuf *xbuf)
+{
+	ssize_t size;
+
+	if (xattrbuf_reserve(&xbuf->value, &xbuf->valuesize, 0))
+		return -1;
+	stats_count(STATS_GETXATTR);
+	while ((size = getxattr(path, name, xbuf->value, xbuf->valuesize)) < 0) {
+		if (errno != ERANGE)
+			return size;
+		stats_count(STATS_GETXATTR);
+		size = getxattr(path, name, NULL, 0);
+		if (size < 0)
+			return size;
+		if (xattrbuf_reserve(&xbuf->value, &xbuf->valuesize, size))
+			return -1;
+		stats_count(STATS_GETXATTR);
+	}
+
+	return size;
+}
+#endif /* !NO_XATTR */
+
+/* Creates a metaentry for the file/dir/etc at path described by sbuf */
+static struct metaentry *
+mentry_create_stat(const char *path, const struct stat *sbuf, msettings *st,
+                   struct xattrbuf *xbuf)
 {
 #if !defined(NO_XATTR) || !(NO_XATTR+0)
 	ssize_t lsize, vsize;
 	char *list, *attr;
 #endif /* !NO_XATTR */
-	struct stat sbuf;
 	struct passwd *pbuf;
 	struct group *gbuf;
 #if !defined(NO_XATTR) || !(NO_XATTR+0)
@@ -207,59 +617,62 @@ mentry_create(const char *path)
 #endif /* !NO_XATTR */
 	struct metaentry *mentry;
 
-	if (lstat(path, &sbuf)) {
-		msg(MSG_ERROR, "lstat failed for %s: %s\n",
-		    path, strerror(errno));
-		return NULL;
-	}
-
-	pbuf = xgetpwuid(sbuf.st_uid);
-	if (!pbuf) {
-		msg(MSG_ERROR, "getpwuid failed for %s: uid %i not found\n",
-		    path, (int)sbuf.st_uid);
-		return NULL;
+	pbuf = NULL;
+	if (st->fields & FIELD_OWNER) {
+		pbuf = xgetpwuid(sbuf->st_uid);
+		if (!pbuf) {
+			msg(MSG_ERROR, "getpwuid failed for %s: uid %i not found\n",
+			    path, (int)sbuf->st_uid);
+			return NULL;
+		}
 	}
 
-	gbuf = xgetgrgid(sbuf.st_gid);
-	if (!gbuf) {
-		msg(MSG_ERROR, "getgrgid failed for %s: gid %i not found\n",
-		    path, (int)sbuf.st_gid);
-		return NULL;
+	gbuf = NULL;
+	if (st->fields & FIELD_GROUP) {
+		gbuf = xgetgrgid(sbuf->st_gid);
+		if (!gbuf) {
+			msg(MSG_ERROR, "getgrgid failed for %s: gid %i not found\n",
+			    path, (int)sbuf->st_gid);
+			return NULL;
+		}
 	}
 
 	mentry = mentry_alloc();
-	mentry->path = xstrdup(path);
+	if (!mentry)
+		return NULL;
+	mentry->path = xstrdup(path, STATS_MEM_PATH);
+	if (!mentry->path)
+		goto nomem;
 	mentry->pathlen = strlen(mentry->path);
-	mentry->owner = xstrdup(pbuf->pw_name);
-	mentry->group = xstrdup(gbuf->gr_name);
-	mentry->mode = sbuf.st_mode & 0177777;
-	mentry->mtime = sbuf.st_mtim.tv_sec;
-	mentry->mtimensec = sbuf.st_mtim.tv_nsec;
+	if (pbuf && !(mentry->owner = xstrdup(pbuf->pw_name, STATS_MEM_NAME)))
+		goto nomem;
+	if (gbuf && !(mentry->group = xstrdup(gbuf->gr_name, STATS_MEM_NAME)))
+		goto nomem;
+	mentry->mode = sbuf->st_mode & 0177777;
+	mentry->mtime = sbuf->st_mtim.tv_sec;
+	mentry->mtimensec = sbuf->st_mtim.tv_nsec;
+	mentry->ctime = sbuf->st_ctim.tv_sec;
+	mentry->ctimensec = sbuf->st_ctim.tv_nsec;
 
 	/* symlinks have no xattrs */
-	if (S_ISLNK(mentry->mode))
+	if (S_ISLNK(mentry->mode) || !(st->fields & FIELD_XATTR))
 		return mentry;
 
 #if !defined(NO_XATTR) || !(NO_XATTR+0)
-	lsize = listxattr(path, NULL, 0);
+	lsize = xattrbuf_list(path, xbuf);
 	if (lsize < 0) {
 		/* Perhaps the FS doesn't support xattrs? */
 		if (errno == ENOTSUP)
 			return mentry;
+		if (errno == ENOMEM)
+			goto nomem;
 
 		msg(MSG_ERROR, "listxattr failed for %s: %s\n",
 		    path, strerror(errno));
+		mentry_free(mentry);
 		return NULL;
 	}
-
-	list = xmalloc(lsize);
-	lsize = listxattr(path, list, lsize);
-	if (lsize < 0) {
-		msg(MSG_ERROR, "listxattr failed for %s: %s\n",
-		    path, strerror(errno));
-		free(list);
-		return NULL;
-	}
+	list = xbuf->list;
 
 	i = 0;
 	for (attr = list; attr < list + lsize; attr = strchr(attr, '\0') + 1) {
@@ -271,48 +684,121 @@ mentry_create(const char *path)
 	if (i == 0)
 		return mentry;
 
-	mentry->xattrs = i;
-	mentry->xattr_names = xmalloc(i * sizeof(char *));
-	mentry->xattr_values = xmalloc(i * sizeof(char *));
-	mentry->xattr_lvalues = xmalloc(i * sizeof(ssize_t));
+	if (mentry_alloc_xattrs(mentry, i))
+		goto nomem;
 
 	i = 0;
 	for (attr = list; attr < list + lsize; attr = strchr(attr, '\0') + 1) {
 		if (*attr == '\0')
 			continue;
 
-		mentry->xattr_names[i] = xstrdup(attr);
-		mentry->xattr_values[i] = NULL;
+		mentry->xattr_names[i] = xstrdup(attr, STATS_MEM_XNAME);
+		if (!mentry->xattr_names[i])
+			goto nomem;
 
-		vsize = getxattr(path, attr, NULL, 0);
+		vsize = xattrbuf_get(path, attr, xbuf);
+		if (vsize < 0 && errno == ENOMEM)
+			goto nomem;
 		if (vsize < 0) {
 			msg(MSG_ERROR, "getxattr failed for %s: %s\n",
 			    path, strerror(errno));
-			free(list);
-			mentry->xattrs = i + 1;
 			mentry_free(mentry);
 			return NULL;
 		}
 
 		mentry->xattr_lvalues[i] = vsize;
-		mentry->xattr_values[i] = xmalloc(vsize);
-
-		vsize = getxattr(path, attr, mentry->xattr_values[i], vsize);
-		if (vsize < 0) {
-			msg(MSG_ERROR, "getxattr failed for %s: %s\n",
-			    path, strerror(errno));
-			free(list);
-			mentry->xattrs = i + 1;
-			mentry_free(mentry);
-			return NULL;
-		}
+		mentry->xattr_values[i] = xmalloc(vsize, STATS_MEM_XVALUE);
+		if (!mentry->xattr_values[i])
+			goto nomem;
+		memcpy(mentry->xattr_values[i], xbuf->value, vsize);
 		i++;
 	}
-
-	free(list);
+#else
+	(void)xbuf;
 #endif /* !NO_XATTR */
 
 	return mentry;
+
+nomem:
+	mentry_free(mentry);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/* Creates a metaentry for the file/dir/etc at path */
+struct metaentry *
+mentry_create(const char *path, msettings *st)
+{
+	struct stat sbuf;
+	struct xattrbuf xbuf;
+	struct metaentry *mentry;
+
+	if (mentry_lstat(path, &sbuf, st)) {
+		msg(MSG_ERROR, "lstat failed for %s: %s\n",
+		    path, strerror(errno));
+		return NULL;
+	}
+
+	memset(&xbuf, 0, sizeof(xbuf));
+	mentry = mentry_create_stat(path, &sbuf, st, &xbuf);
+	xattrbuf_free(&xbuf);
+	return mentry;
+}
+
+/*
+ * Creates a metaentry for path, which is a hardlink to the same inode as
+ * already created link, by copying its data instead of querying it again
+ */
+static struct metaentry *
+mentry_create_link(const char *path, const struct metaentry *link)
+{
+	struct metaentry *mentry;
+	unsigned i;
+
+	mentry = mentry_alloc();
+	if (!mentry)
+		return NULL;
+	mentry->mode = link->mode;
+	mentry->mtime = link->mtime;
+	mentry->mtimensec = link->mtimensec;
+	mentry->ctime = link->ctime;
+	mentry->ctimensec = link->ctimensec;
+
+	mentry->path = xstrdup(path, STATS_MEM_PATH);
+	if (!mentry->path)
+		goto nomem;
+	mentry->pathlen = strlen(mentry->path);
+	if (link->owner &&
+	    !(mentry->owner = xstrdup(link->owner, STATS_MEM_NAME)))
+		goto nomem;
+	if (link->group &&
+	    !(mentry->group = xstrdup(link->group, STATS_MEM_NAME)))
+		goto nomem;
+
+	if (!link->xattrs)
+		return mentry;
+
+	if (mentry_alloc_xattrs(mentry, link->xattrs))
+		goto nomem;
+
+	for (i = 0; i < mentry->xattrs; i++) {
+		mentry->xattr_names[i] = xstrdup(link->xattr_names[i],
+		                                 STATS_MEM_XNAME);
+		mentry->xattr_lvalues[i] = link->xattr_lvalues[i];
+		mentry->xattr_values[i] = xmalloc(link->xattr_lvalues[i],
+		                                  STATS_MEM_XVALUE);
+		if (!mentry->xattr_names[i] || !mentry->xattr_values[i])
+			goto nomem;
+		memcpy(mentry->xattr_values[i], link->xattr_values[i],
+		       link->xattr_lvalues[i]);
+	}
+
+	return mentry;
+
+nomem:
+	mentry_free(mentry);
+	errno = ENOMEM;
+	return NULL;
 }
 
 /* Cleans up a path and makes it relative to cwd unless it is absolute */
@@ -333,336 +819,2933 @@ normalize_path(const char *orig)
 	cwdlen -= !strcmp("/", cwd);
 
 	if (!strncmp(real, cwd, cwdlen)) {
-		result = xmalloc(strlen(real) - cwdlen + 1 + 1);
-		result[0] = '\0';
-		strcat(result, ".");
-		strcat(result, real + cwdlen);
+		result = xmalloc(strlen(real) - cwdlen + 1 + 1,
+		                 STATS_MEM_OTHER);
+		if (result) {
+			result[0] = '\0';
+			strcat(result, ".");
+			strcat(result, real + cwdlen);
+		}
 	} else {
-		result = xstrdup(real);
+		result = xstrdup(real, STATS_MEM_OTHER);
 	}
 
 	free(real);
 	return result;
 }
 
-/* Internal function for the recursive path walk */
-static void
-mentries_recurse(const char *path, struct metahash *mhash, msettings *st)
+/* Data structure to remember already seen inodes with multiple links */
+struct inodelink {
+	struct inodelink *next;
+	dev_t dev;
+	ino_t ino;
+	struct metaentry *mentry; /* Own copy, callback may free the original */
+};
+
+/* Data structure to hold the state of a path walk */
+struct mwalk {
+	int (*cb)(struct metaentry *mentry, void *arg);
+	void *arg;
+	int ret; /* Non-zero return value of cb or -1, which stops the walk */
+	msettings *st;
+	dev_t dev; /* Device of the root of the walk */
+	struct xattrbuf xbuf;
+	struct inodelink *inodes[HASH_INDEXES];
+	struct dirbuf *dirbufs; /* Spare buffers for listing directories */
+};
+
+/* Finds the first seen link to the inode described by sbuf */
+static const struct metaentry *
+inodelink_find(const struct mwalk *walk, const struct stat *sbuf)
 {
-	struct stat sbuf;
-	struct metaentry *mentry;
-	char tpath[PATH_MAX];
-	DIR *dir;
-	struct dirent *dent;
+	const struct inodelink *link;
 
-	if (!path)
-		return;
-
-	if (lstat(path, &sbuf)) {
-		msg(MSG_ERROR, "lstat failed for %s: %s\n",
-		    path, strerror(errno));
-		return;
+	link = walk->inodes[(sbuf->st_ino ^ sbuf->st_dev) % HASH_INDEXES];
+	for (; link; link = link->next) {
+		if (link->ino == sbuf->st_ino && link->dev == sbuf->st_dev)
+			return link->mentry;
 	}
 
-	mentry = mentry_create(path);
-	if (!mentry)
-		return;
-
-	mentry_insert(mentry, mhash);
+	return NULL;
+}
 
-	if (S_ISDIR(sbuf.st_mode)) {
-		dir = opendir(path);
-		if (!dir) {
-			msg(MSG_ERROR, "opendir failed for %s: %s\n",
-			    path, strerror(errno));
-			return;
+/*
+ * Remembers mentry as the first seen link to the inode described by sbuf
+ * - returns -1 if out of memory
+ */
+static int
+inodelink_insert(struct mwalk *walk, const struct stat *sbuf,
+                 const struct metaentry *mentry)
+{
+	struct inodelink *link;
+	unsigned key;
+
+	key = (sbuf->st_ino ^ sbuf->st_dev) % HASH_INDEXES;
+	link = xmalloc(sizeof(struct inodelink), STATS_MEM_HASH);
+	if (!link)
+		return -1;
+	link->dev = sbuf->st_dev;
+	link->ino = sbuf->st_ino;
+	link->mentry = mentry_create_link(mentry->path, mentry);
+	if (!link->mentry) {
+		xfree(link);
+		errno = ENOMEM;
+		return -1;
+	}
+	link->next = walk->inodes[key];
+	walk->inodes[key] = link;
+	return 0;
+}
+
+/* Frees all remembered inodes */
+static void
+inodelink_free(struct mwalk *walk)
+{
+	struct inodelink *link, *next;
+	int key;
+
+	for (key = 0; key < HASH_INDEXES; key++) {
+		for (link = walk->inodes[key]; link; link = next) {
+			next = link->next;
+			mentry_free(link->mentry);
+			xfree(link);
+		}
+		walk->inodes[key] = NULL;
+	}
+}
+
+/*
+ * Checks whether a walk started on device rootdev may descend into
+ * directory path on device dev, which is the root of the walk or a
+ * mountpoint
+ */
+bool
+mentries_descend(const char *path, dev_t dev, dev_t rootdev, msettings *st)
+{
+#ifdef __linux__
+	struct statfs sfs;
+	int i;
+#endif
+
+	if (st->do_onefs && dev != rootdev) {
+		msg(MSG_DEBUG, "%s:\tnot crossing file system boundary\n", path);
+		return false;
+	}
+
+#ifdef __linux__
+	if (!st->skip_fs)
+		return true;
+
+	if (statfs(path, &sfs)) {
+		msg(MSG_ERROR, "statfs failed for %s: %s\n",
+		    path, strerror(errno));
+		return false;
+	}
+	for (i = 0; st->skip_fs[i]; i++) {
+		if ((unsigned long)sfs.f_type == st->skip_fs[i]) {
+			msg(MSG_DEBUG, "%s:\tskipping file system\n", path);
+			return false;
+		}
+	}
+#endif
+
+	return true;
+}
+
+/*
+ * Queries metadata of path, filling sbuf
+ * - returns NULL if path cannot be queried or memory runs out (walk->ret
+ *   is set to -1 then)
+ */
+static struct metaentry *
+mentries_query(const char *path, struct mwalk *walk, struct stat *sbuf)
+{
+	const struct metaentry *link;
+	struct metaentry *mentry;
+
+	if (mentry_lstat(path, sbuf, walk->st)) {
+		msg(MSG_ERROR, "lstat failed for %s: %s\n",
+		    path, strerror(errno));
+		return NULL;
+	}
+
+	/* Query hardlinked inodes only once */
+	link = NULL;
+	if (sbuf->st_nlink > 1 && !S_ISDIR(sbuf->st_mode))
+		link = inodelink_find(walk, sbuf);
+
+	errno = 0;
+	if (link)
+		mentry = mentry_create_link(path, link);
+	else
+		mentry = mentry_create_stat(path, sbuf, walk->st, &walk->xbuf);
+
+	/* Skip files which cannot be queried, but give up if out of memory */
+	if (!mentry) {
+		if (errno == ENOMEM)
+			walk->ret = -1;
+		return NULL;
+	}
+
+	if (!link && sbuf->st_nlink > 1 && !S_ISDIR(sbuf->st_mode) &&
+	    inodelink_insert(walk, sbuf, mentry)) {
+		mentry_free(mentry);
+		walk->ret = -1;
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return mentry;
+}
+
+/*
+ * Buffer with entries of a directory, as returned by getdents64 or copied
+ * from readdir, big enough for huge directories to be listed in few calls
+ */
+#define DIRBUF_SIZE (256 * 1024)
+#define DIRBUF_MIN  (8 * 1024) /* Less space left is not worth a call */
+struct dirbuf {
+	struct dirbuf *next;
+	size_t used;
+	char data[DIRBUF_SIZE];
+};
+
+/* Directory entry read ahead of querying its metadata */
+struct mdirent {
+	ino_t ino;
+	const char *name;         /* in one of the buffers of the listing */
+	dev_t dev;                /* device of the queried entry */
+	struct metaentry *mentry; /* queried entry, NULL if skipped */
+};
+
+/* Entries of a directory being walked */
+struct mlisting {
+	struct mdirent *ents;
+	size_t count;
+	size_t size;
+	struct dirbuf *bufs;      /* newest first */
+	char *names;              /* names kept while walking into entries */
+};
+
+/* Orders directory entries by inode, then by position in the directory */
+static int
+mdirent_cmp(const void *a, const void *b)
+{
+	const struct mdirent *left = *(const struct mdirent * const *)a;
+	const struct mdirent *right = *(const struct mdirent * const *)b;
+
+	if (left->ino != right->ino)
+		return left->ino < right->ino ? -1 : 1;
+	return left < right ? -1 : left > right;
+}
+
+/*
+ * Adds entry name of directory path to listing unless it is to be skipped
+ * - type is d_type of the entry
+ * - returns -1 if out of memory
+ */
+static int
+mlisting_add(struct mlisting *list, const char *path, const char *name,
+             ino_t ino, unsigned char type, const struct mwalk *walk)
+{
+	char tpath[PATH_MAX];
+	struct mdirent *ents;
+	size_t size;
+
+	if (!strcmp(name, ".") ||
+	    !strcmp(name, "..") ||
+	    (!walk->st->do_git && !strcmp(name, ".git"))
+	   )
+		return 0;
+
+	/* Do not even stat paths unknown to git or ignored */
+	if (walk->st->tracked || walk->st->ignore) {
+		snprintf(tpath, PATH_MAX, "%s/%s", path, name);
+		tpath[PATH_MAX - 1] = '\0';
+		if ((walk->st->tracked &&
+		     !gitindex_tracked(walk->st->tracked, tpath)) ||
+		    (walk->st->ignore &&
+		     mignore_excluded(walk->st->ignore, tpath,
+		                      type == DT_UNKNOWN ? -1 :
+		                      type == DT_DIR))) {
+			stats_count(STATS_PRUNE);
+			return 0;
+		}
+	}
+
+	if (list->count == list->size) {
+		size = list->size ? list->size * 2 : 16;
+		ents = xmalloc(size * sizeof(struct mdirent), STATS_MEM_BUFFER);
+		if (!ents)
+			return -1;
+		if (list->count)
+			memcpy(ents, list->ents,
+			       list->count * sizeof(struct mdirent));
+		xfree(list->ents);
+		list->ents = ents;
+		list->size = size;
+	}
+
+	list->ents[list->count].ino = ino;
+	list->ents[list->count].name = name;
+	list->ents[list->count].mentry = NULL;
+	list->count++;
+	return 0;
+}
+
+/*
+ * Returns a buffer of listing with at least need bytes free, reusing spare
+ * buffers of the walk, or NULL if out of memory
+ */
+static struct dirbuf *
+mlisting_buf(struct mlisting *list, struct mwalk *walk, size_t need)
+{
+	struct dirbuf *buf = list->bufs;
+
+	if (buf && DIRBUF_SIZE - buf->used >= need)
+		return buf;
+
+	buf = walk->dirbufs;
+	if (buf)
+		walk->dirbufs = buf->next;
+	else
+		buf = xmalloc(sizeof(struct dirbuf), STATS_MEM_BUFFER);
+	if (!buf)
+		return NULL;
+
+	buf->used = 0;
+	buf->next = list->bufs;
+	list->bufs = buf;
+	return buf;
+}
+
+/* Frees listing, keeping its buffers for reuse by the walk */
+static void
+mlisting_free(struct mlisting *list, struct mwalk *walk)
+{
+	struct dirbuf *buf;
+
+	while ((buf = list->bufs)) {
+		list->bufs = buf->next;
+		buf->next = walk->dirbufs;
+		walk->dirbufs = buf;
+	}
+	xfree(list->names);
+	xfree(list->ents);
+}
+
+/*
+ * Copies names of queried entries out of the buffers of listing, which are
+ * returned to the walk, so that walking into subdirectories does not hold
+ * a whole buffer per level, returns -1 if out of memory
+ */
+static int
+mlisting_compact(struct mlisting *list, struct mwalk *walk)
+{
+	struct dirbuf *buf;
+	size_t i, len, total = 0;
+	bool subdirs = false;
+	char *p;
+
+	for (i = 0; i < list->count; i++) {
+		if (!list->ents[i].mentry)
+			continue;
+		total += strlen(list->ents[i].name) + 1;
+		if (S_ISDIR(list->ents[i].mentry->mode))
+			subdirs = true;
+	}
+	if (!subdirs)
+		return 0;
+
+	list->names = xmalloc(total, STATS_MEM_BUFFER);
+	if (!list->names)
+		return -1;
+
+	p = list->names;
+	for (i = 0; i < list->count; i++) {
+		if (!list->ents[i].mentry)
+			continue;
+		len = strlen(list->ents[i].name) + 1;
+		memcpy(p, list->ents[i].name, len);
+		list->ents[i].name = p;
+		p += len;
+	}
+
+	while ((buf = list->bufs)) {
+		list->bufs = buf->next;
+		buf->next = walk->dirbufs;
+		walk->dirbufs = buf;
+	}
+	return 0;
+}
+
+/*
+ * Lists directory path, names stay in the buffers they were read into
+ * - returns -1 on failure (walk->ret is set to -1 if out of memory)
+ */
+static int
+mlisting_read(struct mlisting *list, const char *path, struct mwalk *walk)
+{
+	struct dirbuf *buf;
+#ifdef HAVE_GETDENTS64
+	struct dirent64 *dent;
+	size_t off;
+	long len;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		msg(MSG_ERROR, "opendir failed for %s: %s\n",
+		    path, strerror(errno));
+		return -1;
+	}
+
+	while ((buf = mlisting_buf(list, walk, DIRBUF_MIN))) {
+		stats_count(STATS_GETDENTS);
+		len = syscall(SYS_getdents64, fd, buf->data + buf->used,
+		              DIRBUF_SIZE - buf->used);
+		if (len <= 0)
+			break;
+
+		for (off = buf->used; off < buf->used + len;
+		     off += dent->d_reclen) {
+			dent = (struct dirent64 *)(buf->data + off);
+			if (mlisting_add(list, path, dent->d_name, dent->d_ino,
+			                 dent->d_type, walk))
+				break;
+		}
+		if (off < buf->used + len)
+			goto nomem;
+		buf->used += len;
+	}
+
+	if (!buf)
+		goto nomem;
+	if (len < 0)
+		msg(MSG_ERROR, "getdents64 failed for %s: %s\n",
+		    path, strerror(errno));
+	close(fd);
+	return len < 0 ? -1 : 0;
+
+nomem:
+	close(fd);
+#else
+	struct dirent *dent;
+	size_t len;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir) {
+		msg(MSG_ERROR, "opendir failed for %s: %s\n",
+		    path, strerror(errno));
+		return -1;
+	}
+
+	/* Names are copied, as readdir reuses its buffer */
+	while ((dent = readdir(dir))) {
+		len = strlen(dent->d_name) + 1;
+		buf = mlisting_buf(list, walk, len);
+		if (!buf)
+			goto nomem;
+		memcpy(buf->data + buf->used, dent->d_name, len);
+		if (mlisting_add(list, path, buf->data + buf->used,
+		                 dent->d_ino, dent->d_type, walk))
+			goto nomem;
+		buf->used += len;
+	}
+
+	closedir(dir);
+	return 0;
+
+nomem:
+	closedir(dir);
+#endif /* HAVE_GETDENTS64 */
+	walk->ret = -1;
+	errno = ENOMEM;
+	return -1;
+}
+
+static void mentries_visit(const char *path, struct metaentry *mentry,
+                           dev_t dev, bool mount, struct mwalk *walk);
+
+/*
+ * Walks entries of directory path on device dev
+ * - all entries are read first and queried in inode order, which avoids
+ *   seeking back and forth in inode tables of cold caches, but they are
+ *   passed on in directory order, so results do not depend on it
+ */
+static void
+mentries_readdir(const char *path, dev_t dev, struct mwalk *walk)
+{
+	struct mlisting list;
+	struct mdirent *ent, **order = NULL;
+	char tpath[PATH_MAX];
+	struct stat sbuf;
+	size_t i;
+	int err;
+
+	memset(&list, 0, sizeof(list));
+	if (mlisting_read(&list, path, walk) || !list.count)
+		goto out;
+
+	order = xmalloc(list.count * sizeof(struct mdirent *),
+	                STATS_MEM_BUFFER);
+	if (!order) {
+		walk->ret = -1;
+		errno = ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < list.count; i++)
+		order[i] = &list.ents[i];
+	qsort(order, list.count, sizeof(struct mdirent *), mdirent_cmp);
+
+	for (i = 0; i < list.count && !walk->ret; i++) {
+		ent = order[i];
+		snprintf(tpath, PATH_MAX, "%s/%s", path, ent->name);
+		tpath[PATH_MAX - 1] = '\0';
+		ent->mentry = mentries_query(tpath, walk, &sbuf);
+		ent->dev = sbuf.st_dev;
+	}
+	xfree(order);
+	order = NULL;
+
+	if (!walk->ret && mlisting_compact(&list, walk)) {
+		walk->ret = -1;
+		errno = ENOMEM;
+	}
+
+	for (i = 0; i < list.count; i++) {
+		ent = &list.ents[i];
+		if (!ent->mentry)
+			continue;
+		/* Entries not passed on are still ours after a failure */
+		if (walk->ret) {
+			mentry_free(ent->mentry);
+			continue;
+		}
+		snprintf(tpath, PATH_MAX, "%s/%s", path, ent->name);
+		tpath[PATH_MAX - 1] = '\0';
+		mentries_visit(tpath, ent->mentry, ent->dev, ent->dev != dev,
+		               walk);
+	}
+
+out:
+	err = errno;
+	xfree(order);
+	mlisting_free(&list, walk);
+	errno = err;
+}
+
+/*
+ * Passes mentry of path on device dev to the callback and walks into it
+ * if it is a directory, mount tells whether it is the root of the walk or
+ * a mountpoint
+ */
+static void
+mentries_visit(const char *path, struct metaentry *mentry, dev_t dev,
+               bool mount, struct mwalk *walk)
+{
+	bool isdir;
+
+	/* Callback takes over mentry, so do not touch it afterwards */
+	isdir = S_ISDIR(mentry->mode);
+	walk->ret = walk->cb(mentry, walk->arg);
+	if (walk->ret || !isdir)
+		return;
+
+	/* Mountpoints are leaves if their file system is not to be walked */
+	if (mount && (walk->st->do_onefs || walk->st->skip_fs) &&
+	    !mentries_descend(path, dev, walk->dev, walk->st))
+		return;
+
+	mentries_readdir(path, dev, walk);
+}
+
+/*
+ * Walks opath and calls cb for each entry, until cb returns non-zero
+ * - returns the value returned by cb, or -1 (with errno set) if opath
+ *   cannot be resolved or memory runs out
+ */
+int
+mentries_walk(const char *opath, msettings *st,
+              int (*cb)(struct metaentry *mentry, void *arg), void *arg)
+{
+	char *path = normalize_path(opath);
+	struct metaentry *mentry;
+	struct dirbuf *buf;
+	struct mwalk walk;
+	struct stat sbuf;
+	int err;
+
+	if (!path) {
+		if (errno != ENOMEM)
+			msg(MSG_ERROR, "realpath failed for %s: %s\n",
+			    opath, strerror(errno));
+		return -1;
+	}
+
+	memset(&walk, 0, sizeof(walk));
+	walk.cb = cb;
+	walk.arg = arg;
+	walk.st = st;
+	mentry = mentries_query(path, &walk, &sbuf);
+	if (mentry) {
+		walk.dev = sbuf.st_dev;
+		mentries_visit(path, mentry, sbuf.st_dev, true, &walk);
+	}
+	err = errno;
+	inodelink_free(&walk);
+	xattrbuf_free(&walk.xbuf);
+	while ((buf = walk.dirbufs)) {
+		walk.dirbufs = buf->next;
+		xfree(buf);
+	}
+	xfree(path);
+	errno = err;
+	return walk.ret;
+}
+
+/* Inserts mentry into mhash given as arg - for use in mentries_walk */
+static int
+mentries_walk_insert(struct metaentry *mentry, void *arg)
+{
+	mentry_insert(mentry, arg);
+	return 0;
+}
+
+/*
+ * Recurses opath and adds metadata entries to the metaentry list
+ * - returns -1 if out of memory, other errors are only reported
+ */
+int
+mentries_recurse_path(const char *opath, struct metahash **mhash, msettings *st)
+{
+	if (!(*mhash))
+		*mhash = mhash_alloc();
+	if (!(*mhash))
+		return -1;
+
+	if (mentries_walk(opath, st, mentries_walk_insert, *mhash) &&
+	    errno == ENOMEM)
+		return -1;
+	return 0;
+}
+
+/* Least number of bytes loaded or written by each thread */
+#define MTHREADS_CHUNK  (1 << 20)
+/* Most threads used for loading or writing */
+#define MTHREADS_MAX    64
+
+/* Number of threads used for loading and writing, 0 for one per CPU */
+static unsigned mthreads = 0;
+
+/* Sets the number of threads used for loading and writing large files */
+void
+mentries_threads(unsigned threads)
+{
+	mthreads = threads;
+}
+
+/* Returns the number of threads to load or write size bytes with */
+static unsigned
+mthreads_count(size_t size)
+{
+	long cpus;
+	size_t n = mthreads;
+
+	if (!n) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n = cpus > 0 ? (size_t)cpus : 1;
+	}
+	if (n > size / MTHREADS_CHUNK)
+		n = size / MTHREADS_CHUNK;
+	if (n > MTHREADS_MAX)
+		n = MTHREADS_MAX;
+	return n ? (unsigned)n : 1;
+}
+
+/*
+ * Runs fn for each of n jobs of given size, in threads where possible
+ * - the first job and those whose thread failed to start run in the
+ *   calling thread
+ */
+static void
+mthreads_run(void *jobs, size_t size, unsigned n, void *(*fn)(void *))
+{
+	pthread_t threads[MTHREADS_MAX];
+	bool started[MTHREADS_MAX];
+	unsigned i;
+
+	for (i = 1; i < n; i++)
+		started[i] = !pthread_create(&threads[i], NULL, fn,
+		                             (char *)jobs + i * size);
+	fn(jobs);
+	for (i = 1; i < n; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			fn((char *)jobs + i * size);
+	}
+}
+
+/* Writes a single metaentry to a file, errors are left for ferror() */
+void
+mentry_tofile(const struct metaentry *mentry, FILE *to)
+{
+	unsigned i;
+
+	write_string(mentry->path, to);
+	write_string(mentry->owner ? mentry->owner : "", to);
+	write_string(mentry->group ? mentry->group : "", to);
+	write_int((uint64_t)mentry->mtime, 8, to);
+	write_int((uint64_t)mentry->mtimensec, 8, to);
+	write_int((uint64_t)mentry->mode, 2, to);
+	write_int(mentry->xattrs, 4, to);
+	for (i = 0; i < mentry->xattrs; i++) {
+		write_string(mentry->xattr_names[i], to);
+		write_int(mentry->xattr_lvalues[i], 4, to);
+		write_binary_string(mentry->xattr_values[i],
+		                    mentry->xattr_lvalues[i], to);
+	}
+}
+
+/* Writes the header of a metadata file, errors are left for ferror() */
+void
+mentries_header_write(FILE *to, unsigned version)
+{
+	write_binary_string(SIGNATURE, SIGNATURELEN, to);
+	write_binary_string(version ? VERSION1 : VERSION, VERSIONLEN, to);
+}
+
+/*
+ * Orders paths so that each one is directly followed by those below it,
+ * by comparing "/" as lower than any other character
+ */
+int
+mentry_path_cmp(const char *left, const char *right)
+{
+	unsigned char l, r;
+
+	while (*left && *left == *right) {
+		left++;
+		right++;
+	}
+
+	l = (unsigned char)*left;
+	r = (unsigned char)*right;
+	l = l == '/' ? 1 : l && l < '/' ? l + 1 : l;
+	r = r == '/' ? 1 : r && r < '/' ? r + 1 : r;
+	return l - r;
+}
+
+/*
+ * Version 1 files consist of blocks of whole entries, each preceded by a
+ * header with the length and number of its entries and a CRC32C of both
+ * and of the entries, and end with an empty block holding the number of
+ * all entries. Their entries are sorted by path, so that each directory
+ * is followed by everything below it, and an index block without entries
+ * may come first, holding a digest of each directory and everything
+ * below it, so that equal subtrees of two files can be skipped. Files
+ * of both versions are written in blocks of about BLOCK_SIZE bytes,
+ * which are spread among writing threads.
+ */
+
+/* Length of entries after which a block is ended */
+#define BLOCK_SIZE      (64 * 1024)
+
+/* Length of a block header */
+#define BLOCKHDRLEN     12
+
+/* Length of a directory record in the index block */
+#define DIGESTLEN       (8 + SHA256_LEN)
+
+/* Entries written together */
+struct mblock {
+	unsigned long first;     /* index of the first entry */
+	unsigned long count;     /* number of entries */
+	size_t len;              /* length of entries */
+	size_t offset;           /* of the block in the file */
+};
+
+/* Digest of a directory and of everything below it */
+struct mdigest {
+	unsigned long first;     /* index of the directory */
+	unsigned long count;     /* number of entries, with the directory */
+	unsigned char digest[SHA256_LEN];
+};
+
+/* Reads len bytes of an int known to be within bounds */
+static uint64_t
+mload_int(const char *ptr, size_t len)
+{
+	char *from = (char *)ptr;
+
+	return read_int(&from, len, ptr + len);
+}
+
+/* Computes the checksum of the block with header at hdr */
+static uint32_t
+mblock_crc(const char *hdr)
+{
+	return crc32c(crc32c(0, hdr, 8), hdr + BLOCKHDRLEN,
+	              (size_t)mload_int(hdr, 4));
+}
+
+/* Puts a header for count entries of len bytes following it at hdr */
+static void
+mblock_header(char *hdr, size_t len, unsigned long count)
+{
+	put_int(hdr, len, 4);
+	put_int(hdr + 4, count, 4);
+	put_int(hdr + 8, mblock_crc(hdr), 4);
+}
+
+/* Returns the number of bytes mentry_tofile writes for mentry */
+static size_t
+mentry_size(const struct metaentry *mentry)
+{
+	size_t size;
+	unsigned i;
+
+	size = mentry->pathlen + 1 + 8 + 8 + 2 + 4;
+	size += (mentry->owner ? strlen(mentry->owner) : 0) + 1;
+	size += (mentry->group ? strlen(mentry->group) : 0) + 1;
+	for (i = 0; i < mentry->xattrs; i++)
+		size += strlen(mentry->xattr_names[i]) + 1 + 4 +
+		        mentry->xattr_lvalues[i];
+
+	return size;
+}
+
+/* Puts a metaentry into memory at to as mentry_tofile writes it */
+static char *
+mentry_put(const struct metaentry *mentry, char *to)
+{
+	unsigned i;
+
+	to = put_string(to, mentry->path);
+	to = put_string(to, mentry->owner ? mentry->owner : "");
+	to = put_string(to, mentry->group ? mentry->group : "");
+	to = put_int(to, (uint64_t)mentry->mtime, 8);
+	to = put_int(to, (uint64_t)mentry->mtimensec, 8);
+	to = put_int(to, (uint64_t)mentry->mode, 2);
+	to = put_int(to, mentry->xattrs, 4);
+	for (i = 0; i < mentry->xattrs; i++) {
+		to = put_string(to, mentry->xattr_names[i]);
+		to = put_int(to, mentry->xattr_lvalues[i], 4);
+		to = put_binary_string(to, mentry->xattr_values[i],
+		                       mentry->xattr_lvalues[i]);
+	}
+
+	return to;
+}
+
+/* Metaentry being sorted, with its path at hand */
+struct msortkey {
+	const char *path;
+	const struct metaentry *mentry;
+};
+
+/* Orders metaentries by path as in mentry_path_cmp - for qsort */
+static int
+msortkey_cmp(const void *a, const void *b)
+{
+	return mentry_path_cmp(((const struct msortkey *)a)->path,
+	                       ((const struct msortkey *)b)->path);
+}
+
+/*
+ * Lists metaentries in the order of the hash table, or sorted by path
+ * - returns NULL if out of memory
+ */
+static const struct metaentry **
+mentries_list(const struct metahash *mhash, bool sorted)
+{
+	const struct metaentry **list, *mentry;
+	struct msortkey *keys;
+	unsigned long n = 0, i;
+	int key;
+
+	list = xmalloc((mhash->count + 1) * sizeof(struct metaentry *),
+	               STATS_MEM_BUFFER);
+	if (!list)
+		return NULL;
+
+	for (key = 0; key < HASH_INDEXES; key++)
+		for (mentry = mhash->bucket[key]; mentry; mentry = mentry->next)
+			list[n++] = mentry;
+	if (!sorted)
+		return list;
+
+	/* Paths are compared without going through entries each time */
+	keys = xmalloc((n + 1) * sizeof(struct msortkey), STATS_MEM_BUFFER);
+	if (!keys) {
+		xfree(list);
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		keys[i].path = list[i]->path;
+		keys[i].mentry = list[i];
+	}
+	qsort(keys, n, sizeof(struct msortkey), msortkey_cmp);
+	for (i = 0; i < n; i++)
+		list[i] = keys[i].mentry;
+	xfree(keys);
+	return list;
+}
+
+/* Adds an int of len bytes, in little-endian order, to a digest */
+static void
+mdigest_int(struct sha256 *ctx, uint64_t value, size_t len)
+{
+	char buf[8];
+
+	put_int(buf, value, len);
+	sha256_update(ctx, buf, len);
+}
+
+/* Adds a metaentry, as mentry_tofile writes it, to a digest */
+static void
+mdigest_entry(struct sha256 *ctx, const struct metaentry *mentry)
+{
+	const char *owner = mentry->owner ? mentry->owner : "";
+	const char *group = mentry->group ? mentry->group : "";
+	unsigned i;
+
+	sha256_update(ctx, mentry->path, mentry->pathlen + 1);
+	sha256_update(ctx, owner, strlen(owner) + 1);
+	sha256_update(ctx, group, strlen(group) + 1);
+	mdigest_int(ctx, (uint64_t)mentry->mtime, 8);
+	mdigest_int(ctx, (uint64_t)mentry->mtimensec, 8);
+	mdigest_int(ctx, (uint64_t)mentry->mode, 2);
+	mdigest_int(ctx, mentry->xattrs, 4);
+	for (i = 0; i < mentry->xattrs; i++) {
+		sha256_update(ctx, mentry->xattr_names[i],
+		              strlen(mentry->xattr_names[i]) + 1);
+		mdigest_int(ctx, (uint64_t)mentry->xattr_lvalues[i], 4);
+		sha256_update(ctx, mentry->xattr_values[i],
+		              (size_t)mentry->xattr_lvalues[i]);
+	}
+}
+
+/* Checks whether path is below directory dir of length len */
+static bool
+mpath_below(const char *path, const char *dir, size_t len)
+{
+	return !strncmp(path, dir, len) &&
+	       (path[len] == '/' || (len && dir[len - 1] == '/' && path[len]));
+}
+
+/*
+ * Computes digests of directories of n metaentries sorted by path
+ * - a directory digest covers the directory, then its children in order:
+ *   the ENTRY bytes of other entries and digests of directories, each
+ *   after a tag byte, so that no two subtrees give the same bytes
+ * - sets *ndigests, returns NULL if out of memory
+ */
+static struct mdigest *
+mdigests_compute(const struct metaentry **list, unsigned long n,
+                 unsigned long *ndigests)
+{
+	const struct metaentry *dir;
+	struct mdigest *digests;
+	struct sha256 *ctxs;
+	unsigned long *open;
+	unsigned long i, dirs = 0, depth = 0, d;
+
+	for (i = 0; i < n; i++)
+		if (S_ISDIR(list[i]->mode))
+			dirs++;
+
+	digests = xmalloc((dirs + 1) * sizeof(struct mdigest),
+	                  STATS_MEM_BUFFER);
+	open = xmalloc((dirs + 1) * sizeof(unsigned long), STATS_MEM_BUFFER);
+	ctxs = xmalloc((dirs + 1) * sizeof(struct sha256), STATS_MEM_BUFFER);
+	if (!digests || !open || !ctxs) {
+		xfree(digests);
+		xfree(open);
+		xfree(ctxs);
+		return NULL;
+	}
+
+	/* Directories are closed when the first entry not below them comes */
+	*ndigests = 0;
+	for (i = 0; i <= n; i++) {
+		while (depth) {
+			d = open[depth - 1];
+			dir = list[digests[d].first];
+			if (i < n && mpath_below(list[i]->path, dir->path,
+			                         dir->pathlen))
+				break;
+			digests[d].count = i - digests[d].first;
+			sha256_final(&ctxs[--depth], digests[d].digest);
+			if (depth) {
+				sha256_update(&ctxs[depth - 1], "D", 1);
+				sha256_update(&ctxs[depth - 1],
+				              digests[d].digest, SHA256_LEN);
+			}
+		}
+		if (i == n)
+			break;
+
+		if (S_ISDIR(list[i]->mode)) {
+			digests[*ndigests].first = i;
+			sha256_init(&ctxs[depth]);
+			mdigest_entry(&ctxs[depth], list[i]);
+			open[depth++] = (*ndigests)++;
+		} else if (depth) {
+			sha256_update(&ctxs[depth - 1], "E", 1);
+			mdigest_entry(&ctxs[depth - 1], list[i]);
+		}
+	}
+
+	xfree(open);
+	xfree(ctxs);
+	return digests;
+}
+
+/* Puts the index block with n digests at hdr */
+static void
+mdigests_put(const struct mdigest *digests, unsigned long n, char *hdr)
+{
+	char *to = hdr + BLOCKHDRLEN;
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		to = put_int(to, digests[i].first, 4);
+		to = put_int(to, digests[i].count, 4);
+		memcpy(to, digests[i].digest, SHA256_LEN);
+		to += SHA256_LEN;
+	}
+	mblock_header(hdr, n * DIGESTLEN, 0);
+}
+
+/*
+ * Splits n listed metaentries into blocks for a file of given version,
+ * whose first block starts at offset
+ * - sets *nblocks to the number of blocks and *size to the size of the
+ *   file, returns NULL if out of memory
+ */
+static struct mblock *
+mblocks_split(const struct metaentry **list, unsigned long n,
+              unsigned version, size_t offset, unsigned *nblocks,
+              size_t *size)
+{
+	struct mblock *blocks, *grown, *block = NULL;
+	unsigned alloc = 16;
+	unsigned long i;
+	size_t len;
+
+	blocks = xmalloc(alloc * sizeof(struct mblock), STATS_MEM_BUFFER);
+	if (!blocks)
+		return NULL;
+
+	*nblocks = 0;
+	*size = offset;
+	for (i = 0; i < n; i++) {
+		len = mentry_size(list[i]);
+		if (!block || block->len + len > BLOCK_SIZE) {
+			if (*nblocks == alloc) {
+				grown = xmalloc(2 * alloc *
+				                sizeof(struct mblock),
+				                STATS_MEM_BUFFER);
+				if (!grown) {
+					xfree(blocks);
+					return NULL;
+				}
+				memcpy(grown, blocks,
+				       alloc * sizeof(struct mblock));
+				xfree(blocks);
+				blocks = grown;
+				alloc *= 2;
+			}
+			block = &blocks[(*nblocks)++];
+			block->first = i;
+			block->count = 0;
+			block->len = 0;
+			block->offset = *size;
+			if (version)
+				*size += BLOCKHDRLEN;
+		}
+		block->count++;
+		block->len += len;
+		*size += len;
+	}
+
+	/* Trailer */
+	if (version)
+		*size += BLOCKHDRLEN;
+	return blocks;
+}
+
+/* Puts a block into memory at to, with its header if version is 1 */
+static void
+mblock_put(const struct metaentry **list, const struct mblock *block,
+           char *to, unsigned version)
+{
+	char *hdr = to;
+	unsigned long i;
+
+	if (version)
+		to += BLOCKHDRLEN;
+	for (i = block->first; i < block->first + block->count; i++)
+		to = mentry_put(list[i], to);
+	if (version)
+		mblock_header(hdr, block->len, block->count);
+}
+
+/* Parts of a metadata file to be written */
+struct mlayout {
+	const struct metaentry **list; /* entries in file order */
+	struct mdigest *digests;       /* index of a version 1 file */
+	unsigned long ndigests;
+	struct mblock *blocks;
+	unsigned nblocks;
+	size_t size;                   /* of the whole file */
+};
+
+/* Frees the parts of a metadata file */
+static void
+mlayout_free(struct mlayout *layout)
+{
+	xfree(layout->list);
+	xfree(layout->digests);
+	xfree(layout->blocks);
+}
+
+/* Lays out a metadata file of given version, returns -1 if out of memory */
+static int
+mlayout_compute(struct mlayout *layout, const struct metahash *mhash,
+                unsigned version)
+{
+	size_t offset = SIGNATURELEN + VERSIONLEN;
+
+	memset(layout, 0, sizeof(*layout));
+	layout->list = mentries_list(mhash, version);
+	if (!layout->list)
+		goto err;
+
+	if (version) {
+		layout->digests = mdigests_compute(layout->list, mhash->count,
+		                                   &layout->ndigests);
+		if (!layout->digests)
+			goto err;
+		if (layout->ndigests)
+			offset += BLOCKHDRLEN + layout->ndigests * DIGESTLEN;
+	}
+
+	layout->blocks = mblocks_split(layout->list, mhash->count, version,
+	                               offset, &layout->nblocks,
+	                               &layout->size);
+	if (!layout->blocks)
+		goto err;
+	return 0;
+
+err:
+	mlayout_free(layout);
+	errno = ENOMEM;
+	return -1;
+}
+
+/* Stores metaentries to an open stream, returns -1 on write errors */
+int
+mentries_tostream(const struct metahash *mhash, FILE *to, unsigned version)
+{
+	const struct metaentry *mentry;
+	struct mlayout layout;
+	size_t len = 0;
+	unsigned i;
+	char *buf;
+	int key;
+
+	mentries_header_write(to, version);
+
+	if (!version) {
+		for (key = 0; key < HASH_INDEXES; key++) {
+			for (mentry = mhash->bucket[key]; mentry;
+			     mentry = mentry->next)
+				mentry_tofile(mentry, to);
+		}
+		return ferror(to) ? -1 : 0;
+	}
+
+	/* Blocks are put together in memory, where they are checksummed */
+	if (mlayout_compute(&layout, mhash, version))
+		return -1;
+	for (i = 0; i < layout.nblocks; i++)
+		if (layout.blocks[i].len > len)
+			len = layout.blocks[i].len;
+	if (layout.ndigests * DIGESTLEN > len)
+		len = layout.ndigests * DIGESTLEN;
+	buf = xmalloc(BLOCKHDRLEN + len, STATS_MEM_BUFFER);
+	if (!buf) {
+		mlayout_free(&layout);
+		return -1;
+	}
+
+	if (layout.ndigests) {
+		mdigests_put(layout.digests, layout.ndigests, buf);
+		write_binary_string(buf, BLOCKHDRLEN +
+		                    layout.ndigests * DIGESTLEN, to);
+	}
+	for (i = 0; i < layout.nblocks; i++) {
+		mblock_put(layout.list, &layout.blocks[i], buf, version);
+		write_binary_string(buf, BLOCKHDRLEN + layout.blocks[i].len,
+		                    to);
+	}
+	mblock_header(buf, 0, mhash->count);
+	write_binary_string(buf, BLOCKHDRLEN, to);
+
+	xfree(buf);
+	mlayout_free(&layout);
+	return ferror(to) ? -1 : 0;
+}
+
+/* Blocks of a metadata file written by one thread */
+struct mwriter {
+	const struct mlayout *layout;
+	unsigned first;          /* first block */
+	unsigned last;           /* block after the last one */
+	char *map;               /* the whole file */
+	unsigned version;
+};
+
+/* Puts the blocks of a writer into memory */
+static void *
+mwriter_put(void *arg)
+{
+	struct mwriter *writer = arg;
+	const struct mlayout *layout = writer->layout;
+	unsigned i;
+
+	for (i = writer->first; i < writer->last; i++)
+		mblock_put(layout->list, &layout->blocks[i],
+		           writer->map + layout->blocks[i].offset,
+		           writer->version);
+
+	return NULL;
+}
+
+/* Stores metaentries to a file through stdio, returns -1 on failure */
+static int
+mentries_tofile_stdio(const struct metahash *mhash, const char *path,
+                      unsigned version)
+{
+	FILE *to;
+	int ret;
+
+	to = fopen(path, "w");
+	if (!to) {
+		msg(MSG_CRITICAL, "Failed to open %s: %s\n",
+		    path, strerror(errno));
+		return -1;
+	}
+
+	ret = mentries_tostream(mhash, to, version);
+	if (fclose(to))
+		ret = -1;
+	if (ret)
+		msg(MSG_CRITICAL, "Failed to write to %s: %s\n",
+		    path, strerror(errno));
+	return ret;
+}
+
+/* Returns the version of a metadata file, -1 if it is missing or invalid */
+int
+mentries_version(const char *path)
+{
+	char buf[SIGNATURELEN + VERSIONLEN];
+	struct stat sbuf;
+	ssize_t len = -1;
+	int fd;
+
+	/* Other than regular files (e.g. /dev/stdout) are not read */
+	fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (!fstat(fd, &sbuf) && S_ISREG(sbuf.st_mode))
+		len = read(fd, buf, sizeof(buf));
+	close(fd);
+
+	if (len != (ssize_t)sizeof(buf) ||
+	    memcmp(buf, SIGNATURE, SIGNATURELEN))
+		return -1;
+	if (!memcmp(buf + SIGNATURELEN, VERSION, VERSIONLEN))
+		return 0;
+	if (!memcmp(buf + SIGNATURELEN, VERSION1, VERSIONLEN))
+		return 1;
+	return -1;
+}
+
+/*
+ * Copies xattrs (with ACLs) of the file at path to fd
+ * - returns -1 if one of them cannot be read or set
+ */
+static int
+mfile_copy_xattrs(const char *path, int fd)
+{
+#if !defined(NO_XATTR) || !(NO_XATTR+0)
+	struct xattrbuf xbuf;
+	ssize_t lsize, vsize;
+	char *name;
+	int ret = -1;
+
+	memset(&xbuf, 0, sizeof(xbuf));
+	lsize = xattrbuf_list(path, &xbuf);
+	if (lsize < 0) {
+		if (errno == ENOTSUP)
+			ret = 0;
+		goto out;
+	}
+
+	for (name = xbuf.list; name < xbuf.list + lsize;
+	     name += strlen(name) + 1) {
+		vsize = xattrbuf_get(path, name, &xbuf);
+		if (vsize < 0 ||
+		    fsetxattr(fd, name, xbuf.value, (size_t)vsize, 0))
+			goto out;
+	}
+	ret = 0;
+
+out:
+	xattrbuf_free(&xbuf);
+	return ret;
+#else
+	(void)path;
+	(void)fd;
+	return 0;
+#endif /* !NO_XATTR */
+}
+
+/*
+ * Stores metaentries to a file of given version, returns -1 on failure
+ * - version -1 keeps the version of the existing file (0 if there is none)
+ * - the size of the file is computed first, entries are put into a new
+ *   file mapped in memory, by several threads if it is large, and the new
+ *   file replaces the old one once it is synced, so readers never see a
+ *   partly written file
+ * - the new file gets mode, owner and xattrs of the old one, and the times
+ *   of the directory are restored after the rename, so that saving does
+ *   not change the mtime of "." just recorded
+ * - other than regular files (e.g. symlinks or /dev/stdout), files with
+ *   several links and files whose attributes cannot be copied are written
+ *   through stdio, as are files whose directory cannot hold the new file
+ */
+int
+mentries_tofile(const struct metahash *mhash, const char *path, int version)
+{
+	static unsigned seq = 0;
+	struct mwriter writers[MTHREADS_MAX];
+	struct timespec dirtimes[2];
+	struct mlayout layout;
+	char tmp[PATH_MAX], dir[PATH_MAX];
+	const char *slash;
+	struct stat sbuf, dbuf;
+	bool exists = true, keepdir = false;
+	size_t size;
+	char *map;
+	unsigned n, i;
+	int fd, ret;
+
+	if (version < 0)
+		version = mentries_version(path) > 0 ? 1 : 0;
+
+	if (lstat(path, &sbuf)) {
+		if (errno != ENOENT)
+			return mentries_tofile_stdio(mhash, path, version);
+		exists = false;
+	} else if (!S_ISREG(sbuf.st_mode) || sbuf.st_nlink > 1) {
+		return mentries_tofile_stdio(mhash, path, version);
+	}
+
+	/* A new file does change its directory, so only replacing one is kept */
+	slash = strrchr(path, '/');
+	if (slash)
+		ret = snprintf(dir, sizeof(dir), "%.*s",
+		               (int)(slash - path + 1), path);
+	else
+		ret = snprintf(dir, sizeof(dir), ".");
+	if (exists && ret >= 0 && (size_t)ret < sizeof(dir) &&
+	    !stat(dir, &dbuf)) {
+		dirtimes[0] = dbuf.st_atim;
+		dirtimes[1] = dbuf.st_mtim;
+		keepdir = true;
+	}
+
+	if (mlayout_compute(&layout, mhash, version))
+		return mentries_tofile_stdio(mhash, path, version);
+	size = layout.size;
+
+	ret = snprintf(tmp, sizeof(tmp), "%s.%ld.%u", path, (long)getpid(),
+	               __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+	fd = -1;
+	if (ret >= 0 && (size_t)ret < sizeof(tmp))
+		fd = open(tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		mlayout_free(&layout);
+		return mentries_tofile_stdio(mhash, path, version);
+	}
+
+	/*
+	 * The new file must get mode, owner and xattrs of the old one, which
+	 * is kept if that is not allowed (e.g. it belongs to another user)
+	 * - blocks are reserved, so running out of space cannot fault later
+	 */
+	map = MAP_FAILED;
+	if (!(exists && (fchmod(fd, sbuf.st_mode & 07777) ||
+	                 fchown(fd, sbuf.st_uid, sbuf.st_gid) ||
+	                 mfile_copy_xattrs(path, fd))) &&
+	    !posix_fallocate(fd, 0, (off_t)size))
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		           fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		unlink(tmp);
+		if (keepdir)
+			utimensat(AT_FDCWD, dir, dirtimes, 0);
+		mlayout_free(&layout);
+		return mentries_tofile_stdio(mhash, path, version);
+	}
+
+	/* Blocks are about the same size, so each thread gets as many */
+	memcpy(map, SIGNATURE, SIGNATURELEN);
+	memcpy(map + SIGNATURELEN, version ? VERSION1 : VERSION, VERSIONLEN);
+	n = mthreads_count(size);
+	for (i = 0; i < n; i++) {
+		writers[i].layout = &layout;
+		writers[i].first = (unsigned)((uint64_t)layout.nblocks * i / n);
+		writers[i].last = (unsigned)((uint64_t)layout.nblocks *
+		                             (i + 1) / n);
+		writers[i].map = map;
+		writers[i].version = version;
+	}
+	mthreads_run(writers, sizeof(struct mwriter), n, mwriter_put);
+
+	if (version && layout.ndigests)
+		mdigests_put(layout.digests, layout.ndigests,
+		             map + SIGNATURELEN + VERSIONLEN);
+	if (version)
+		mblock_header(map + size - BLOCKHDRLEN, 0, mhash->count);
+	mlayout_free(&layout);
+
+	ret = msync(map, size, MS_SYNC);
+	munmap(map, size);
+	if (close(fd))
+		ret = -1;
+	if (!ret)
+		ret = rename(tmp, path);
+	if (ret) {
+		msg(MSG_CRITICAL, "Failed to write to %s: %s\n",
+		    path, strerror(errno));
+		unlink(tmp);
+	}
+
+	/* Not being allowed to (e.g. in a directory of another user) is fine */
+	if (keepdir)
+		utimensat(AT_FDCWD, dir, dirtimes, 0);
+	return ret ? -1 : 0;
+}
+
+/*
+ * Reads a single metaentry from a file
+ * - returns NULL (with *ptr set to NULL) if the file is corrupt, errno is
+ *   set to EINVAL then, or to ENOMEM if out of memory
+ */
+struct metaentry *
+mentry_fromfile(char **ptr, const char *max)
+{
+	struct metaentry *mentry;
+	const char *start;
+	unsigned xattrs;
+	unsigned i;
+	int err;
+
+	mentry = mentry_alloc();
+	if (!mentry) {
+		*ptr = NULL;
+		return NULL;
+	}
+	start = *ptr;
+	mentry->path = read_string(ptr, max, STATS_MEM_PATH);
+	if (*ptr)
+		mentry->pathlen = *ptr - start - 1;
+	mentry->owner = read_string(ptr, max, STATS_MEM_NAME);
+	mentry->group = read_string(ptr, max, STATS_MEM_NAME);
+	mentry->mtime = (time_t)read_int(ptr, 8, max);
+	mentry->mtimensec = (time_t)read_int(ptr, 8, max);
+	mentry->mode = (mode_t)read_int(ptr, 2, max);
+	xattrs = (unsigned)read_int(ptr, 4, max);
+
+	if (!*ptr)
+		goto corrupt;
+
+	if (!xattrs)
+		return mentry;
+
+	/* Each xattr takes at least 5 bytes (empty name and length) */
+	if (xattrs > (size_t)(max - *ptr) / 5) {
+		errno = EINVAL;
+		goto corrupt;
+	}
+
+	if (mentry_alloc_xattrs(mentry, xattrs))
+		goto corrupt;
+
+	for (i = 0; i < mentry->xattrs; i++) {
+		mentry->xattr_names[i] = read_string(ptr, max, STATS_MEM_XNAME);
+		mentry->xattr_lvalues[i] = (int)read_int(ptr, 4, max);
+		mentry->xattr_values[i] = read_binary_string(
+		                           ptr,
+		                           mentry->xattr_lvalues[i],
+		                           max,
+		                           STATS_MEM_XVALUE
+		                          );
+		if (!*ptr)
+			goto corrupt;
+	}
+
+	return mentry;
+
+corrupt:
+	err = errno;
+	*ptr = NULL;
+	mentry_free(mentry);
+	errno = err;
+	return NULL;
+}
+
+/* Opens and maps a file of at least minsize bytes, returns NULL on failure */
+char *
+mfile_map(const char *path, size_t minsize, size_t *size, int *fd)
+{
+	struct stat sbuf;
+	char *mmapstart;
+
+	*fd = open(path, O_RDONLY);
+	if (*fd < 0) {
+		msg(MSG_CRITICAL, "Failed to open %s: %s\n",
+		    path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(*fd, &sbuf)) {
+		msg(MSG_CRITICAL, "Failed to stat %s: %s\n",
+		    path, strerror(errno));
+		goto err;
+	}
+
+	if (sbuf.st_size < (off_t)minsize) {
+		msg(MSG_CRITICAL, "File %s has an invalid size\n", path);
+		errno = EINVAL;
+		goto err;
+	}
+
+	mmapstart = mmap(NULL, (size_t)sbuf.st_size, PROT_READ,
+	                 MAP_SHARED, *fd, 0);
+	if (mmapstart == MAP_FAILED) {
+		msg(MSG_CRITICAL, "Unable to mmap %s: %s\n",
+		    path, strerror(errno));
+		goto err;
+	}
+
+	*size = (size_t)sbuf.st_size;
+	return mmapstart;
+
+err:
+	close(*fd);
+	*fd = -1;
+	return NULL;
+}
+
+/* Unmaps and closes a file mapped by mfile_map */
+void
+mfile_unmap(char *mmapstart, size_t size, int fd)
+{
+	munmap(mmapstart, size);
+	close(fd);
+}
+
+/*
+ * Checks the header of a metadata file of size bytes at buf, named path
+ * - sets up cur to read the entries after it, returns -1 if invalid
+ */
+int
+mentries_header_read(struct mcursor *cur, char *buf, size_t size,
+                     const char *path)
+{
+	size_t len;
+
+	memset(cur, 0, sizeof(*cur));
+	cur->path = path;
+	cur->max = buf + size;
+
+	if (size < SIGNATURELEN + VERSIONLEN) {
+		msg(MSG_CRITICAL, "File %s has an invalid size\n", path);
+		goto err;
+	}
+
+	if (strncmp(buf, SIGNATURE, SIGNATURELEN)) {
+		msg(MSG_CRITICAL, "Invalid signature for file %s\n", path);
+		goto err;
+	}
+
+	if (!memcmp(buf + SIGNATURELEN, VERSION1, VERSIONLEN)) {
+		cur->version = 1;
+	} else if (memcmp(buf + SIGNATURELEN, VERSION, VERSIONLEN)) {
+		msg(MSG_CRITICAL, "Invalid version of file %s\n", path);
+		goto err;
+	}
+	cur->ptr = buf + SIGNATURELEN + VERSIONLEN;
+	cur->end = cur->ptr;
+
+	/* Index block of version 1 files comes first, without entries */
+	if (!cur->version || (size_t)(cur->max - cur->ptr) < BLOCKHDRLEN ||
+	    !(len = (size_t)mload_int(cur->ptr, 4)) ||
+	    mload_int(cur->ptr + 4, 4))
+		return 0;
+
+	if (len > (size_t)(cur->max - cur->ptr) - BLOCKHDRLEN) {
+		msg(MSG_CRITICAL, "File %s is truncated\n", path);
+		goto err;
+	}
+	if (mblock_crc(cur->ptr) != mload_int(cur->ptr + 8, 4)) {
+		msg(MSG_CRITICAL, "Checksum mismatch in file %s\n", path);
+		goto err;
+	}
+	if (len % DIGESTLEN) {
+		msg(MSG_CRITICAL, "Corrupt file %s\n", path);
+		goto err;
+	}
+	cur->index = cur->ptr + BLOCKHDRLEN;
+	cur->nindex = len / DIGESTLEN;
+	cur->ptr += BLOCKHDRLEN + len;
+	cur->end = cur->ptr;
+	return 0;
+
+err:
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Checks the block of a version 1 file at the cursor and enters it
+ * - returns -1 at the trailer (with errno set to 0) or if the block is
+ *   corrupt (EINVAL)
+ */
+static int
+mcursor_block(struct mcursor *cur)
+{
+	const char *hdr = cur->ptr;
+	size_t len;
+
+	if (cur->ptr != cur->end) {
+		msg(MSG_CRITICAL, "Corrupt file %s\n", cur->path);
+		goto err;
+	}
+
+	if ((size_t)(cur->max - hdr) < BLOCKHDRLEN ||
+	    (len = (size_t)mload_int(hdr, 4)) >
+	    (size_t)(cur->max - hdr) - BLOCKHDRLEN) {
+		msg(MSG_CRITICAL, "File %s is truncated\n", cur->path);
+		goto err;
+	}
+
+	if (mblock_crc(hdr) != mload_int(hdr + 8, 4)) {
+		msg(MSG_CRITICAL, "Checksum mismatch in file %s\n", cur->path);
+		goto err;
+	}
+
+	cur->ptr += BLOCKHDRLEN;
+	cur->end = cur->ptr + len;
+	cur->left = (unsigned long)mload_int(hdr + 4, 4);
+
+	/* Trailer holds the number of all entries and ends the file */
+	if (!len) {
+		if (cur->left != cur->count || cur->ptr != cur->max) {
+			msg(MSG_CRITICAL, "Corrupt file %s\n", cur->path);
+			goto err;
+		}
+		cur->left = 0;
+		cur->done = true;
+		errno = 0;
+		return -1;
+	}
+
+	if (!cur->left) {
+		msg(MSG_CRITICAL, "Corrupt file %s\n", cur->path);
+		goto err;
+	}
+	return 0;
+
+err:
+	cur->ptr = NULL;
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Reads the next metaentry from a metadata file, verifying checksums
+ * - returns NULL at the end (with errno set to 0), if the file is corrupt
+ *   (EINVAL) or if out of memory (ENOMEM)
+ */
+struct metaentry *
+mentries_next(struct mcursor *cur)
+{
+	struct metaentry *mentry;
+	const char *lim = cur->max;
+
+	errno = 0;
+	if (!cur->ptr) {
+		/* Stay at the end after a failure */
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (cur->version) {
+		if (!cur->done && !cur->left && mcursor_block(cur))
+			return NULL;
+		if (cur->done)
+			return NULL;
+		lim = cur->end;
+	} else if (cur->ptr >= cur->max) {
+		return NULL;
+	}
+
+	if (cur->ptr < lim && *cur->ptr == '\0') {
+		msg(MSG_CRITICAL, "Invalid characters in file %s\n", cur->path);
+		cur->ptr = NULL;
+		errno = EINVAL;
+		return NULL;
+	}
+
+	mentry = mentry_fromfile(&cur->ptr, lim);
+	if (!mentry && errno != ENOMEM) {
+		msg(MSG_CRITICAL, "Corrupt file %s\n", cur->path);
+		errno = EINVAL;
+	}
+	if (mentry && cur->version)
+		cur->left--;
+	if (mentry)
+		cur->count++;
+	return mentry;
+}
+
+/*
+ * Large files are loaded by several threads, each decoding a range of
+ * entries into lists of its own, which are then merged into the hash
+ * table. Entries of version 0 files are not indexed, so each range
+ * except the first starts at a guessed entry, the first position after
+ * a NUL byte from which a few plausible entries follow. Ranges are
+ * checked to end where the next one starts before any entry is decoded
+ * and those whose guess was wrong are skipped again from the right
+ * place. Ranges of version 1 files start at blocks found by following
+ * block headers, and their checksums are verified while the entries are
+ * skipped. Each merging thread inserts all entries of its own buckets in
+ * file order, so the result is the same as with the serial loader.
+ */
+
+/* Number of entries which must follow a guessed entry start */
+#define LOAD_PROBES     4
+
+/* Range of a metadata file loaded by one thread */
+struct mchunk {
+	const char *start;       /* first entry, or NULL if none was found */
+	const char *end;         /* after the last entry, NULL if invalid */
+	const char *lim;         /* last entry starts before lim */
+	const char *max;         /* end of file */
+	struct metaentry **heads; /* decoded entries, by merging thread */
+	struct metaentry **tails;
+	unsigned long count;     /* entries of blocks (version 1) */
+	int err;                 /* errno if decoding failed */
+};
+
+/* Work of one loading thread */
+struct mloader {
+	struct mchunk *chunks;
+	unsigned nchunks;
+	unsigned idx;            /* chunk decoded or buckets merged */
+	struct metahash *mhash;
+	unsigned version;
+};
+
+/*
+ * Skips a single metaentry accepted by mentry_fromfile, without printing
+ * anything
+ * - plausible also requires a valid mode and nanoseconds, as any entry
+ *   written by metastore has
+ * - returns pointer after the entry or NULL if it is not valid
+ */
+static const char *
+mentry_skip(const char *ptr, const char *max, bool plausible)
+{
+	const char *nul;
+	unsigned xattrs, i;
+	uint64_t len;
+	int field;
+
+	if (ptr >= max || !*ptr)
+		return NULL;
+
+	/* Path, owner and group */
+	for (field = 0; field < 3; field++) {
+		nul = memchr(ptr, '\0', max - ptr);
+		if (!nul)
+			return NULL;
+		ptr = nul + 1;
+	}
+
+	if (max - ptr < 8 + 8 + 2 + 4)
+		return NULL;
+	if (plausible) {
+		switch (mload_int(ptr + 16, 2) & S_IFMT) {
+		case S_IFREG: case S_IFDIR: case S_IFLNK: case S_IFIFO:
+		case S_IFSOCK: case S_IFCHR: case S_IFBLK:
+			break;
+		default:
+			return NULL;
+		}
+		if (mload_int(ptr + 8, 8) >= 1000000000)
+			return NULL;
+	}
+	xattrs = (unsigned)mload_int(ptr + 18, 4);
+	ptr += 8 + 8 + 2 + 4;
+
+	if (xattrs > (size_t)(max - ptr) / 5)
+		return NULL;
+
+	for (i = 0; i < xattrs; i++) {
+		nul = memchr(ptr, '\0', max - ptr);
+		if (!nul || max - nul - 1 < 4)
+			return NULL;
+		ptr = nul + 1;
+		/* Lengths of 2 GiB and more are negative for mentry_fromfile */
+		len = mload_int(ptr, 4);
+		ptr += 4;
+		if (len > INT_MAX || len > (size_t)(max - ptr))
+			return NULL;
+		ptr += len;
+	}
+
+	return ptr;
+}
+
+/*
+ * Skips entries from chunk->start until one starts at or after chunk->lim
+ * - sets chunk->end, to NULL if an invalid entry was found
+ */
+static void
+mchunk_skip(struct mchunk *chunk)
+{
+	const char *ptr = chunk->start;
+
+	while (ptr && ptr < chunk->lim)
+		ptr = mentry_skip(ptr, chunk->max, false);
+	chunk->end = ptr;
+}
+
+/*
+ * Guesses the first entry of a chunk, except the first one, at or after
+ * its start and skips its entries
+ */
+static void *
+mchunk_scan(void *arg)
+{
+	struct mloader *loader = arg;
+	struct mchunk *chunk = &loader->chunks[loader->idx];
+	const char *ptr = chunk->start, *next;
+	int i;
+
+	if (!loader->idx) {
+		mchunk_skip(chunk);
+		return NULL;
+	}
+
+	chunk->start = NULL;
+	for (; ptr < chunk->lim; ptr++) {
+		if (ptr[-1] != '\0')
+			continue;
+		for (next = ptr, i = 0; next && next < chunk->max &&
+		                        i < LOAD_PROBES; i++)
+			next = mentry_skip(next, chunk->max, true);
+		if (next) {
+			chunk->start = ptr;
+			break;
+		}
+	}
+
+	mchunk_skip(chunk);
+	return NULL;
+}
+
+/* Verifies checksums of the blocks of a chunk and skips their entries */
+static void *
+mchunk_verify(void *arg)
+{
+	struct mloader *loader = arg;
+	struct mchunk *chunk = &loader->chunks[loader->idx];
+	const char *ptr = chunk->start, *lim;
+	unsigned long count;
+
+	chunk->count = 0;
+	while (ptr && ptr < chunk->lim) {
+		lim = ptr + BLOCKHDRLEN + mload_int(ptr, 4);
+		count = (unsigned long)mload_int(ptr + 4, 4);
+		if (mblock_crc(ptr) != mload_int(ptr + 8, 4)) {
+			ptr = NULL;
+			break;
+		}
+		chunk->count += count;
+		for (ptr += BLOCKHDRLEN; ptr && ptr < lim && count; count--)
+			ptr = mentry_skip(ptr, lim, false);
+		if (ptr != lim || count)
+			ptr = NULL;
+	}
+
+	chunk->end = ptr;
+	return NULL;
+}
+
+/* Decodes entries of a validated chunk into lists by merging thread */
+static void *
+mchunk_decode(void *arg)
+{
+	struct mloader *loader = arg;
+	struct mchunk *chunk = &loader->chunks[loader->idx];
+	struct metaentry *mentry;
+	char *ptr = (char *)chunk->start;
+	const char *lim;
+	unsigned part;
+
+	while (ptr < chunk->end) {
+		lim = chunk->end;
+		if (loader->version) {
+			lim = ptr + BLOCKHDRLEN + mload_int(ptr, 4);
+			ptr += BLOCKHDRLEN;
 		}
 
-		while ((dent = readdir(dir))) {
-			if (!strcmp(dent->d_name, ".") ||
-			    !strcmp(dent->d_name, "..") ||
-			    (!st->do_git && !strcmp(dent->d_name, ".git"))
-			   )
-				continue;
-			snprintf(tpath, PATH_MAX, "%s/%s", path, dent->d_name);
-			tpath[PATH_MAX - 1] = '\0';
-			mentries_recurse(tpath, mhash, st);
+		while (ptr < lim) {
+			mentry = mentry_fromfile(&ptr, lim);
+			if (!mentry) {
+				chunk->err = errno;
+				return NULL;
+			}
+			mentry->hash = mhash_hash(mentry->path);
+			mentry->next = NULL;
+
+			part = mentry->hash % HASH_INDEXES % loader->nchunks;
+			if (chunk->tails[part])
+				chunk->tails[part]->next = mentry;
+			else
+				chunk->heads[part] = mentry;
+			chunk->tails[part] = mentry;
 		}
+	}
+
+	return NULL;
+}
+
+/* Inserts decoded entries of one merging thread, in file order */
+static void *
+mchunk_merge(void *arg)
+{
+	struct mloader *loader = arg;
+	struct metaentry *mentry, *next;
+	unsigned i;
 
-		closedir(dir);
+	for (i = 0; i < loader->nchunks; i++) {
+		for (mentry = loader->chunks[i].heads[loader->idx]; mentry;
+		     mentry = next) {
+			next = mentry->next;
+			mentry_insert_hashed(mentry, loader->mhash);
+		}
+		loader->chunks[i].heads[loader->idx] = NULL;
 	}
+
+	return NULL;
 }
 
-/* Recurses opath and adds metadata entries to the metaentry list */
-void
-mentries_recurse_path(const char *opath, struct metahash **mhash, msettings *st)
+/*
+ * Starts n chunks of a version 1 file at blocks following the one at ptr
+ * - sets *count to the number of entries held by the trailer
+ * - returns -1 if the blocks do not end with a valid trailer at max
+ */
+static int
+mchunks_blocks(struct mchunk *chunks, unsigned n, const char *ptr,
+               const char *max, unsigned long *count)
 {
-	char *path = normalize_path(opath);
+	const char *first = ptr;
+	size_t len;
+	unsigned i = 0;
+
+	for (;;) {
+		if ((size_t)(max - ptr) < BLOCKHDRLEN)
+			return -1;
+		len = (size_t)mload_int(ptr, 4);
+		if (len > (size_t)(max - ptr) - BLOCKHDRLEN)
+			return -1;
+		if (!len)
+			break;
+		while (i < n && (size_t)(ptr - first) >=
+		                (size_t)(max - first) / n * i)
+			chunks[i++].start = ptr;
+		ptr += BLOCKHDRLEN + len;
+	}
+
+	if (ptr + BLOCKHDRLEN != max ||
+	    mblock_crc(ptr) != mload_int(ptr + 8, 4))
+		return -1;
+	*count = (unsigned long)mload_int(ptr + 4, 4);
+
+	while (i < n)
+		chunks[i++].start = ptr;
+	for (i = 0; i < n; i++)
+		chunks[i].lim = i + 1 < n ? chunks[i + 1].start : ptr;
+	return 0;
+}
+
+/*
+ * Loads entries after cur into mhash with n threads
+ * - returns -1 with errno set to EINVAL if the entries are not valid,
+ *   without loading any, or to ENOMEM if out of memory
+ */
+static int
+mentries_load(struct metahash *mhash, const struct mcursor *cur, unsigned n)
+{
+	struct mloader loaders[MTHREADS_MAX];
+	struct mchunk chunks[MTHREADS_MAX];
+	struct metaentry **lists, *mentry, *next;
+	const char *ptr = cur->ptr, *max = cur->max;
+	const char *expected = ptr;
+	unsigned long count;
+	unsigned i, j;
+	int err = 0;
+
+	lists = xmalloc(2 * n * n * sizeof(struct metaentry *),
+	                STATS_MEM_BUFFER);
+	if (!lists)
+		return -1;
+	memset(lists, 0, 2 * n * n * sizeof(struct metaentry *));
+
+	for (i = 0; i < n; i++) {
+		chunks[i].start = ptr + (size_t)(max - ptr) / n * i;
+		chunks[i].lim = i + 1 < n ?
+		                ptr + (size_t)(max - ptr) / n * (i + 1) : max;
+		chunks[i].max = max;
+		chunks[i].heads = lists + 2 * n * i;
+		chunks[i].tails = lists + 2 * n * i + n;
+		chunks[i].err = 0;
+		loaders[i].chunks = chunks;
+		loaders[i].nchunks = n;
+		loaders[i].idx = i;
+		loaders[i].mhash = mhash;
+		loaders[i].version = cur->version;
+	}
+
+	if (cur->version) {
+		/* Blocks must hold as many entries as the trailer says */
+		if (mchunks_blocks(chunks, n, ptr, max, &count)) {
+			err = EINVAL;
+			goto out;
+		}
+		mthreads_run(loaders, sizeof(struct mloader), n,
+		             mchunk_verify);
+		for (i = 0; i < n; i++) {
+			if (chunks[i].end != chunks[i].lim)
+				err = EINVAL;
+			count -= chunks[i].count;
+		}
+		if (count)
+			err = EINVAL;
+	} else {
+		mthreads_run(loaders, sizeof(struct mloader), n, mchunk_scan);
+
+		/* Skip chunks again where they should have started */
+		for (i = 0; i < n && !err; i++) {
+			if (chunks[i].start != expected) {
+				chunks[i].start = expected;
+				mchunk_skip(&chunks[i]);
+			}
+			if (!chunks[i].end)
+				err = EINVAL;
+			expected = chunks[i].end;
+		}
+	}
+	if (err)
+		goto out;
+
+	mthreads_run(loaders, sizeof(struct mloader), n, mchunk_decode);
+	for (i = 0; i < n; i++)
+		if (chunks[i].err)
+			err = chunks[i].err;
+	if (!err)
+		mthreads_run(loaders, sizeof(struct mloader), n, mchunk_merge);
+
+out:
+	/* Entries are only left if decoding failed */
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < n; j++) {
+			for (mentry = chunks[i].heads[j]; mentry; mentry = next) {
+				next = mentry->next;
+				mentry_free(mentry);
+			}
+		}
+	}
+	xfree(lists);
+	errno = err;
+	return err ? -1 : 0;
+}
+
+/*
+ * Creates a metaentry list from file contents in memory, named path
+ * - returns -1 if the contents are invalid, after loading all valid entries
+ */
+int
+mentries_frombuffer(struct metahash **mhash, char *buf, size_t size,
+                    const char *path)
+{
+	struct metaentry *mentry;
+	struct mcursor cur;
+	unsigned threads;
 
 	if (!(*mhash))
 		*mhash = mhash_alloc();
-	mentries_recurse(path, *mhash, st);
-	free(path);
+	if (!(*mhash))
+		return -1;
+
+	if (mentries_header_read(&cur, buf, size, path))
+		return -1;
+
+	/* Invalid files are loaded serially again, to report the error */
+	threads = mthreads_count(size);
+	if (threads > 1 && !mentries_load(*mhash, &cur, threads))
+		return 0;
+	if (threads > 1 && errno == ENOMEM)
+		return -1;
+
+	while ((mentry = mentries_next(&cur)))
+		mentry_insert(mentry, *mhash);
+
+	return errno ? -1 : 0;
 }
 
-/* Stores metaentries to a file */
-void
-mentries_tofile(const struct metahash *mhash, const char *path)
+/* Creates a metaentry list from a file, returns -1 on failure */
+int
+mentries_fromfile(struct metahash **mhash, const char *path)
+{
+	char *mmapstart;
+	int fd;
+	size_t size;
+	int ret;
+	int err;
+
+	mmapstart = mfile_map(path, SIGNATURELEN + VERSIONLEN, &size, &fd);
+	if (!mmapstart)
+		return -1;
+
+	ret = mentries_frombuffer(mhash, mmapstart, size, path);
+	err = errno;
+	mfile_unmap(mmapstart, size, fd);
+	errno = err;
+	return ret;
+}
+
+/* Searches haystack for an xattr matching xattr number n in needle */
+int
+mentry_find_xattr(struct metaentry *haystack, struct metaentry *needle,
+                  unsigned n)
 {
-	FILE *to;
-	const struct metaentry *mentry;
-	int key;
 	unsigned i;
 
-	to = fopen(path, "w");
-	if (!to) {
-		msg(MSG_CRITICAL, "Failed to open %s: %s\n",
-		    path, strerror(errno));
-		exit(EXIT_FAILURE);
+	for (i = 0; i < haystack->xattrs; i++) {
+		if (strcmp(haystack->xattr_names[i], needle->xattr_names[n]))
+			continue;
+		if (haystack->xattr_lvalues[i] != needle->xattr_lvalues[n])
+			return -1;
+		if (bcmp(haystack->xattr_values[i], needle->xattr_values[n],
+		         needle->xattr_lvalues[n])
+		   )
+			return -1;
+		return i;
 	}
+	return -1;
+}
 
-	write_binary_string(SIGNATURE, SIGNATURELEN, to);
-	write_binary_string(VERSION, VERSIONLEN, to);
+/* Returns zero if all xattrs in left and right match */
+static int
+mentry_compare_xattr(struct metaentry *left, struct metaentry *right)
+{
+	unsigned i;
 
-	for (key = 0; key < HASH_INDEXES; key++) {
-		for (mentry = mhash->bucket[key]; mentry; mentry = mentry->next) {
-			write_string(mentry->path, to);
-			write_string(mentry->owner, to);
-			write_string(mentry->group, to);
-			write_int((uint64_t)mentry->mtime, 8, to);
-			write_int((uint64_t)mentry->mtimensec, 8, to);
-			write_int((uint64_t)mentry->mode, 2, to);
-			write_int(mentry->xattrs, 4, to);
-			for (i = 0; i < mentry->xattrs; i++) {
-				write_string(mentry->xattr_names[i], to);
-				write_int(mentry->xattr_lvalues[i], 4, to);
-				write_binary_string(mentry->xattr_values[i],
-				                    mentry->xattr_lvalues[i], to);
-			}
+	if (left->xattrs != right->xattrs)
+		return 1;
+
+	/* Make sure all xattrs in left are found in right and vice versa */
+	for (i = 0; i < left->xattrs; i++) {
+		if (   mentry_find_xattr(right, left, i) < 0
+		    || mentry_find_xattr(left, right, i) < 0
+		   ) {
+			return 1;
 		}
 	}
 
-	fclose(to);
+	return 0;
+}
+
+/* Compares two metaentries and returns an int with a bitmask of differences */
+int
+mentry_compare(struct metaentry *left, struct metaentry *right, msettings *st)
+{
+	int retval = DIFF_NONE;
+
+	if (!left || !right) {
+		msg(MSG_ERROR, "%s called with empty list\n", __func__);
+		return -1;
+	}
+
+	if (strcmp(left->path, right->path))
+		return -1;
+
+	if (st->fields & FIELD_OWNER && strcmp(left->owner, right->owner))
+		retval |= DIFF_OWNER;
+
+	if (st->fields & FIELD_GROUP && strcmp(left->group, right->group))
+		retval |= DIFF_GROUP;
+
+	if (st->fields & FIELD_MODE &&
+	    (left->mode & 07777) != (right->mode & 07777))
+		retval |= DIFF_MODE;
+
+	if ((left->mode & S_IFMT) != (right->mode & S_IFMT))
+		retval |= DIFF_TYPE;
+
+	if (st->do_mtime && st->fields & FIELD_MTIME &&
+	    (!st->metafile || strcmp(left->path, st->metafile)) &&
+	    (   left->mtime     != right->mtime
+	     || left->mtimensec != right->mtimensec)
+	   )
+		retval |= DIFF_MTIME;
+
+	if (st->fields & FIELD_XATTR && mentry_compare_xattr(left, right)) {
+		retval |= DIFF_XATTR;
+		return retval;
+	}
+
+	return retval;
 }
 
-/* Creates a metaentry list from a file */
+/* Compares lists of real and stored metadata and calls pfunc for each */
 void
-mentries_fromfile(struct metahash **mhash, const char *path)
+mentries_compare(struct metahash *mhashreal,
+                 struct metahash *mhashstored,
+                 void (*pfunc)
+                 (struct metaentry *real, struct metaentry *stored, int cmp,
+                  void *arg),
+                 void *arg,
+                 msettings *st)
 {
-	struct metaentry *mentry;
-	char *mmapstart;
-	char *ptr;
-	char *max;
+	struct metaentry *real, *stored;
+	int key;
+
+	if (!mhashreal || !mhashstored) {
+		msg(MSG_ERROR, "%s called with empty list\n", __func__);
+		return;
+	}
+
+	for (key = 0; key < HASH_INDEXES; key++) {
+		for (real = mhashreal->bucket[key]; real; real = real->next) {
+			stored = mentry_find(real->path, mhashstored);
+
+			if (!stored)
+				pfunc(real, NULL, DIFF_ADDED, arg);
+			else
+				pfunc(real, stored, mentry_compare(real, stored, st),
+				      arg);
+		}
+
+		for (stored = mhashstored->bucket[key]; stored; stored = stored->next) {
+			real = mentry_find(stored->path, mhashreal);
+
+			if (!real)
+				pfunc(NULL, stored, DIFF_DELE, arg);
+		}
+	}
+}
+
+/*
+ * Skips entries of a version 1 file up to entry number k, without reading
+ * whole blocks in between, returns -1 if the file is corrupt
+ */
+static int
+mcursor_seek(struct mcursor *cur, unsigned long k)
+{
+	const char *hdr;
+	unsigned long count;
+	size_t len;
+
+	while (cur->ptr && !cur->done && cur->count < k) {
+		if (cur->left && k - cur->count >= cur->left) {
+			cur->ptr = (char *)cur->end;
+			cur->count += cur->left;
+			cur->left = 0;
+		} else if (cur->left) {
+			cur->ptr = (char *)mentry_skip(cur->ptr, cur->end,
+			                               false);
+			if (!cur->ptr)
+				break;
+			cur->count++;
+			cur->left--;
+		} else {
+			/* Checksums of skipped blocks are not needed */
+			hdr = cur->ptr;
+			if (hdr == cur->end &&
+			    (size_t)(cur->max - hdr) >= BLOCKHDRLEN) {
+				len = (size_t)mload_int(hdr, 4);
+				count = (unsigned long)mload_int(hdr + 4, 4);
+				if (count && k - cur->count >= count &&
+				    len <= (size_t)(cur->max - hdr) -
+				           BLOCKHDRLEN) {
+					cur->ptr += BLOCKHDRLEN + len;
+					cur->end = cur->ptr;
+					cur->count += count;
+					continue;
+				}
+			}
+			if (mcursor_block(cur) && errno)
+				return -1;
+		}
+	}
+
+	if (cur->ptr && cur->count == k)
+		return 0;
+	if (cur->ptr || cur->left)
+		msg(MSG_CRITICAL, "Corrupt file %s\n", cur->path);
+	cur->ptr = NULL;
+	errno = EINVAL;
+	return -1;
+}
+
+/* Metadata file compared or merged in path order */
+struct mside {
+	struct mcursor cur;
+	char *mmapstart;          /* NULL if entries were loaded into list */
+	size_t size;
 	int fd;
+	struct metaentry **list;  /* loaded entries sorted by path */
+	unsigned long nlist;
+	unsigned long ilist;      /* number of the next entry in list */
+	struct metaentry *mentry; /* current entry */
+	unsigned long idx;        /* number of the current entry */
+	bool kept;                /* current entry was passed on, not freed */
+};
+
+/* Opens a metadata file for comparing, returns -1 on failure */
+static int
+mside_open(struct mside *side, const char *path)
+{
+	memset(side, 0, sizeof(*side));
+	side->mmapstart = mfile_map(path, SIGNATURELEN + VERSIONLEN,
+	                            &side->size, &side->fd);
+	if (!side->mmapstart)
+		return -1;
+
+	if (mentries_header_read(&side->cur, side->mmapstart, side->size,
+	                         path)) {
+		mfile_unmap(side->mmapstart, side->size, side->fd);
+		side->mmapstart = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Opens a metadata file for merging, returns -1 on failure
+ * - entries of version 0 files are loaded and sorted by path
+ * - an empty file has no entries (e.g. a base given by git for files added
+ *   on both sides)
+ */
+static int
+mside_load(struct mside *side, const char *path)
+{
+	struct metahash *mhash = NULL;
 	struct stat sbuf;
-	unsigned i;
+	int ret;
 
-	if (!(*mhash))
-		*mhash = mhash_alloc();
+	memset(side, 0, sizeof(*side));
+	if (!stat(path, &sbuf) && sbuf.st_size == 0) {
+		side->cur.path = path;
+		return 0;
+	}
 
-	fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		msg(MSG_CRITICAL, "Failed to open %s: %s\n",
-		    path, strerror(errno));
-		exit(EXIT_FAILURE);
+	if (mside_open(side, path))
+		return -1;
+	if (side->cur.version)
+		return 0;
+
+	ret = mentries_frombuffer(&mhash, side->mmapstart, side->size, path);
+	mfile_unmap(side->mmapstart, side->size, side->fd);
+	side->mmapstart = NULL;
+	if (!ret) {
+		side->list = (struct metaentry **)mentries_list(mhash, true);
+		if (side->list) {
+			side->nlist = mhash->count;
+			mhash_free(mhash);
+			return 0;
+		}
+		msg(MSG_CRITICAL, "Failed to sort entries of %s: %s\n",
+		    path, strerror(ENOMEM));
+		errno = ENOMEM;
 	}
+	ret = errno;
+	mentries_free(mhash);
+	errno = ret;
+	return -1;
+}
 
-	if (fstat(fd, &sbuf)) {
-		msg(MSG_CRITICAL, "Failed to stat %s: %s\n",
-		    path, strerror(errno));
-		exit(EXIT_FAILURE);
+/* Closes a metadata file opened for comparing or merging */
+static void
+mside_close(struct mside *side)
+{
+	if (!side->kept)
+		mentry_free(side->mentry);
+	if (side->mmapstart)
+		mfile_unmap(side->mmapstart, side->size, side->fd);
+	while (side->ilist < side->nlist)
+		mentry_free(side->list[side->ilist++]);
+	xfree(side->list);
+}
+
+/* Reads the next entry, which must follow the current one in path order */
+static int
+mside_next(struct mside *side)
+{
+	struct metaentry *prev = side->mentry;
+	bool kept = side->kept;
+	int ret = 0;
+
+	side->kept = false;
+	if (side->mmapstart) {
+		side->idx = side->cur.count;
+		side->mentry = mentries_next(&side->cur);
+		if (!side->mentry && errno)
+			ret = -1;
+	} else {
+		side->idx = side->ilist;
+		side->mentry = side->ilist < side->nlist ?
+		               side->list[side->ilist++] : NULL;
 	}
 
-	if (sbuf.st_size < (SIGNATURELEN + VERSIONLEN)) {
-		msg(MSG_CRITICAL, "File %s has an invalid size\n", path);
-		exit(EXIT_FAILURE);
+	if (!ret && prev && side->mentry &&
+	    mentry_path_cmp(prev->path, side->mentry->path) >= 0) {
+		msg(MSG_CRITICAL, "Unsorted entries in file %s\n",
+		    side->cur.path);
+		errno = EINVAL;
+		ret = -1;
+	}
+
+	if (!kept)
+		mentry_free(prev);
+	return ret;
+}
+
+/* Finds the digest of the current entry, returns false if it has none */
+static bool
+mside_digest(const struct mside *side, unsigned long *count,
+             const char **digest)
+{
+	const char *rec;
+	unsigned long lo = 0, hi = side->cur.nindex, mid, first;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		rec = side->cur.index + mid * DIGESTLEN;
+		first = (unsigned long)mload_int(rec, 4);
+		if (first == side->idx) {
+			*count = (unsigned long)mload_int(rec + 4, 4);
+			*digest = rec + 8;
+			return *count > 0;
+		}
+		if (first < side->idx)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return false;
+}
+
+/* Compares metadata files in memory, for version 0 files */
+static int
+mentries_compare_loaded(const char *storedpath, const char *realpath,
+                        void (*pfunc)
+                        (struct metaentry *real, struct metaentry *stored,
+                         int cmp, void *arg),
+                        void *arg,
+                        msettings *st)
+{
+	struct metahash *stored = NULL, *real = NULL;
+	int ret = -1;
+
+	if (!mentries_fromfile(&stored, storedpath) &&
+	    !mentries_fromfile(&real, realpath)) {
+		mentries_compare(real, stored, pfunc, arg, st);
+		ret = 0;
 	}
 
-	mmapstart = mmap(NULL, (size_t)sbuf.st_size, PROT_READ,
-	                 MAP_SHARED, fd, 0);
-	if (mmapstart == MAP_FAILED) {
-		msg(MSG_CRITICAL, "Unable to mmap %s: %s\n",
-		    path, strerror(errno));
-		exit(EXIT_FAILURE);
+	mentries_free(stored);
+	mentries_free(real);
+	return ret;
+}
+
+/*
+ * Compares metadata files storedpath and realpath and calls pfunc for each
+ * pair of entries as mentries_compare does, returns -1 on failure
+ * - version 1 files are read side by side in path order and subtrees with
+ *   equal digests are skipped, only their top directory is passed to pfunc
+ * - other files are loaded and compared in memory
+ */
+int
+mentries_compare_files(const char *storedpath, const char *realpath,
+                       void (*pfunc)
+                       (struct metaentry *real, struct metaentry *stored,
+                        int cmp, void *arg),
+                       void *arg,
+                       msettings *st)
+{
+	struct mside stored, real;
+	unsigned long scount, rcount;
+	const char *sdigest, *rdigest;
+	bool same;
+	int cmp, ret = -1;
+
+	if (mside_open(&stored, storedpath))
+		return -1;
+	if (mside_open(&real, realpath)) {
+		mside_close(&stored);
+		return -1;
 	}
-	ptr = mmapstart;
-	max = mmapstart + sbuf.st_size;
 
-	if (strncmp(ptr, SIGNATURE, SIGNATURELEN)) {
-		msg(MSG_CRITICAL, "Invalid signature for file %s\n", path);
-		goto out;
+	if (!stored.cur.version || !real.cur.version) {
+		mside_close(&stored);
+		mside_close(&real);
+		return mentries_compare_loaded(storedpath, realpath, pfunc,
+		                               arg, st);
 	}
-	ptr += SIGNATURELEN;
 
-	if (strncmp(ptr, VERSION, VERSIONLEN)) {
-		msg(MSG_CRITICAL, "Invalid version of file %s\n", path);
+	if (mside_next(&stored) || mside_next(&real))
 		goto out;
-	}
-	ptr += VERSIONLEN;
 
-	while (ptr < mmapstart + sbuf.st_size) {
-		if (*ptr == '\0') {
-			msg(MSG_CRITICAL, "Invalid characters in file %s\n",
-			    path);
-			goto out;
+	while (stored.mentry || real.mentry) {
+		cmp = !stored.mentry ? 1 : !real.mentry ? -1 :
+		      mentry_path_cmp(stored.mentry->path, real.mentry->path);
+		if (cmp < 0) {
+			pfunc(NULL, stored.mentry, DIFF_DELE, arg);
+			if (mside_next(&stored))
+				goto out;
+			continue;
 		}
-
-		mentry = mentry_alloc();
-		mentry->path = read_string(&ptr, max);
-		mentry->pathlen = strlen(mentry->path);
-		mentry->owner = read_string(&ptr, max);
-		mentry->group = read_string(&ptr, max);
-		mentry->mtime = (time_t)read_int(&ptr, 8, max);
-		mentry->mtimensec = (time_t)read_int(&ptr, 8, max);
-		mentry->mode = (mode_t)read_int(&ptr, 2, max);
-		mentry->xattrs = (unsigned)read_int(&ptr, 4, max);
-
-		if (!mentry->xattrs) {
-			mentry_insert(mentry, *mhash);
+		if (cmp > 0) {
+			pfunc(real.mentry, NULL, DIFF_ADDED, arg);
+			if (mside_next(&real))
+				goto out;
 			continue;
 		}
 
-		mentry->xattr_names   = xmalloc(mentry->xattrs * sizeof(char *));
-		mentry->xattr_lvalues = xmalloc(mentry->xattrs * sizeof(ssize_t));
-		mentry->xattr_values  = xmalloc(mentry->xattrs * sizeof(char *));
-
-		for (i = 0; i < mentry->xattrs; i++) {
-			mentry->xattr_names[i] = read_string(&ptr, max);
-			mentry->xattr_lvalues[i] = (int)read_int(&ptr, 4, max);
-			mentry->xattr_values[i] = read_binary_string(
-			                           &ptr,
-			                           mentry->xattr_lvalues[i],
-			                           max
-			                          );
+		same = mside_digest(&stored, &scount, &sdigest) &&
+		       mside_digest(&real, &rcount, &rdigest) &&
+		       scount == rcount &&
+		       !memcmp(sdigest, rdigest, SHA256_LEN);
+		if (same) {
+			pfunc(real.mentry, stored.mentry, DIFF_NONE, arg);
+			if (mcursor_seek(&stored.cur, stored.idx + scount) ||
+			    mcursor_seek(&real.cur, real.idx + rcount))
+				goto out;
+		} else {
+			pfunc(real.mentry, stored.mentry,
+			      mentry_compare(real.mentry, stored.mentry, st),
+			      arg);
 		}
-		mentry_insert(mentry, *mhash);
+		if (mside_next(&stored) || mside_next(&real))
+			goto out;
 	}
+	ret = 0;
 
 out:
-	munmap(mmapstart, sbuf.st_size);
-	close(fd);
+	mside_close(&stored);
+	mside_close(&real);
+	return ret;
 }
 
-/* Searches haystack for an xattr matching xattr number n in needle */
-int
-mentry_find_xattr(struct metaentry *haystack, struct metaentry *needle,
-                  unsigned n)
+/* Every field counts when merging */
+static const struct metasettings merge_settings = {
+	.fields = FIELDS_ALL,
+	.do_mtime = true,
+};
+
+/* Sides whose value of a field is kept by a merge */
+#define MERGE_OURS     0
+#define MERGE_THEIRS   1
+#define MERGE_CONFLICT 2
+
+/*
+ * Picks the side whose value of a field is kept, given which of its values
+ * in base, ours and theirs are equal, so that a change made on one side wins
+ */
+static int
+merge_pick(bool ours_base, bool theirs_base, bool ours_theirs)
+{
+	if (ours_theirs || theirs_base)
+		return MERGE_OURS;
+	if (ours_base)
+		return MERGE_THEIRS;
+	return MERGE_CONFLICT;
+}
+
+/* Finds xattr name in mentry (if any), returns its number or -1 */
+static int
+mentry_xattr_index(const struct metaentry *mentry, const char *name)
 {
 	unsigned i;
 
-	for (i = 0; i < haystack->xattrs; i++) {
-		if (strcmp(haystack->xattr_names[i], needle->xattr_names[n]))
-			continue;
-		if (haystack->xattr_lvalues[i] != needle->xattr_lvalues[n])
-			return -1;
-		if (bcmp(haystack->xattr_values[i], needle->xattr_values[n],
-		         needle->xattr_lvalues[n])
-		   )
-			return -1;
-		return i;
-	}
+	if (!mentry)
+		return -1;
+
+	for (i = 0; i < mentry->xattrs; i++)
+		if (mentry->xattr_names[i] &&
+		    !strcmp(mentry->xattr_names[i], name))
+			return (int)i;
 	return -1;
 }
 
-/* Returns zero if all xattrs in left and right match */
+/* Checks whether xattr l of left equals xattr r of right, -1 is none */
+static bool
+mxattr_equal(const struct metaentry *left, int l,
+             const struct metaentry *right, int r)
+{
+	if (l < 0 || r < 0)
+		return l < 0 && r < 0;
+
+	return left->xattr_lvalues[l] == right->xattr_lvalues[r] &&
+	       !bcmp(left->xattr_values[l], right->xattr_values[r],
+	             left->xattr_lvalues[l]);
+}
+
+/* Moves xattr n of from to the end of xattrs of to */
+static void
+mxattr_move(struct metaentry *to, struct metaentry *from, unsigned n)
+{
+	to->xattr_names[to->xattrs] = from->xattr_names[n];
+	to->xattr_values[to->xattrs] = from->xattr_values[n];
+	to->xattr_lvalues[to->xattrs++] = from->xattr_lvalues[n];
+	from->xattr_names[n] = NULL;
+	from->xattr_values[n] = NULL;
+}
+
+/*
+ * Merges xattrs of theirs into ours one by one
+ * - returns DIFF_XATTR if some of them conflict (ours are kept), DIFF_NONE
+ *   if not or -1 on failure
+ */
 static int
-mentry_compare_xattr(struct metaentry *left, struct metaentry *right)
+mentry_merge_xattrs(const struct metaentry *base, struct metaentry *ours,
+                    struct metaentry *theirs)
 {
+	struct metaentry merged;
 	unsigned i;
+	int b, t, ret = DIFF_NONE;
 
-	if (left->xattrs != right->xattrs)
-		return 1;
+	memset(&merged, 0, sizeof(merged));
+	if (mentry_alloc_xattrs(&merged, ours->xattrs + theirs->xattrs)) {
+		xfree(merged.xattr_names);
+		xfree(merged.xattr_values);
+		xfree(merged.xattr_lvalues);
+		return -1;
+	}
+	merged.xattrs = 0;
+
+	for (i = 0; i < ours->xattrs; i++) {
+		t = mentry_xattr_index(theirs, ours->xattr_names[i]);
+		b = mentry_xattr_index(base, ours->xattr_names[i]);
+		switch (merge_pick(mxattr_equal(ours, (int)i, base, b),
+		                   mxattr_equal(theirs, t, base, b),
+		                   mxattr_equal(ours, (int)i, theirs, t))) {
+		case MERGE_CONFLICT:
+			ret = DIFF_XATTR;
+			/* FALLTHROUGH */
+		case MERGE_OURS:
+			mxattr_move(&merged, ours, i);
+			break;
+		case MERGE_THEIRS:
+			if (t >= 0)
+				mxattr_move(&merged, theirs, (unsigned)t);
+			break;
+		}
 
-	/* Make sure all xattrs in left are found in right and vice versa */
-	for (i = 0; i < left->xattrs; i++) {
-		if (   mentry_find_xattr(right, left, i) < 0
-		    || mentry_find_xattr(left, right, i) < 0
-		   ) {
-			return 1;
+		/* Only xattrs missing in ours are left in theirs */
+		if (t >= 0) {
+			xfree(theirs->xattr_names[t]);
+			theirs->xattr_names[t] = NULL;
 		}
 	}
 
-	return 0;
+	for (i = 0; i < theirs->xattrs; i++) {
+		if (!theirs->xattr_names[i])
+			continue;
+		b = mentry_xattr_index(base, theirs->xattr_names[i]);
+		switch (merge_pick(b < 0, mxattr_equal(theirs, (int)i, base, b),
+		                   false)) {
+		case MERGE_CONFLICT:
+			ret = DIFF_XATTR;
+			break;
+		case MERGE_THEIRS:
+			mxattr_move(&merged, theirs, i);
+			break;
+		}
+	}
+
+	/* Xattrs not moved were replaced or removed by theirs */
+	for (i = 0; i < ours->xattrs; i++) {
+		xfree(ours->xattr_names[i]);
+		xfree(ours->xattr_values[i]);
+	}
+	xfree(ours->xattr_names);
+	xfree(ours->xattr_values);
+	xfree(ours->xattr_lvalues);
+	ours->xattr_names = merged.xattr_names;
+	ours->xattr_values = merged.xattr_values;
+	ours->xattr_lvalues = merged.xattr_lvalues;
+	ours->xattrs = merged.xattrs;
+	return ret;
 }
 
-/* Compares two metaentries and returns an int with a bitmask of differences */
-int
-mentry_compare(struct metaentry *left, struct metaentry *right, msettings *st)
+/* Compares mtimes of left and right, returns <0, 0 or >0 as strcmp does */
+static int
+mentry_mtime_cmp(const struct metaentry *left, const struct metaentry *right)
 {
-	int retval = DIFF_NONE;
+	if (left->mtime != right->mtime)
+		return left->mtime < right->mtime ? -1 : 1;
+	if (left->mtimensec != right->mtimensec)
+		return left->mtimensec < right->mtimensec ? -1 : 1;
+	return 0;
+}
 
-	if (!left || !right) {
-		msg(MSG_ERROR, "%s called with empty list\n", __func__);
-		return -1;
-	}
+/* Swaps strings of ours and theirs, so that theirs is kept in ours */
+static void
+mstring_take(char **ours, char **theirs)
+{
+	char *tmp = *ours;
 
-	if (strcmp(left->path, right->path))
-		return -1;
+	*ours = *theirs;
+	*theirs = tmp;
+}
 
-	if (strcmp(left->owner, right->owner))
-		retval |= DIFF_OWNER;
+/*
+ * Merges entries of a path in base, ours and theirs (NULL where it is
+ * missing) into *keep, which is set to ours, theirs or NULL if the path is
+ * removed
+ * - conflicts are reported and keep what ours has
+ * - returns 1 if there were conflicts, 0 if not or -1 on failure
+ */
+static int
+mentry_merge(const struct metaentry *base, struct metaentry *ours,
+             struct metaentry *theirs, struct metaentry **keep)
+{
+	struct metaentry *changed = ours ? ours : theirs;
+	int diff, pick, xattr, conflict = DIFF_NONE;
+
+	*keep = ours;
+	if (!ours || !theirs) {
+		/* Added on one side or removed on a side and kept on the other */
+		if (!base) {
+			*keep = changed;
+			return 0;
+		}
+		if (!changed ||
+		    !mentry_compare((struct metaentry *)base, changed,
+		                    &merge_settings)) {
+			*keep = NULL;
+			return 0;
+		}
+		msg(MSG_QUIET, "%s:\tconflict: removed in %s, changed in %s\n",
+		    base->path, ours ? "theirs" : "ours",
+		    ours ? "ours" : "theirs");
+		return 1;
+	}
 
-	if (strcmp(left->group, right->group))
-		retval |= DIFF_GROUP;
+	diff = mentry_compare(ours, theirs, &merge_settings);
+	if (diff == DIFF_NONE)
+		return 0;
+
+	if (diff & DIFF_OWNER) {
+		switch (merge_pick(base && !strcmp(ours->owner, base->owner),
+		                   base && !strcmp(theirs->owner, base->owner),
+		                   false)) {
+		case MERGE_THEIRS:
+			mstring_take(&ours->owner, &theirs->owner);
+			break;
+		case MERGE_CONFLICT:
+			conflict |= DIFF_OWNER;
+			break;
+		}
+	}
 
-	if ((left->mode & 07777) != (right->mode & 07777))
-		retval |= DIFF_MODE;
+	if (diff & DIFF_GROUP) {
+		switch (merge_pick(base && !strcmp(ours->group, base->group),
+		                   base && !strcmp(theirs->group, base->group),
+		                   false)) {
+		case MERGE_THEIRS:
+			mstring_take(&ours->group, &theirs->group);
+			break;
+		case MERGE_CONFLICT:
+			conflict |= DIFF_GROUP;
+			break;
+		}
+	}
 
-	if ((left->mode & S_IFMT) != (right->mode & S_IFMT))
-		retval |= DIFF_TYPE;
+	/* Type and permissions are merged together */
+	if (diff & (DIFF_MODE | DIFF_TYPE)) {
+		switch (merge_pick(base && ours->mode == base->mode,
+		                   base && theirs->mode == base->mode,
+		                   false)) {
+		case MERGE_THEIRS:
+			ours->mode = theirs->mode;
+			break;
+		case MERGE_CONFLICT:
+			conflict |= diff & (DIFF_MODE | DIFF_TYPE);
+			break;
+		}
+	}
 
-	if (st->do_mtime && strcmp(left->path, st->metafile) &&
-	    (   left->mtime     != right->mtime
-	     || left->mtimensec != right->mtimensec)
-	   )
-		retval |= DIFF_MTIME;
+	/*
+	 * Mtime changed on both sides means that the file was modified on
+	 * both (e.g. a directory in which each branch added or removed
+	 * files), so both changes are in the merged tree and the later mtime
+	 * is the one it would have
+	 */
+	if (diff & DIFF_MTIME) {
+		pick = merge_pick(base && !mentry_mtime_cmp(ours, base),
+		                  base && !mentry_mtime_cmp(theirs, base),
+		                  false);
+		if (pick == MERGE_CONFLICT &&
+		    mentry_mtime_cmp(theirs, ours) > 0)
+			pick = MERGE_THEIRS;
+		if (pick == MERGE_THEIRS) {
+			ours->mtime = theirs->mtime;
+			ours->mtimensec = theirs->mtimensec;
+		}
+	}
 
-	if (mentry_compare_xattr(left, right)) {
-		retval |= DIFF_XATTR;
-		return retval;
+	if (diff & DIFF_XATTR) {
+		xattr = mentry_merge_xattrs(base, ours, theirs);
+		if (xattr < 0)
+			return -1;
+		conflict |= xattr;
 	}
 
-	return retval;
+	if (conflict == DIFF_NONE)
+		return 0;
+
+	msg(MSG_QUIET, "%s:\tconflict: ", ours->path);
+	if (conflict & DIFF_OWNER)
+		msg(MSG_QUIET, "owner ");
+	if (conflict & DIFF_GROUP)
+		msg(MSG_QUIET, "group ");
+	if (conflict & DIFF_MODE)
+		msg(MSG_QUIET, "mode ");
+	if (conflict & DIFF_TYPE)
+		msg(MSG_QUIET, "type ");
+	if (conflict & DIFF_XATTR)
+		msg(MSG_QUIET, "xattr ");
+	msg(MSG_QUIET, "\n");
+	return 1;
 }
 
-/* Compares lists of real and stored metadata and calls pfunc for each */
-void
-mentries_compare(struct metahash *mhashreal,
-                 struct metahash *mhashstored,
-                 void (*pfunc)
-                 (struct metaentry *real, struct metaentry *stored, int cmp),
-                 msettings *st)
+/* Returns the current entry of side if it has given path */
+static struct metaentry *
+mside_at(const struct mside *side, const char *path)
 {
-	struct metaentry *real, *stored;
-	int key;
-
-	if (!mhashreal || !mhashstored) {
-		msg(MSG_ERROR, "%s called with empty list\n", __func__);
-		return;
-	}
+	if (side->mentry && !strcmp(side->mentry->path, path))
+		return side->mentry;
+	return NULL;
+}
 
-	for (key = 0; key < HASH_INDEXES; key++) {
-		for (real = mhashreal->bucket[key]; real; real = real->next) {
-			stored = mentry_find(real->path, mhashstored);
+/*
+ * Merges changes made to metadata file basepath in ourspath and theirspath
+ * and saves the result to ourspath, as git merge drivers do
+ * - version 1 files are read side by side in path order, others are loaded
+ *   and sorted first
+ * - returns the number of paths with conflicts or -1 on failure
+ */
+int
+mentries_merge(const char *basepath, const char *ourspath,
+               const char *theirspath, int version)
+{
+	struct mside base, ours, theirs;
+	struct metahash *merged;
+	struct metaentry *b, *o, *t, *keep;
+	const char *path;
+	int conflicts = 0, ret = -1, n;
+
+	memset(&base, 0, sizeof(base));
+	memset(&ours, 0, sizeof(ours));
+	memset(&theirs, 0, sizeof(theirs));
+
+	merged = mhash_alloc();
+	if (!merged ||
+	    mside_load(&base, basepath) || mside_load(&ours, ourspath) ||
+	    mside_load(&theirs, theirspath))
+		goto out;
 
-			if (!stored)
-				pfunc(real, NULL, DIFF_ADDED);
-			else
-				pfunc(real, stored, mentry_compare(real, stored, st));
-		}
+	if (mside_next(&base) || mside_next(&ours) || mside_next(&theirs))
+		goto out;
 
-		for (stored = mhashstored->bucket[key]; stored; stored = stored->next) {
-			real = mentry_find(stored->path, mhashreal);
+	while (base.mentry || ours.mentry || theirs.mentry) {
+		path = NULL;
+		if (base.mentry)
+			path = base.mentry->path;
+		if (ours.mentry &&
+		    (!path || mentry_path_cmp(ours.mentry->path, path) < 0))
+			path = ours.mentry->path;
+		if (theirs.mentry &&
+		    (!path || mentry_path_cmp(theirs.mentry->path, path) < 0))
+			path = theirs.mentry->path;
+
+		b = mside_at(&base, path);
+		o = mside_at(&ours, path);
+		t = mside_at(&theirs, path);
+		n = mentry_merge(b, o, t, &keep);
+		if (n < 0)
+			goto out;
+		conflicts += n;
 
-			if (!real)
-				pfunc(NULL, stored, DIFF_DELE);
+		/* Kept entries are owned by merged from now on */
+		if (keep) {
+			mentry_insert(keep, merged);
+			ours.kept = keep == o;
+			theirs.kept = keep == t;
 		}
+
+		if ((b && mside_next(&base)) || (o && mside_next(&ours)) ||
+		    (t && mside_next(&theirs)))
+			goto out;
 	}
+	ret = 0;
+
+out:
+	n = errno;
+	mside_close(&base);
+	mside_close(&ours);
+	mside_close(&theirs);
+	errno = n;
+
+	if (!ret)
+		ret = mentries_tofile(merged, ourspath, version);
+	mentries_free(merged);
+	return ret ? -1 : conflicts;
 }
 
-/* Dumps given metadata */
+/* Dumps given metadata in human-readable form */
 void
-mentries_dump(struct metahash *mhash)
+mentries_dump(struct metahash *mhash, msettings *st)
 {
 	const struct metaentry *mentry;
 	char mode[11 + 1] = "";
@@ -678,9 +3761,12 @@ mentries_dump(struct metahash *mhash)
 			strftime(zone, sizeof(zone), "%z", &cal);
 			printf("%s\t%s\t%s\t%s.%09ld %s\t%s%s\n",
 			       mode,
-			       mentry->owner, mentry->group,
+			       st->fields & FIELD_OWNER ? mentry->owner : "-",
+			       st->fields & FIELD_GROUP ? mentry->group : "-",
 			       date, mentry->mtimensec, zone,
 			       mentry->path, S_ISDIR(mentry->mode) ? "/" : "");
+			if (!(st->fields & FIELD_XATTR))
+				continue;
 			for (unsigned i = 0; i < mentry->xattrs; i++) {
 				printf("\t\t\t\t%s%s\t%s=",
 				       mentry->path, S_ISDIR(mentry->mode) ? "/" : "",
@@ -707,3 +3793,246 @@ mentries_dump(struct metahash *mhash)
 		}
 	}
 }
+
+/* Creates a plan file to which compare results can be added */
+FILE *
+mentries_plan_create(const char *path)
+{
+	FILE *to;
+
+	to = fopen(path, "w");
+	if (!to) {
+		msg(MSG_CRITICAL, "Failed to open %s: %s\n",
+		    path, strerror(errno));
+		return NULL;
+	}
+
+	write_binary_string(PLANSIGNATURE, PLANSIGNATURELEN, to);
+	write_binary_string(VERSION, VERSIONLEN, to);
+
+	return to;
+}
+
+/* Adds a single compare result to a plan file */
+void
+mentries_plan_add(FILE *to, const struct metaentry *real,
+                  const struct metaentry *stored, int cmp)
+{
+	if (cmp == DIFF_NONE)
+		return;
+
+	write_int((uint64_t)cmp, 2, to);
+	write_int((real ? PLAN_REAL : 0) | (stored ? PLAN_STORED : 0), 1, to);
+	write_int(real ? (uint64_t)real->ctime : 0, 8, to);
+	write_int(real ? (uint64_t)real->ctimensec : 0, 8, to);
+	if (real)
+		mentry_tofile(real, to);
+	if (stored)
+		mentry_tofile(stored, to);
+}
+
+/* Hardlinked inode changed by applying a plan */
+struct planinode {
+	struct planinode *next;
+	dev_t dev;
+	ino_t ino;
+	time_t csec;           /* ctime recorded in the plan */
+	long cnsec;
+	struct timespec ctime; /* ctime after the plan was applied to it */
+};
+
+/* Finds the inode described by sbuf among those changed by the plan */
+static struct planinode *
+planinode_find(struct planinode **inodes, const struct stat *sbuf)
+{
+	struct planinode *inode;
+
+	inode = inodes[(sbuf->st_ino ^ sbuf->st_dev) % HASH_INDEXES];
+	for (; inode; inode = inode->next)
+		if (inode->ino == sbuf->st_ino && inode->dev == sbuf->st_dev)
+			return inode;
+	return NULL;
+}
+
+/*
+ * Remembers the ctime of hardlinked real after the plan was applied to it,
+ * so that its other links are not taken as changed since the plan was made
+ * - returns -1 if out of memory
+ */
+static int
+planinode_update(struct planinode **inodes, const struct metaentry *real)
+{
+	struct planinode *inode;
+	struct stat sbuf;
+
+	if (lstat(real->path, &sbuf))
+		return 0;
+
+	inode = planinode_find(inodes, &sbuf);
+	if (!inode) {
+		inode = xmalloc(sizeof(struct planinode), STATS_MEM_HASH);
+		if (!inode)
+			return -1;
+		inode->dev = sbuf.st_dev;
+		inode->ino = sbuf.st_ino;
+		inode->csec = real->ctime;
+		inode->cnsec = real->ctimensec;
+		inode->next = inodes[(sbuf.st_ino ^ sbuf.st_dev) % HASH_INDEXES];
+		inodes[(sbuf.st_ino ^ sbuf.st_dev) % HASH_INDEXES] = inode;
+	}
+	inode->ctime = sbuf.st_ctim;
+	return 0;
+}
+
+/* Frees inodes changed by a plan */
+static void
+planinode_free(struct planinode **inodes)
+{
+	struct planinode *inode, *next;
+	int key;
+
+	for (key = 0; key < HASH_INDEXES; key++) {
+		for (inode = inodes[key]; inode; inode = next) {
+			next = inode->next;
+			xfree(inode);
+		}
+	}
+}
+
+/*
+ * Checks that the file at path has not changed since its plan entry was
+ * made, other than by applying the plan to another link of it
+ * - sbuf is set to the current state of real (if any)
+ */
+static bool
+mentry_plan_valid(const struct metaentry *real, const struct metaentry *stored,
+                  struct planinode **inodes, struct stat *sbuf)
+{
+	const struct planinode *inode;
+
+	if (!real) {
+		if (!lstat(stored->path, sbuf) || errno != ENOENT) {
+			msg(MSG_WARNING, "%s:\tappeared since plan was made, "
+			    "skipping\n", stored->path);
+			return false;
+		}
+		return true;
+	}
+
+	if (lstat(real->path, sbuf)) {
+		msg(MSG_WARNING, "%s:\tlstat failed, skipping: %s\n",
+		    real->path, strerror(errno));
+		return false;
+	}
+
+	if (   sbuf->st_ctim.tv_sec  == real->ctime
+	    && sbuf->st_ctim.tv_nsec == real->ctimensec
+	   )
+		return true;
+
+	inode = sbuf->st_nlink > 1 ? planinode_find(inodes, sbuf) : NULL;
+	if (   !inode
+	    || inode->csec != real->ctime
+	    || inode->cnsec != real->ctimensec
+	    || inode->ctime.tv_sec != sbuf->st_ctim.tv_sec
+	    || inode->ctime.tv_nsec != sbuf->st_ctim.tv_nsec
+	   ) {
+		msg(MSG_WARNING, "%s:\tchanged since plan was made, "
+		    "skipping\n", real->path);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Reads a plan file and calls pfunc for each still valid operation in it
+ * - returns -1 if the plan file cannot be read or is corrupt
+ */
+int
+mentries_plan_apply(const char *path,
+                    void (*pfunc)
+                    (struct metaentry *real, struct metaentry *stored, int cmp,
+                     void *arg),
+                    void *arg)
+{
+	struct metaentry *real, *stored;
+	struct planinode *inodes[HASH_INDEXES];
+	struct stat sbuf;
+	char *mmapstart;
+	char *ptr;
+	char *max;
+	int fd;
+	size_t size;
+	int cmp, which, ret;
+	time_t csec;
+	long cnsec;
+
+	mmapstart = mfile_map(path, PLANSIGNATURELEN + VERSIONLEN, &size, &fd);
+	if (!mmapstart)
+		return -1;
+	memset(inodes, 0, sizeof(inodes));
+	ptr = mmapstart;
+	max = mmapstart + size;
+	ret = -1;
+
+	if (strncmp(ptr, PLANSIGNATURE, PLANSIGNATURELEN)) {
+		msg(MSG_CRITICAL, "Invalid signature for plan file %s\n", path);
+		errno = EINVAL;
+		goto out;
+	}
+	ptr += PLANSIGNATURELEN;
+
+	if (strncmp(ptr, VERSION, VERSIONLEN)) {
+		msg(MSG_CRITICAL, "Invalid version of plan file %s\n", path);
+		errno = EINVAL;
+		goto out;
+	}
+	ptr += VERSIONLEN;
+
+	while (ptr < max) {
+		cmp = (int)read_int(&ptr, 2, max);
+		which = (int)read_int(&ptr, 1, max);
+		csec = (time_t)read_int(&ptr, 8, max);
+		cnsec = (long)read_int(&ptr, 8, max);
+
+		real = stored = NULL;
+		if (ptr && which & PLAN_REAL) {
+			real = mentry_fromfile(&ptr, max);
+			if (real) {
+				real->ctime = csec;
+				real->ctimensec = cnsec;
+			}
+		}
+		if (ptr && which & PLAN_STORED)
+			stored = mentry_fromfile(&ptr, max);
+
+		if (!ptr || !which) {
+			if (ptr || errno != ENOMEM) {
+				msg(MSG_CRITICAL,
+				    "Invalid operation in plan file %s\n", path);
+				errno = EINVAL;
+			}
+			mentry_free(real);
+			goto out;
+		}
+
+		sbuf.st_nlink = 0;
+		if (mentry_plan_valid(real, stored, inodes, &sbuf)) {
+			pfunc(real, stored, cmp, arg);
+			if (real && sbuf.st_nlink > 1 &&
+			    planinode_update(inodes, real)) {
+				errno = ENOMEM;
+				goto out;
+			}
+		}
+	}
+	ret = 0;
+
+out:
+	cmp = errno;
+	planinode_free(inodes);
+	mfile_unmap(mmapstart, size, fd);
+	errno = cmp;
+	return ret;
+}
@@ -22,6 +22,9 @@
 #define METAENTRY_H
 
 #include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 #include "settings.h"
 
@@ -32,12 +35,15 @@ struct metaentry {
 
 	char    *path;
 	unsigned pathlen;
+	unsigned hash;      /* Full hash of path, set by mentry_insert */
 
 	char    *owner;
 	char    *group;
 	mode_t   mode;
 	time_t   mtime;
 	long     mtimensec;
+	time_t   ctime;     /* Not stored, only used for revalidating plans */
+	long     ctimensec;
 
 	unsigned xattrs;
 	char   **xattr_names;
@@ -47,24 +53,146 @@ struct metaentry {
 
 #define HASH_INDEXES 1024
 
-/* Data structure to hold a number of metadata entries */
+/* Open-addressed index of the entries of one chain, for lookups */
+struct metaindex {
+	struct metaentry **slots;
+	unsigned mask;      /* Number of slots - 1, or 0 if slots is NULL */
+	unsigned count;
+	pthread_mutex_t lock; /* Held while inserting */
+	bool nomem;         /* Index failed to grow, chain is searched instead */
+};
+
+/*
+ * Data structure to hold a number of metadata entries
+ * - bucket chains keep entries in the order they are stored in files
+ * - entries may be inserted by many threads at once, which only wait for
+ *   each other when they hit the same bucket, but nothing else may be done
+ *   with the table until they are done
+ */
 struct metahash {
 	struct metaentry *bucket[HASH_INDEXES];
+	struct metaindex index[HASH_INDEXES];
 	unsigned count;
 };
 
+/* Allocates an empty metahash table */
+struct metahash *mhash_alloc(void);
+
+/* Generates a hash key (bucket index) for path */
+unsigned mhash_key(const char *path);
+
+/* Finds the metaentry for path in mhash, returns NULL if there is none */
+struct metaentry *mentry_find(const char *path, struct metahash *mhash);
+
+/* Inserts a metaentry into mhash, safe to call concurrently */
+void mentry_insert(struct metaentry *mentry, struct metahash *mhash);
+
+/* Removes the metaentry for path from mhash, returns it or NULL if absent */
+struct metaentry *mentry_remove(const char *path, struct metahash *mhash);
+
+/* Removes and frees all metaentries below the directory path in mhash */
+void mentries_remove_tree(const char *path, struct metahash *mhash);
+
+/* Free's a metaentry and all its parameters */
+void mentry_free(struct metaentry *mentry);
+
+/* Free's a metahash table and all its entries */
+void mentries_free(struct metahash *mhash);
+
+/* Free's a metahash table, but not its entries */
+void mhash_free(struct metahash *mhash);
+
 /* Create a metaentry for the file/dir/etc at path */
-struct metaentry *mentry_create(const char *path);
+struct metaentry *mentry_create(const char *path, msettings *st);
 
-/* Recurses opath and adds metadata entries to the metaentry list */
-void mentries_recurse_path(const char *opath, struct metahash **mhash,
+/*
+ * Walks opath and calls cb for each entry, which takes over the entry
+ * - stops when cb returns non-zero and returns that value
+ * - returns -1 if opath cannot be resolved
+ */
+int mentries_walk(const char *opath, msettings *st,
+                  int (*cb)(struct metaentry *mentry, void *arg), void *arg);
+
+/*
+ * Checks whether a walk started on device rootdev descends into directory
+ * path on device dev, which is the root of the walk or a mountpoint (as
+ * --one-file-system and --skip-fs decide)
+ */
+bool mentries_descend(const char *path, dev_t dev, dev_t rootdev,
+                      msettings *st);
+
+/*
+ * Recurses opath and adds metadata entries to the metaentry list
+ * - returns -1 if out of memory
+ */
+int mentries_recurse_path(const char *opath, struct metahash **mhash,
                            msettings *st);
 
-/* Stores a metaentry list to a file */
-void mentries_tofile(const struct metahash *mhash, const char *path);
+/* Writes a single metaentry to a file, errors are left for ferror() */
+void mentry_tofile(const struct metaentry *mentry, FILE *to);
+
+/* Writes the header of a metadata file, errors are left for ferror() */
+void mentries_header_write(FILE *to, unsigned version);
+
+/*
+ * Stores a metaentry list to a file of given version, returns -1 on failure
+ * - version -1 keeps the version of the existing file (0 if there is none)
+ */
+int mentries_tofile(const struct metahash *mhash, const char *path,
+                    int version);
+
+/* Stores a metaentry list to an open stream, returns -1 on write errors */
+int mentries_tostream(const struct metahash *mhash, FILE *to,
+                      unsigned version);
 
-/* Creates a metaentry list from a file */
-void mentries_fromfile(struct metahash **mhash, const char *path);
+/* Returns the version of a metadata file, -1 if it is missing or invalid */
+int mentries_version(const char *path);
+
+/* Opens and maps a file of at least minsize bytes, returns NULL on failure */
+char *mfile_map(const char *path, size_t minsize, size_t *size, int *fd);
+
+/* Unmaps and closes a file mapped by mfile_map */
+void mfile_unmap(char *mmapstart, size_t size, int fd);
+
+/* Position in a metadata file mapped in memory */
+struct mcursor {
+	char *ptr;               /* next entry, NULL after a failure */
+	const char *max;         /* end of the file */
+	const char *path;        /* name of the file for messages */
+	unsigned version;
+	const char *end;         /* end of the current block (version 1) */
+	unsigned long left;      /* entries left in the current block */
+	unsigned long count;     /* entries read so far */
+	bool done;               /* trailer was read (version 1) */
+	const char *index;       /* directory digests (version 1), if any */
+	unsigned long nindex;    /* number of directory digests */
+};
+
+/*
+ * Checks the header of a metadata file of size bytes at buf, named path
+ * - sets up cur to read the entries after it, returns -1 if invalid
+ */
+int mentries_header_read(struct mcursor *cur, char *buf, size_t size,
+                         const char *path);
+
+/* Reads a single metaentry from a file, returns NULL if it is corrupt */
+struct metaentry *mentry_fromfile(char **ptr, const char *max);
+
+/*
+ * Reads the next metaentry from a metadata file, verifying checksums
+ * - returns NULL at the end (with errno set to 0) or if the file is corrupt
+ */
+struct metaentry *mentries_next(struct mcursor *cur);
+
+/* Sets the number of threads loading and saving large files, 0 for auto */
+void mentries_threads(unsigned threads);
+
+/* Creates a metaentry list from a file, returns -1 on failure */
+int mentries_fromfile(struct metahash **mhash, const char *path);
+
+/* Creates a metaentry list from file contents in memory, named path */
+int mentries_frombuffer(struct metahash **mhash, char *buf, size_t size,
+                        const char *path);
 
 /* Searches haystack for an xattr matching xattr number n in needle */
 int mentry_find_xattr(struct metaentry *haystack,
@@ -81,6 +209,9 @@ int mentry_find_xattr(struct metaentry *haystack,
 #define DIFF_ADDED 0x40
 #define DIFF_DELE  0x80
 
+/* Orders paths so that each one is directly followed by those below it */
+int mentry_path_cmp(const char *left, const char *right);
+
 /* Compares two metaentries and returns an int with a bitmask of differences */
 int mentry_compare(struct metaentry *left,
                    struct metaentry *right,
@@ -91,9 +222,55 @@ void mentries_compare(struct metahash *mhashreal,
                       struct metahash *mhashstored,
                       void (*pfunc)(struct metaentry *real,
                                     struct metaentry *stored,
-                                    int cmp),
+                                    int cmp,
+                                    void *arg),
+                      void *arg,
                       msettings *st);
 
-void mentries_dump(struct metahash *mhash);
+/*
+ * Compares metadata files storedpath and realpath and calls pfunc for each
+ * pair of entries as mentries_compare does, returns -1 on failure
+ * - subtrees of version 1 files with equal digests are skipped
+ */
+int mentries_compare_files(const char *storedpath, const char *realpath,
+                           void (*pfunc)(struct metaentry *real,
+                                         struct metaentry *stored,
+                                         int cmp,
+                                         void *arg),
+                           void *arg,
+                           msettings *st);
+
+/*
+ * Merges changes made to metadata file basepath in ourspath and theirspath
+ * field by field and saves the result in given version (-1 keeps that of
+ * ourspath) to ourspath, as git merge drivers do
+ * - conflicting fields keep their values in ourspath and are reported
+ * - returns the number of paths with conflicts or -1 on failure
+ */
+int mentries_merge(const char *basepath, const char *ourspath,
+                   const char *theirspath, int version);
+
+/* Dumps given metadata in human-readable form */
+void mentries_dump(struct metahash *mhash, msettings *st);
+
+/* Creates a plan file to which compare results can be added */
+FILE *mentries_plan_create(const char *path);
+
+/* Adds a single compare result to a plan file */
+void mentries_plan_add(FILE *to,
+                       const struct metaentry *real,
+                       const struct metaentry *stored,
+                       int cmp);
+
+/*
+ * Reads a plan file and calls pfunc for each still valid operation in it
+ * - returns -1 if the plan file cannot be read or is corrupt
+ */
+int mentries_plan_apply(const char *path,
+                        void (*pfunc)(struct metaentry *real,
+                                      struct metaentry *stored,
+                                      int cmp,
+                                      void *arg),
+                        void *arg);
 
 #endif /* METAENTRY_H */
@@ -34,19 +34,31 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <ctype.h>
+#include <limits.h>
 
 #include "metastore.h"
 #include "settings.h"
 #include "utils.h"
 #include "metaentry.h"
+#include "stats.h"
+#include "daemon.h"
+#include "gitindex.h"
+#include "ignore.h"
+#include "journal.h"
 
 /* metastore settings */
 static struct metasettings settings = {
 	.metafile = METAFILE,
+	.planfile = NULL,
 	.do_mtime = false,
 	.do_emptydirs = false,
 	.do_removeemptydirs = false,
 	.do_git = false,
+	.fields = FIELDS_ALL,
+	.do_cachedattrs = false,
+	.do_onefs = false,
+	.format = -1,
 };
 
 /* Used to create lists of dirs / other files which are missing in the fs */
@@ -95,8 +107,11 @@ insert_entry_pdlist(struct metaentry **list, struct metaentry *entry)
  * - for use in mentries_compare
  */
 static void
-compare_print(struct metaentry *real, struct metaentry *stored, int cmp)
+compare_print(struct metaentry *real, struct metaentry *stored, int cmp,
+              void *arg)
 {
+	(void)arg;
+
 	if (!real && (!stored || (cmp == DIFF_NONE || cmp & DIFF_ADDED))) {
 		msg(MSG_ERROR, "%s called with incorrect arguments\n", __func__);
 		return;
@@ -133,12 +148,26 @@ compare_print(struct metaentry *real, struct metaentry *stored, int cmp)
 	}
 }
 
+/*
+ * Prints differences between real and stored actual metadata and adds them
+ * to the plan file given as arg
+ * - for use in mentries_compare
+ */
+static void
+compare_plan(struct metaentry *real, struct metaentry *stored, int cmp,
+             void *arg)
+{
+	compare_print(real, stored, cmp, NULL);
+	mentries_plan_add(arg, real, stored, cmp);
+}
+
 /*
  * Tries to change the real metadata to match the stored one
  * - for use in mentries_compare
  */
 static void
-compare_fix(struct metaentry *real, struct metaentry *stored, int cmp)
+compare_fix(struct metaentry *real, struct metaentry *stored, int cmp,
+            void *arg)
 {
 	struct group *group;
 	struct passwd *owner;
@@ -147,6 +176,8 @@ compare_fix(struct metaentry *real, struct metaentry *stored, int cmp)
 	struct timespec times[2];
 	unsigned i;
 
+	(void)arg;
+
 	if (!real && !stored) {
 		msg(MSG_ERROR, "%s called with incorrect arguments\n", __func__);
 		return;
@@ -207,6 +238,7 @@ compare_fix(struct metaentry *real, struct metaentry *stored, int cmp)
 			gid = group->gr_gid;
 		}
 
+		stats_count(STATS_FIX);
 		if (lchown(real->path, uid, gid)) {
 			msg(MSG_DEBUG, "\tlchown failed: %s\n",
 			    strerror(errno));
@@ -218,6 +250,7 @@ compare_fix(struct metaentry *real, struct metaentry *stored, int cmp)
 	if (cmp & DIFF_MODE) {
 		msg(MSG_NORMAL, "%s:\tchanging mode from 0%o to 0%o\n",
 		    real->path, real->mode & 07777, stored->mode & 07777);
+		stats_count(STATS_FIX);
 		if (chmod(real->path, stored->mode & 07777))
 			msg(MSG_DEBUG, "\tchmod failed: %s\n", strerror(errno));
 	}
@@ -228,6 +261,7 @@ compare_fix(struct metaentry *real, struct metaentry *stored, int cmp)
 		times[0].tv_nsec = UTIME_OMIT;        // atime (last access time)
 		times[1].tv_sec  = stored->mtime;     // mtime (last modification time)
 		times[1].tv_nsec = stored->mtimensec;
+		stats_count(STATS_FIX);
 		if (utimensat(AT_FDCWD, real->path, times, AT_SYMLINK_NOFOLLOW)) {
 			msg(MSG_DEBUG, "\tutimensat failed: %s\n", strerror(errno));
 			return;
@@ -247,10 +281,12 @@ compare_fix(struct metaentry *real, struct metaentry *stored, int cmp)
 				    real->path, real->xattr_names[i], NO_XATTR_MSG);
 			}
 #if !defined(NO_XATTR) || !(NO_XATTR+0)
-			else
-			if (lremovexattr(real->path, real->xattr_names[i]))
-				msg(MSG_DEBUG, "\tlremovexattr failed: %s\n",
-				    strerror(errno));
+			else {
+				stats_count(STATS_FIX);
+				if (lremovexattr(real->path, real->xattr_names[i]))
+					msg(MSG_DEBUG, "\tlremovexattr failed: %s\n",
+					    strerror(errno));
+			}
 #endif /* !NO_XATTR */
 		}
 
@@ -266,13 +302,15 @@ compare_fix(struct metaentry *real, struct metaentry *stored, int cmp)
 				    stored->path, stored->xattr_names[i], NO_XATTR_MSG);
 			}
 #if !defined(NO_XATTR) || !(NO_XATTR+0)
-			else
-			if (lsetxattr(stored->path, stored->xattr_names[i],
-			              stored->xattr_values[i],
-			              stored->xattr_lvalues[i], XATTR_CREATE)
-			   )
-				msg(MSG_DEBUG, "\tlsetxattr failed: %s\n",
-				    strerror(errno));
+			else {
+				stats_count(STATS_FIX);
+				if (lsetxattr(stored->path, stored->xattr_names[i],
+				              stored->xattr_values[i],
+				              stored->xattr_lvalues[i], XATTR_CREATE)
+				   )
+					msg(MSG_DEBUG, "\tlsetxattr failed: %s\n",
+					    strerror(errno));
+			}
 #endif /* !NO_XATTR */
 		}
 	}
@@ -313,11 +351,13 @@ fixup_emptydirs(void)
 
 	for (entry = missingothers; entry; entry = entry->list) {
 		msg(MSG_DEBUG, "Pruning using file %s\n", entry->path);
-		bpath = xstrdup(entry->path);
+		bpath = xstrdup(entry->path, STATS_MEM_OTHER);
+		if (!bpath)
+			exit(EXIT_FAILURE);
 		delim = strrchr(bpath, '/');
 		if (!delim) {
 			msg(MSG_NORMAL, "No delimiter found in %s\n", bpath);
-			free(bpath);
+			xfree(bpath);
 			continue;
 		}
 		*delim = '\0';
@@ -349,25 +389,26 @@ fixup_emptydirs(void)
 			*parent = cur->list;
 		}
 
-		free(bpath);
+		xfree(bpath);
 	}
 	msg(MSG_DEBUG, "\n");
 
 	for (cur = missingdirs; cur; cur = cur->list) {
 		msg(MSG_QUIET, "%s:\trecreating...", cur->path);
+		stats_count(STATS_FIX);
 		if (mkdir(cur->path, cur->mode)) {
 			msg(MSG_QUIET, "failed (%s)\n", strerror(errno));
 			continue;
 		}
 		msg(MSG_QUIET, "ok\n");
 
-		new = mentry_create(cur->path);
+		new = mentry_create(cur->path, &settings);
 		if (!new) {
 			msg(MSG_QUIET, "Failed to get metadata for %s\n", cur->path);
 			continue;
 		}
 
-		compare_fix(new, cur, mentry_compare(new, cur, &settings));
+		compare_fix(new, cur, mentry_compare(new, cur, &settings), NULL);
 	}
 }
 
@@ -403,6 +444,7 @@ fixup_newemptydirs(void)
 		msg(MSG_DEBUG, "\nAttempting to delete empty dirs\n");
 		for (cur = &extradirs; *cur;) {
 			msg(MSG_QUIET, "%s:\tremoving...", (*cur)->path);
+			stats_count(STATS_FIX);
 			if (rmdir((*cur)->path)) {
 				msg(MSG_QUIET, "failed (%s)\n", strerror(errno));
 				cur = &(*cur)->list;
@@ -449,6 +491,13 @@ usage(const char *arg0, const char *message)
 "  -a, --apply              Apply stored metadata\n"
 "  -d, --dump               Dump stored (if no PATH is given) or real metadata\n"
 "                           (if PATH is present, e.g. ./) in human-readable form\n"
+"      --daemon             Keep metadata in memory and serve requests on\n"
+"                           --socket until terminated\n"
+"      --watch              Record metadata changes in --journal until\n"
+"                           terminated\n"
+"      --merge BASE OURS THEIRS\n"
+"                           Merge changes made to metadata file BASE in OURS\n"
+"                           and THEIRS into OURS (e.g. as git merge driver)\n"
 "  -V, --version            Output version information and exit\n"
 "  -h, --help               Help message (this text)\n"
 "\n"
@@ -459,12 +508,57 @@ usage(const char *arg0, const char *message)
 "  -e, --empty-dirs         Recreate missing empty directories\n"
 "  -E, --remove-empty-dirs  Remove extra empty directories\n"
 "  -g, --git                Do not omit .git directories\n"
+"      --git-tracked        Only handle paths tracked in the git index\n"
+"      --exclude=PATTERN    Skip paths matching PATTERN (as in .gitignore)\n"
+"      --include=PATTERN    Do not skip paths matching PATTERN\n"
+"  -x, --one-file-system    Do not walk into other file systems\n"
+"      --skip-fs=TYPE[,...] Do not walk into file systems of given types\n"
+"                           (e.g. proc, nfs, or groups pseudo and network)\n"
+"      --threads=N          Load and save large metadata files with N\n"
+"                           threads (0 for one per CPU, the default)\n"
 "  -f, --file=FILE          Set metadata file (" METAFILE " by default)\n"
+"      --format=N           Save (or merge) metadata file in version N (0 or 1\n"
+"                           with checksums, that of the old file by default)\n"
+"      --against=FILE       Compare with metadata in FILE instead of the\n"
+"                           file system\n"
+"      --plan-out=FILE      Write differences found by compare to FILE\n"
+"      --plan-in=FILE       Apply differences from FILE instead of rescanning\n"
+"      --only=FIELD[,...]   Only handle given fields (owner, group, mode,\n"
+"                           mtime, xattrs)\n"
+"      --no-xattrs          Do not handle xattrs\n"
+"      --no-sync-attrs      Accept cached attributes on network filesystems\n"
+"      --stats[=json]       Print timings and counters to stderr at exit\n"
+"      --socket=SOCKET      Serve (--daemon) or send (--compare, --save and\n"
+"                           --dump) requests on UNIX socket SOCKET\n"
+"      --journal=FILE       Record changes in (--watch) or take them from\n"
+"                           (--compare and --save) FILE instead of rescanning\n"
 	    );
 
 	exit(message ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
+/* Long-only options */
+enum {
+	OPT_PLAN_OUT = CHAR_MAX + 1,
+	OPT_PLAN_IN,
+	OPT_ONLY,
+	OPT_NO_XATTRS,
+	OPT_NO_SYNC_ATTRS,
+	OPT_STATS,
+	OPT_DAEMON,
+	OPT_SOCKET,
+	OPT_WATCH,
+	OPT_JOURNAL,
+	OPT_GIT_TRACKED,
+	OPT_EXCLUDE,
+	OPT_INCLUDE,
+	OPT_SKIP_FS,
+	OPT_THREADS,
+	OPT_FORMAT,
+	OPT_AGAINST,
+	OPT_MERGE,
+};
+
 /* Options */
 static struct option long_options[] = {
 	{ "compare",           no_argument,       NULL, 'c' },
@@ -480,9 +574,249 @@ static struct option long_options[] = {
 	{ "remove-empty-dirs", no_argument,       NULL, 'E' },
 	{ "git",               no_argument,       NULL, 'g' },
 	{ "file",              required_argument, NULL, 'f' },
+	{ "plan-out",          required_argument, NULL, OPT_PLAN_OUT },
+	{ "plan-in",           required_argument, NULL, OPT_PLAN_IN },
+	{ "only",              required_argument, NULL, OPT_ONLY },
+	{ "no-xattrs",         no_argument,       NULL, OPT_NO_XATTRS },
+	{ "no-sync-attrs",     no_argument,       NULL, OPT_NO_SYNC_ATTRS },
+	{ "stats",             optional_argument, NULL, OPT_STATS },
+	{ "daemon",            no_argument,       NULL, OPT_DAEMON },
+	{ "socket",            required_argument, NULL, OPT_SOCKET },
+	{ "watch",             no_argument,       NULL, OPT_WATCH },
+	{ "journal",           required_argument, NULL, OPT_JOURNAL },
+	{ "git-tracked",       no_argument,       NULL, OPT_GIT_TRACKED },
+	{ "exclude",           required_argument, NULL, OPT_EXCLUDE },
+	{ "include",           required_argument, NULL, OPT_INCLUDE },
+	{ "one-file-system",   no_argument,       NULL, 'x' },
+	{ "skip-fs",           required_argument, NULL, OPT_SKIP_FS },
+	{ "threads",           required_argument, NULL, OPT_THREADS },
+	{ "format",            required_argument, NULL, OPT_FORMAT },
+	{ "against",           required_argument, NULL, OPT_AGAINST },
+	{ "merge",             no_argument,       NULL, OPT_MERGE },
 	{ NULL, 0, NULL, 0 }
 };
 
+/* Field names for --only */
+static const struct {
+	const char *name;
+	unsigned field;
+} field_names[] = {
+	{ "owner",  FIELD_OWNER },
+	{ "group",  FIELD_GROUP },
+	{ "mode",   FIELD_MODE  },
+	{ "mtime",  FIELD_MTIME },
+	{ "xattrs", FIELD_XATTR },
+	{ "xattr",  FIELD_XATTR },
+};
+
+/* Parses comma-separated list of field names, returns 0 on failure */
+static unsigned
+parse_fields(const char *list)
+{
+	unsigned fields = 0;
+	size_t len, i;
+
+	while (*list) {
+		len = strcspn(list, ",");
+		for (i = 0; i < sizeof(field_names) / sizeof(*field_names); i++) {
+			if (strlen(field_names[i].name) == len &&
+			    !strncmp(field_names[i].name, list, len))
+				break;
+		}
+		if (i == sizeof(field_names) / sizeof(*field_names))
+			return 0;
+		fields |= field_names[i].field;
+		list += len;
+		if (*list == ',')
+			list++;
+	}
+
+	return fields;
+}
+
+/* File system types for --skip-fs, by f_type of statfs(2) on Linux */
+#define FS_PSEUDO  0x01 /* kernel interfaces, not files */
+#define FS_NETWORK 0x02 /* remote, possibly unreachable */
+static const struct {
+	const char *name;
+	unsigned long magic;
+	unsigned groups;
+} fs_types[] = {
+	{ "9p",          0x01021997, FS_NETWORK },
+	{ "afs",         0x5346414f, FS_NETWORK },
+	{ "autofs",      0x00000187, FS_PSEUDO  },
+	{ "binfmt_misc", 0x42494e4d, FS_PSEUDO  },
+	{ "bpf",         0xcafe4a11, FS_PSEUDO  },
+	{ "ceph",        0x00c36400, FS_NETWORK },
+	{ "cgroup",      0x0027e0eb, FS_PSEUDO  },
+	{ "cgroup2",     0x63677270, FS_PSEUDO  },
+	{ "cifs",        0xff534d42, FS_NETWORK },
+	{ "configfs",    0x62656570, FS_PSEUDO  },
+	{ "debugfs",     0x64626720, FS_PSEUDO  },
+	{ "devpts",      0x00001cd1, FS_PSEUDO  },
+	{ "efivarfs",    0xde5e81e4, FS_PSEUDO  },
+	{ "fuse",        0x65735546, 0          },
+	{ "fusectl",     0x65735543, FS_PSEUDO  },
+	{ "hugetlbfs",   0x958458f6, 0          },
+	{ "mqueue",      0x19800202, FS_PSEUDO  },
+	{ "nfs",         0x00006969, FS_NETWORK },
+	{ "nsfs",        0x6e736673, FS_PSEUDO  },
+	{ "overlay",     0x794c7630, 0          },
+	{ "proc",        0x00009fa0, FS_PSEUDO  },
+	{ "pstore",      0x6165676c, FS_PSEUDO  },
+	{ "ramfs",       0x858458f6, 0          },
+	{ "securityfs",  0x73636673, FS_PSEUDO  },
+	{ "selinuxfs",   0xf97cff8c, FS_PSEUDO  },
+	{ "smb2",        0xfe534d42, FS_NETWORK },
+	{ "squashfs",    0x73717368, 0          },
+	{ "sysfs",       0x62656572, FS_PSEUDO  },
+	{ "tmpfs",       0x01021994, 0          },
+	{ "tracefs",     0x74726163, FS_PSEUDO  },
+};
+#define FS_TYPES (sizeof(fs_types) / sizeof(*fs_types))
+
+/* Magic numbers of file systems to skip, 0-terminated */
+static unsigned long skip_fs[FS_TYPES + 1];
+
+/*
+ * Parses comma-separated list of file system types or groups ("pseudo",
+ * "network") into skip_fs, returns -1 on failure
+ */
+static int
+parse_fs_types(const char *list)
+{
+	unsigned groups, count = 0;
+	size_t len, i, j;
+
+	while (*list) {
+		len = strcspn(list, ",");
+		groups = 0;
+		if (len == 6 && !strncmp(list, "pseudo", len))
+			groups = FS_PSEUDO;
+		else if (len == 7 && !strncmp(list, "network", len))
+			groups = FS_NETWORK;
+
+		for (i = 0; i < FS_TYPES; i++) {
+			if (groups ? !(fs_types[i].groups & groups) :
+			    strlen(fs_types[i].name) != len ||
+			    strncmp(fs_types[i].name, list, len))
+				continue;
+			for (j = 0; j < count; j++)
+				if (skip_fs[j] == fs_types[i].magic)
+					break;
+			if (j == count)
+				skip_fs[count++] = fs_types[i].magic;
+			if (!groups)
+				break;
+		}
+		if (!groups && i == FS_TYPES)
+			return -1;
+
+		list += len;
+		if (*list == ',')
+			list++;
+	}
+
+	return count ? 0 : -1;
+}
+
+/* Pattern given by --exclude or --include */
+struct pattern_opt {
+	const char *pattern;
+	bool include;
+};
+
+/*
+ * Compiles patterns from IGNOREFILE followed by count patterns given on the
+ * command line into *mi, which is left NULL if there are none
+ * - returns -1 on failure
+ */
+static int
+load_ignore(const struct pattern_opt *patterns, unsigned count,
+            struct mignore **mi)
+{
+	int loaded;
+	unsigned i;
+
+	*mi = mignore_new();
+	if (!*mi)
+		goto nomem;
+
+	loaded = mignore_load(*mi, IGNOREFILE);
+	if (loaded < 0)
+		goto err;
+
+	for (i = 0; i < count; i++)
+		if (mignore_add(*mi, patterns[i].pattern, patterns[i].include))
+			goto nomem;
+
+	if (!loaded && !count) {
+		mignore_free(*mi);
+		*mi = NULL;
+	}
+	return 0;
+
+nomem:
+	msg(MSG_CRITICAL, "Failed to compile patterns: %s\n", strerror(ENOMEM));
+err:
+	mignore_free(*mi);
+	*mi = NULL;
+	return -1;
+}
+
+/*
+ * Performs action on real and stored metadata, returns -1 on failure
+ * - also used by the daemon, which redirects stdout to its client
+ */
+static int
+perform(int action, struct metahash *real, struct metahash *stored,
+        msettings *st)
+{
+	FILE *planout;
+	int werr;
+
+	switch (action) {
+	case ACTION_DIFF:
+		stats_start(STATS_COMPARE);
+		if (!st->planfile) {
+			mentries_compare(real, stored, compare_print, NULL, st);
+		} else {
+			planout = mentries_plan_create(st->planfile);
+			if (!planout)
+				return -1;
+			mentries_compare(real, stored, compare_plan, planout, st);
+			werr = ferror(planout);
+			if (fclose(planout) || werr) {
+				msg(MSG_CRITICAL, "Failed to write to %s: %s\n",
+				    st->planfile, strerror(errno));
+				return -1;
+			}
+		}
+		stats_stop(STATS_COMPARE, real->count + stored->count);
+		break;
+	case ACTION_SAVE:
+		stats_start(STATS_WRITE);
+		if (mentries_tofile(real, st->metafile, st->format))
+			return -1;
+		stats_stop(STATS_WRITE, real->count);
+		break;
+	case ACTION_APPLY:
+		stats_start(STATS_APPLY);
+		mentries_compare(real, stored, compare_fix, NULL, st);
+		if (st->do_emptydirs)
+			fixup_emptydirs();
+		if (st->do_removeemptydirs)
+			fixup_newemptydirs();
+		stats_stop(STATS_APPLY, real->count + stored->count);
+		break;
+	case ACTION_DUMP:
+		mentries_dump(real ? real : stored, st);
+		break;
+	}
+
+	return 0;
+}
+
 /* Main function */
 int
 main(int argc, char **argv)
@@ -491,12 +825,32 @@ main(int argc, char **argv)
 	struct metahash *real = NULL;
 	struct metahash *stored = NULL;
 	int action = 0;
-
-	/* Parse options */
+	int planaction = 0;
+	const char *only = NULL;
+	bool no_xattrs = false;
+	const char *stats = NULL;
+	const char *sockpath = NULL;
+	const char *journal = NULL;
+	off_t joff = -1;
+	bool git_tracked = false;
+	struct pattern_opt patterns[argc]; /* at most every argument */
+	unsigned npatterns = 0;
+	struct mignore *ignore = NULL;
+	const char *skip_fs_list = NULL;
+	const char *threads = NULL;
+	const char *format = NULL;
+	const char *against = NULL;
+	unsigned long nthreads;
+	char *end;
+	int ret;
+	int status = EXIT_SUCCESS;
+	bool metafile = false;
+
+	/* Parse options, nothing may be allocated before accounting starts */
 	i = 0;
 	while (1) {
 		int option_index = 0;
-		c = getopt_long(argc, argv, "csadVhvqmeEgf:",
+		c = getopt_long(argc, argv, "csadVhvqmeEgxf:",
 		                long_options, &option_index);
 		if (c == -1)
 			break;
@@ -514,12 +868,44 @@ main(int argc, char **argv)
 		case 'E': /* remove-empty-dirs */ settings.do_removeemptydirs = true;
 			                              break;
 		case 'g': /* git */               settings.do_git = true;        break;
-		case 'f': /* file */              settings.metafile = optarg;    break;
+		case 'x': /* one-file-system */   settings.do_onefs = true;      break;
+		case 'f': /* file */              settings.metafile = optarg;
+			                              metafile = true;               break;
+		case OPT_PLAN_OUT: /* plan-out */ settings.planfile = optarg;
+			                              planaction = ACTION_DIFF;      break;
+		case OPT_PLAN_IN: /* plan-in */   settings.planfile = optarg;
+			                              planaction = ACTION_APPLY;     break;
+		case OPT_ONLY: /* only */         only = optarg;                 break;
+		case OPT_NO_XATTRS: /* no-xattrs */ no_xattrs = true;            break;
+		case OPT_NO_SYNC_ATTRS: /* no-sync-attrs */
+			                              settings.do_cachedattrs = true;
+			                              break;
+		case OPT_STATS: /* stats */       stats = optarg ? optarg : "text";
+			                              break;
+		case OPT_DAEMON: /* daemon */     action |= ACTION_DAEMON; i++;  break;
+		case OPT_SOCKET: /* socket */     sockpath = optarg;             break;
+		case OPT_WATCH: /* watch */       action |= ACTION_WATCH; i++;   break;
+		case OPT_JOURNAL: /* journal */   journal = optarg;              break;
+		case OPT_GIT_TRACKED: /* git-tracked */ git_tracked = true;      break;
+		case OPT_EXCLUDE: /* exclude */
+		case OPT_INCLUDE: /* include */   patterns[npatterns].pattern = optarg;
+			                              patterns[npatterns++].include =
+			                                  c == OPT_INCLUDE;
+			                              break;
+		case OPT_SKIP_FS: /* skip-fs */   skip_fs_list = optarg;         break;
+		case OPT_THREADS: /* threads */   threads = optarg;              break;
+		case OPT_FORMAT: /* format */     format = optarg;               break;
+		case OPT_AGAINST: /* against */   against = optarg;              break;
+		case OPT_MERGE: /* merge */       action |= ACTION_MERGE; i++;   break;
 		default:
 			usage(argv[0], "unknown option");
 		}
 	}
 
+	/* Memory is only accounted (at some cost) when it is reported */
+	if (stats)
+		stats_mem_enable();
+
 	/* Make sure only one action is specified */
 	if (i != 1)
 		usage(argv[0], "incorrect option(s)");
@@ -532,28 +918,250 @@ main(int argc, char **argv)
 	if (settings.do_removeemptydirs && action != ACTION_APPLY)
 		usage(argv[0], "--remove-empty-dirs is only valid with --apply");
 
+	/* Make sure --plan-out is only used with compare */
+	if (planaction == ACTION_DIFF && action != ACTION_DIFF)
+		usage(argv[0], "--plan-out is only valid with --compare");
+
+	/* Make sure --plan-in is only used with apply and without paths */
+	if (planaction == ACTION_APPLY && action != ACTION_APPLY)
+		usage(argv[0], "--plan-in is only valid with --apply");
+	if (planaction == ACTION_APPLY && optind < argc)
+		usage(argv[0], "--plan-in cannot be used with paths");
+
+	/* Make sure metadata is saved in full */
+	if ((only || no_xattrs) && action & (ACTION_SAVE | ACTION_MERGE))
+		usage(argv[0], "--only and --no-xattrs are not valid with "
+		      "--save or --merge");
+
+	/* Make sure --merge is given all three files */
+	if (action == ACTION_MERGE && argc - optind != 3)
+		usage(argv[0], "--merge requires BASE, OURS and THEIRS files");
+
+	/* Limit handled fields, --only=mtime implies --mtime */
+	if (only) {
+		settings.fields = parse_fields(only);
+		if (!settings.fields)
+			usage(argv[0], "invalid --only field list");
+		if (settings.fields & FIELD_MTIME)
+			settings.do_mtime = true;
+	}
+	if (no_xattrs)
+		settings.fields &= ~FIELD_XATTR;
+
+	/* Make sure --daemon is used with --socket and without paths */
+	if (action == ACTION_DAEMON && !sockpath)
+		usage(argv[0], "--daemon requires --socket");
+	if (action == ACTION_DAEMON && optind < argc)
+		usage(argv[0], "--daemon cannot be used with paths");
+
+	/* Make sure requests sent to daemon are supported by it */
+	if (sockpath && action != ACTION_DAEMON) {
+		if (!(action & (ACTION_DIFF | ACTION_SAVE | ACTION_DUMP)))
+			usage(argv[0], "--socket is only valid with --daemon, "
+			      "--compare, --save or --dump");
+		if (optind < argc && (action != ACTION_DUMP ||
+		                      optind != argc - 1 ||
+		                      strcmp(argv[optind], ".")))
+			usage(argv[0], "--socket cannot be used with paths "
+			      "(except . for --dump)");
+		if (settings.planfile || only || no_xattrs || stats ||
+		    npatterns || settings.do_onefs || skip_fs_list || threads ||
+		    format || metafile || settings.do_git ||
+		    settings.do_cachedattrs)
+			usage(argv[0], "--socket cannot be used with options "
+			      "other than --mtime, the daemon uses its own");
+	}
+
+	/* Make sure --watch is used with --journal and without paths */
+	if (action == ACTION_WATCH && !journal)
+		usage(argv[0], "--watch requires --journal");
+	if (action == ACTION_WATCH && optind < argc)
+		usage(argv[0], "--watch cannot be used with paths");
+
+	/* Make sure journal is only used for the whole tree */
+	if (journal && action != ACTION_WATCH) {
+		if (!(action & (ACTION_DIFF | ACTION_SAVE)))
+			usage(argv[0], "--journal is only valid with --watch, "
+			      "--compare or --save");
+		if (optind < argc)
+			usage(argv[0], "--journal cannot be used with paths");
+		if (sockpath)
+			usage(argv[0], "--journal cannot be used with --socket");
+	}
+
+	/* Make sure --git-tracked is used for the whole tree being scanned */
+	if (git_tracked) {
+		if (!(action & (ACTION_DIFF | ACTION_SAVE | ACTION_APPLY)))
+			usage(argv[0], "--git-tracked is only valid with "
+			      "--compare, --save or --apply");
+		if (optind < argc)
+			usage(argv[0], "--git-tracked cannot be used with paths");
+		if (sockpath || journal || planaction == ACTION_APPLY)
+			usage(argv[0], "--git-tracked cannot be used with "
+			      "--socket, --journal or --plan-in");
+	}
+
+	/* Make sure file system types are known */
+	if (skip_fs_list) {
+#ifndef __linux__
+		usage(argv[0], "--skip-fs is only supported on Linux");
+#endif
+		if (parse_fs_types(skip_fs_list))
+			usage(argv[0], "invalid --skip-fs type list");
+		settings.skip_fs = skip_fs;
+	}
+
+	/* Make sure number of threads is a number */
+	if (threads) {
+		errno = 0;
+		nthreads = strtoul(threads, &end, 10);
+		if (!isdigit((unsigned char)*threads) || *end || errno ||
+		    nthreads > UINT_MAX)
+			usage(argv[0], "invalid --threads number");
+		mentries_threads((unsigned)nthreads);
+	}
+
+	/* Make sure --format is only used when saving and is known */
+	if (format) {
+		if (!(action & (ACTION_SAVE | ACTION_MERGE)))
+			usage(argv[0], "--format is only valid with --save or "
+			      "--merge");
+		if (strcmp(format, "0") && strcmp(format, "1"))
+			usage(argv[0], "invalid --format version");
+		settings.format = *format - '0';
+	}
+
+	/* Make sure --against only replaces the walk of a compare */
+	if (against) {
+		if (action != ACTION_DIFF)
+			usage(argv[0], "--against is only valid with "
+			      "--compare");
+		if (optind < argc)
+			usage(argv[0], "--against cannot be used with paths");
+		if (planaction || sockpath || journal || git_tracked)
+			usage(argv[0], "--against cannot be used with "
+			      "--plan-out, --socket, --journal or "
+			      "--git-tracked");
+	}
+
+	/* Make sure --stats format is known */
+	if (stats && strcmp(stats, "text") && strcmp(stats, "json"))
+		usage(argv[0], "invalid --stats format");
+
 	if (action == ACTION_VER)
 		version();
 
 	if (action == ACTION_HELP)
 		usage(argv[0], NULL);
 
+	/* Let the daemon do the work */
+	if (sockpath && action != ACTION_DAEMON) {
+		ret = daemon_request(sockpath, action, settings.do_mtime,
+		                     optind < argc);
+		exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	/* Every walk skips ignored paths */
+	if (load_ignore(patterns, npatterns, &ignore))
+		exit(EXIT_FAILURE);
+	settings.ignore = ignore;
+
+	if (action == ACTION_DAEMON) {
+		if (daemon_run(sockpath, &settings, perform))
+			exit(EXIT_FAILURE);
+		goto out;
+	}
+
+	if (action == ACTION_WATCH) {
+		if (journal_watch(journal, &settings))
+			exit(EXIT_FAILURE);
+		goto out;
+	}
+
+	/* Apply previously computed plan without rescanning */
+	if (planaction == ACTION_APPLY) {
+		stats_start(STATS_APPLY);
+		if (mentries_plan_apply(settings.planfile, compare_fix, NULL))
+			exit(EXIT_FAILURE);
+		if (settings.do_emptydirs)
+			fixup_emptydirs();
+		if (settings.do_removeemptydirs)
+			fixup_newemptydirs();
+		stats_stop(STATS_APPLY, 0);
+		goto out;
+	}
+
+	/* Compare two metadata files without walking the tree */
+	if (against) {
+		stats_start(STATS_COMPARE);
+		if (mentries_compare_files(settings.metafile, against,
+		                           compare_print, NULL, &settings)) {
+			msg(MSG_CRITICAL, "Failed to compare %s with %s\n",
+			    settings.metafile, against);
+			exit(EXIT_FAILURE);
+		}
+		stats_stop(STATS_COMPARE, 0);
+		goto out;
+	}
+
+	/* Merge metadata files without walking the tree */
+	if (action == ACTION_MERGE) {
+		stats_start(STATS_COMPARE);
+		ret = mentries_merge(argv[optind], argv[optind + 1],
+		                     argv[optind + 2], settings.format);
+		if (ret < 0) {
+			msg(MSG_CRITICAL, "Failed to merge %s with %s and %s\n",
+			    argv[optind], argv[optind + 1], argv[optind + 2]);
+			exit(EXIT_FAILURE);
+		}
+		stats_stop(STATS_COMPARE, 0);
+		if (ret) {
+			msg(MSG_WARNING, "Merged with %d conflict(s), kept "
+			    "values of %s for them\n", ret, argv[optind + 1]);
+			status = EXIT_FAILURE;
+		}
+		goto out;
+	}
+
 	/* Perform action */
 	if (action & ACTIONS_READING && !(action == ACTION_DUMP && optind < argc)) {
-		mentries_fromfile(&stored, settings.metafile);
-		if (!stored) {
+		stats_start(STATS_LOAD);
+		if (mentries_fromfile(&stored, settings.metafile) || !stored) {
 			msg(MSG_CRITICAL, "Failed to load metadata from %s\n",
 			    settings.metafile);
 			exit(EXIT_FAILURE);
 		}
+		stats_stop(STATS_LOAD, stored->count);
 	}
 
-	if (optind < argc) {
+	/* Index is read before the walk, which only visits tracked paths */
+	if (git_tracked) {
+		settings.tracked = gitindex_load();
+		if (!settings.tracked)
+			exit(EXIT_FAILURE);
+	}
+
+	/* Take changes since the last save from the journal if possible */
+	stats_start(STATS_WALK);
+	if (journal) {
+		joff = journal_sync(journal);
+		if (joff < 0 || journal_replay(journal, joff, &settings, &real))
+			msg(MSG_WARNING, "Scanning the whole tree instead\n");
+	}
+
+	if (real) {
+		/* Already up to date */
+	} else if (optind < argc) {
 		while (optind < argc)
-			mentries_recurse_path(argv[optind++], &real, &settings);
+			if (mentries_recurse_path(argv[optind++], &real,
+			                          &settings))
+				exit(EXIT_FAILURE);
 	} else if (action != ACTION_DUMP) {
-		mentries_recurse_path(".", &real, &settings);
+		if (mentries_recurse_path(".", &real, &settings))
+			exit(EXIT_FAILURE);
 	}
+	if (real)
+		stats_stop(STATS_WALK, real->count);
 
 	if (!real && (action != ACTION_DUMP || optind < argc)) {
 		msg(MSG_CRITICAL,
@@ -561,24 +1169,16 @@ main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
-	switch (action) {
-	case ACTION_DIFF:
-		mentries_compare(real, stored, compare_print, &settings);
-		break;
-	case ACTION_SAVE:
-		mentries_tofile(real, settings.metafile);
-		break;
-	case ACTION_APPLY:
-		mentries_compare(real, stored, compare_fix, &settings);
-		if (settings.do_emptydirs)
-			fixup_emptydirs();
-		if (settings.do_removeemptydirs)
-			fixup_newemptydirs();
-		break;
-	case ACTION_DUMP:
-		mentries_dump(real ? real : stored);
-		break;
-	}
+	if (perform(action, real, stored, &settings))
+		exit(EXIT_FAILURE);
 
-	exit(EXIT_SUCCESS);
+	/* Later runs only need changes made from now on */
+	if (action == ACTION_SAVE && joff >= 0)
+		journal_base(journal, joff, &settings);
+
+out:
+	if (stats)
+		stats_print(real, stored, !strcmp(stats, "json"));
+
+	exit(status);
 }
@@ -21,22 +21,34 @@
 #ifndef METASTORE_H
 #define METASTORE_H
 
-/* Each file starts with SIGNATURE and VERSION */
+/* Each file starts with SIGNATURE and VERSION, or VERSION1 (checksummed) */
 #define SIGNATURE    "MeTaSt00r3"
 #define SIGNATURELEN 10
 #define VERSION      "\0\0\0\0\0\0\0\0"
+#define VERSION1     "\1\0\0\0\0\0\0\0"
 #define VERSIONLEN   8
 
+/* Each plan file starts with PLANSIGNATURE and VERSION */
+#define PLANSIGNATURE    "MeTaPl4n00"
+#define PLANSIGNATURELEN 10
+
+/* Entries present in a plan file operation */
+#define PLAN_REAL    0x01
+#define PLAN_STORED  0x02
+
 /* Default filename */
 #define METAFILE     "./.metadata"
 
 /* Utility defines for the action to take */
-#define ACTION_APPLY 0x01
-#define ACTION_DIFF  0x02
-#define ACTION_DUMP  0x04
-#define ACTION_SAVE  0x10
-#define ACTION_VER   0x08
-#define ACTION_HELP  0x80
+#define ACTION_APPLY  0x01
+#define ACTION_DIFF   0x02
+#define ACTION_DUMP   0x04
+#define ACTION_SAVE   0x10
+#define ACTION_DAEMON 0x20
+#define ACTION_WATCH  0x40
+#define ACTION_VER    0x08
+#define ACTION_HELP   0x80
+#define ACTION_MERGE  0x100
 
 /* Action masks */
 #define ACTIONS_READING 0x07
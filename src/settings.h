@@ -20,13 +20,33 @@
 
 #include <stdbool.h>
 
+struct gitindex;
+struct mignore;
+
+/* Metadata fields which can be collected, compared and applied */
+#define FIELD_OWNER 0x01
+#define FIELD_GROUP 0x02
+#define FIELD_MODE  0x04
+#define FIELD_MTIME 0x08
+#define FIELD_XATTR 0x10
+#define FIELDS_ALL  0x1F
+
 /* Data structure to hold metastore settings */
 struct metasettings {
 	char *metafile;          /* path to the file containing the metadata */
+	char *planfile;          /* path to the plan file to write or read */
 	bool do_mtime;           /* should mtimes be corrected? */
 	bool do_emptydirs;       /* should empty dirs be recreated? */
 	bool do_removeemptydirs; /* should new empty dirs be removed? */
 	bool do_git;             /* should .git dirs be processed? */
+	unsigned fields;         /* which FIELD_* should be handled? */
+	bool do_cachedattrs;     /* may cached attributes be used (e.g. NFS)? */
+	const struct gitindex *tracked; /* only walk these paths, if set */
+	const struct mignore *ignore;   /* skip these paths, if set */
+	bool do_onefs;           /* should walks stay on one file system? */
+	const unsigned long *skip_fs; /* statfs f_type of file systems not to
+	                               * walk into, 0-terminated, if set */
+	int format;              /* version of saved files, -1 to keep it */
 };
 
 /* Convenient typedef for immutable settings */
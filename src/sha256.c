@@ -0,0 +1,234 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * SHA-256 digests.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * FIPS 180-4 implementation, used where equal digests must mean equal
+ * data even for data made up to collide. Blocks are processed with SHA
+ * instructions on x86 CPUs which have them, which is checked once on
+ * first use, so the binary still runs on CPUs without them.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sha256.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+# define HAVE_SHA256_X86 1
+# include <cpuid.h>
+# include <immintrin.h>
+#endif
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n)   ((x) >> (n) | (x) << (32 - (n)))
+
+static bool sha256_hw = false;
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+/* Checks for SHA instructions */
+static void
+sha256_detect(void)
+{
+#ifdef HAVE_SHA256_X86
+	unsigned a, b, c, d;
+
+	/* SHA extensions are reported in bit 29 of EBX of leaf 7 */
+	sha256_hw = __builtin_cpu_supports("sse4.1") &&
+	            __get_cpuid_count(7, 0, &a, &b, &c, &d) &&
+	            b & (1U << 29);
+#endif
+}
+
+/* Processes a block of 64 bytes at p */
+static void
+sha256_block_sw(uint32_t *state, const unsigned char *p)
+{
+	uint32_t w[64], s[8], t1, t2;
+	unsigned i;
+
+	for (i = 0; i < 16; i++, p += 4)
+		w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		       (uint32_t)p[2] << 8 | (uint32_t)p[3];
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+		       (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^
+		        w[i - 15] >> 3) +
+		       (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ w[i - 2] >> 10);
+
+	memcpy(s, state, sizeof(s));
+	for (i = 0; i < 64; i++) {
+		t1 = s[7] + (ROR(s[4], 6) ^ ROR(s[4], 11) ^ ROR(s[4], 25)) +
+		     ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+		t2 = (ROR(s[0], 2) ^ ROR(s[0], 13) ^ ROR(s[0], 22)) +
+		     ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		s[7] = s[6];
+		s[6] = s[5];
+		s[5] = s[4];
+		s[4] = s[3] + t1;
+		s[3] = s[2];
+		s[2] = s[1];
+		s[1] = s[0];
+		s[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; i++)
+		state[i] += s[i];
+}
+
+#ifdef HAVE_SHA256_X86
+/*
+ * Processes a block of 64 bytes at p using SHA instructions, which keep
+ * the state as ABEF and CDGH halves and do 4 rounds per 2 instructions
+ */
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_block_hw(uint32_t *state, const unsigned char *p)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+	                                     0x0405060700010203ULL);
+	__m128i abef, cdgh, abef0, cdgh0, msg, tmp, w[4];
+	unsigned i;
+
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0xB1);
+	cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(state + 4)),
+	                         0x1B);
+	abef = _mm_alignr_epi8(tmp, cdgh, 8);
+	cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+	abef0 = abef;
+	cdgh0 = cdgh;
+
+	for (i = 0; i < 4; i++)
+		w[i] = _mm_shuffle_epi8(
+		    _mm_loadu_si128((const __m128i *)(p + 16 * i)), bswap);
+
+	/* w[i % 4] holds words 4i to 4i+3 of the schedule when used */
+	for (i = 0; i < 16; i++) {
+		msg = _mm_add_epi32(w[i % 4], _mm_loadu_si128(
+		    (const __m128i *)&sha256_k[4 * i]));
+		cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+		abef = _mm_sha256rnds2_epu32(abef, cdgh,
+		                             _mm_shuffle_epi32(msg, 0x0E));
+		if (i >= 12)
+			continue;
+		tmp = _mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]);
+		tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[(i + 3) % 4],
+		                                         w[(i + 2) % 4], 4));
+		w[i % 4] = _mm_sha256msg2_epu32(tmp, w[(i + 3) % 4]);
+	}
+
+	abef = _mm_add_epi32(abef, abef0);
+	cdgh = _mm_add_epi32(cdgh, cdgh0);
+	tmp = _mm_shuffle_epi32(abef, 0x1B);
+	cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+	_mm_storeu_si128((__m128i *)state, _mm_blend_epi16(tmp, cdgh, 0xF0));
+	_mm_storeu_si128((__m128i *)(state + 4), _mm_alignr_epi8(cdgh, tmp, 8));
+}
+#endif
+
+/* Processes a block of 64 bytes at p */
+static void
+sha256_block(uint32_t *state, const unsigned char *p)
+{
+#ifdef HAVE_SHA256_X86
+	if (sha256_hw) {
+		sha256_block_hw(state, p);
+		return;
+	}
+#endif
+	sha256_block_sw(state, p);
+}
+
+/* Starts a new digest */
+void
+sha256_init(struct sha256 *ctx)
+{
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	pthread_once(&sha256_once, sha256_detect);
+	memcpy(ctx->state, init, sizeof(init));
+	ctx->len = 0;
+}
+
+/* Adds len bytes at buf to a digest */
+void
+sha256_update(struct sha256 *ctx, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t used = ctx->len % 64, part;
+
+	ctx->len += len;
+	if (used) {
+		part = 64 - used < len ? 64 - used : len;
+		memcpy(ctx->buf + used, p, part);
+		p += part;
+		len -= part;
+		if (used + part < 64)
+			return;
+		sha256_block(ctx->state, ctx->buf);
+	}
+	for (; len >= 64; len -= 64, p += 64)
+		sha256_block(ctx->state, p);
+	memcpy(ctx->buf, p, len);
+}
+
+/* Ends a digest and puts it (SHA256_LEN bytes) at digest */
+void
+sha256_final(struct sha256 *ctx, unsigned char *digest)
+{
+	size_t used = ctx->len % 64;
+	uint64_t bits = ctx->len * 8;
+	unsigned i;
+
+	ctx->buf[used++] = 0x80;
+	if (used > 56) {
+		memset(ctx->buf + used, 0, 64 - used);
+		sha256_block(ctx->state, ctx->buf);
+		used = 0;
+	}
+	memset(ctx->buf + used, 0, 56 - used);
+	for (i = 0; i < 8; i++)
+		ctx->buf[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+	sha256_block(ctx->state, ctx->buf);
+
+	for (i = 0; i < 8; i++) {
+		digest[4 * i] = (unsigned char)(ctx->state[i] >> 24);
+		digest[4 * i + 1] = (unsigned char)(ctx->state[i] >> 16);
+		digest[4 * i + 2] = (unsigned char)(ctx->state[i] >> 8);
+		digest[4 * i + 3] = (unsigned char)ctx->state[i];
+	}
+}
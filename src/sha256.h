@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * SHA-256 digests.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Length of a digest */
+#define SHA256_LEN 32
+
+/* State of a digest being computed */
+struct sha256 {
+	uint32_t state[8];
+	uint64_t len;            /* of all bytes added */
+	unsigned char buf[64];   /* bytes not yet processed */
+};
+
+/* Starts a new digest */
+void sha256_init(struct sha256 *ctx);
+
+/* Adds len bytes at buf to a digest */
+void sha256_update(struct sha256 *ctx, const void *buf, size_t len);
+
+/* Ends a digest and puts it (SHA256_LEN bytes) at digest */
+void sha256_final(struct sha256 *ctx, unsigned char *digest);
+
+#endif /* SHA256_H */
@@ -0,0 +1,286 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Run statistics (--stats).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "stats.h"
+#include "metaentry.h"
+
+/* Event counters */
+unsigned long stats_counters[STATS_COUNTERS];
+
+/* Names of phases and counters, as used in the output */
+static const char *phase_names[STATS_PHASES] = {
+	"load", "walk", "compare", "apply", "write",
+};
+static const char *counter_names[STATS_COUNTERS] = {
+	"lstat", "listxattr", "getxattr", "nss_lookup", "nss_enum", "fix",
+	"pruned", "getdents",
+};
+static const char *mem_names[STATS_MEMS] = {
+	"entry", "path", "name", "xattr_name", "xattr_value", "hash", "nss",
+	"buffer", "other",
+};
+
+/* Current and peak bytes allocated in a memory category, or in total */
+struct mem {
+	size_t current;
+	size_t peak;
+};
+
+static struct mem mems[STATS_MEMS];
+static struct mem memtotal;
+
+bool stats_mem_enabled = false;
+
+/* Starts accounting allocations made by xmalloc() (for --stats) */
+void
+stats_mem_enable(void)
+{
+	stats_mem_enabled = true;
+}
+
+/* Adds size bytes to m, updating its peak (thread-safe) */
+static void
+mem_add(struct mem *m, size_t size)
+{
+	size_t current, peak;
+
+	current = __atomic_add_fetch(&m->current, size, __ATOMIC_RELAXED);
+	peak = __atomic_load_n(&m->peak, __ATOMIC_RELAXED);
+	while (current > peak &&
+	       !__atomic_compare_exchange_n(&m->peak, &peak, current, true,
+	                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Accounts size bytes allocated in memory category cat */
+void
+stats_mem_alloc(enum stats_mem cat, size_t size)
+{
+	mem_add(&mems[cat], size);
+	mem_add(&memtotal, size);
+}
+
+/* Accounts size bytes freed in memory category cat */
+void
+stats_mem_free(enum stats_mem cat, size_t size)
+{
+	__atomic_sub_fetch(&mems[cat].current, size, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&memtotal.current, size, __ATOMIC_RELAXED);
+}
+
+/* Measurements of a single phase */
+struct phase {
+	bool     used;
+	double   wall;
+	double   cpu;
+	unsigned long entries;
+	struct timespec wall_start;
+	struct timespec cpu_start;
+};
+
+static struct phase phases[STATS_PHASES];
+
+/* Returns difference between two timespecs in seconds */
+static double
+elapsed(const struct timespec *start, const struct timespec *stop)
+{
+	return (stop->tv_sec - start->tv_sec) +
+	       (stop->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Starts measuring phase */
+void
+stats_start(enum stats_phase phase)
+{
+	clock_gettime(CLOCK_MONOTONIC, &phases[phase].wall_start);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &phases[phase].cpu_start);
+}
+
+/* Stops measuring phase, which processed given number of entries */
+void
+stats_stop(enum stats_phase phase, unsigned long entries)
+{
+	struct timespec wall, cpu;
+
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+
+	phases[phase].used = true;
+	phases[phase].wall += elapsed(&phases[phase].wall_start, &wall);
+	phases[phase].cpu += elapsed(&phases[phase].cpu_start, &cpu);
+	phases[phase].entries += entries;
+}
+
+/* Hash chain statistics */
+struct chains {
+	unsigned entries;
+	unsigned buckets;
+	unsigned used;
+	unsigned longest;
+};
+
+/* Gathers hash chain statistics of mhash */
+static void
+chains_get(const struct metahash *mhash, struct chains *ch)
+{
+	const struct metaentry *mentry;
+	unsigned len;
+	int key;
+
+	memset(ch, 0, sizeof(*ch));
+	ch->buckets = HASH_INDEXES;
+	for (key = 0; key < HASH_INDEXES; key++) {
+		len = 0;
+		for (mentry = mhash->bucket[key]; mentry; mentry = mentry->next)
+			len++;
+		ch->entries += len;
+		ch->used += !!len;
+		if (len > ch->longest)
+			ch->longest = len;
+	}
+}
+
+/* Returns entries per second, or 0 if it is not measurable */
+static double
+rate(const struct phase *p)
+{
+	return p->wall > 0 ? p->entries / p->wall : 0;
+}
+
+/* Prints hash chain statistics as text */
+static void
+chains_print_text(const char *name, const struct metahash *mhash)
+{
+	struct chains ch;
+
+	if (!mhash)
+		return;
+
+	chains_get(mhash, &ch);
+	fprintf(stderr, "hash %-6s entries %u, buckets %u/%u used, "
+	        "longest chain %u, average chain %.2f\n",
+	        name, ch.entries, ch.used, ch.buckets, ch.longest,
+	        ch.used ? (double)ch.entries / ch.used : 0.0);
+}
+
+/* Prints hash chain statistics as JSON object member */
+static void
+chains_print_json(const char *name, const struct metahash *mhash, bool *first)
+{
+	struct chains ch;
+
+	if (!mhash)
+		return;
+
+	chains_get(mhash, &ch);
+	fprintf(stderr, "%s\"%s\":{\"entries\":%u,\"buckets\":%u,\"used\":%u,"
+	        "\"longest\":%u,\"average\":%.2f}",
+	        *first ? "" : ",", name, ch.entries, ch.buckets, ch.used,
+	        ch.longest, ch.used ? (double)ch.entries / ch.used : 0.0);
+	*first = false;
+}
+
+/* Returns peak allocated bytes per entry of both hashes */
+static double
+mem_per_entry(const struct metahash *real, const struct metahash *stored)
+{
+	unsigned long entries = 0;
+
+	if (real)
+		entries += real->count;
+	if (stored)
+		entries += stored->count;
+
+	return entries ? (double)memtotal.peak / entries : 0.0;
+}
+
+/* Prints gathered statistics to stderr, as text or JSON */
+void
+stats_print(const struct metahash *real, const struct metahash *stored,
+            bool json)
+{
+	const struct phase *p;
+	bool first;
+	int i;
+
+	if (!json) {
+		fprintf(stderr, "%-8s %12s %12s %12s %14s\n",
+		        "phase", "wall [s]", "cpu [s]", "entries", "entries/s");
+		for (i = 0; i < STATS_PHASES; i++) {
+			p = &phases[i];
+			if (!p->used)
+				continue;
+			fprintf(stderr, "%-8s %12.6f %12.6f %12lu %14.0f\n",
+			        phase_names[i], p->wall, p->cpu, p->entries, rate(p));
+		}
+		for (i = 0; i < STATS_COUNTERS; i++) {
+			fprintf(stderr, "%s%s %lu", i ? ", " : "calls: ",
+			        counter_names[i], stats_counters[i]);
+		}
+		fprintf(stderr, "\n");
+		chains_print_text("real", real);
+		chains_print_text("stored", stored);
+		fprintf(stderr, "%-12s %14s %14s\n",
+		        "memory", "current [B]", "peak [B]");
+		for (i = 0; i < STATS_MEMS; i++) {
+			fprintf(stderr, "%-12s %14zu %14zu\n",
+			        mem_names[i], mems[i].current, mems[i].peak);
+		}
+		fprintf(stderr, "%-12s %14zu %14zu\n",
+		        "total", memtotal.current, memtotal.peak);
+		fprintf(stderr, "peak memory per entry %.1f B\n",
+		        mem_per_entry(real, stored));
+		return;
+	}
+
+	fprintf(stderr, "{\"phases\":{");
+	first = true;
+	for (i = 0; i < STATS_PHASES; i++) {
+		p = &phases[i];
+		if (!p->used)
+			continue;
+		fprintf(stderr, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f,"
+		        "\"entries\":%lu,\"entries_per_sec\":%.0f}",
+		        first ? "" : ",", phase_names[i], p->wall, p->cpu,
+		        p->entries, rate(p));
+		first = false;
+	}
+	fprintf(stderr, "},\"calls\":{");
+	for (i = 0; i < STATS_COUNTERS; i++) {
+		fprintf(stderr, "%s\"%s\":%lu", i ? "," : "",
+		        counter_names[i], stats_counters[i]);
+	}
+	fprintf(stderr, "},\"hash\":{");
+	first = true;
+	chains_print_json("real", real, &first);
+	chains_print_json("stored", stored, &first);
+	fprintf(stderr, "},\"memory\":{");
+	for (i = 0; i < STATS_MEMS; i++) {
+		fprintf(stderr, "\"%s\":{\"current\":%zu,\"peak\":%zu},",
+		        mem_names[i], mems[i].current, mems[i].peak);
+	}
+	fprintf(stderr, "\"total\":{\"current\":%zu,\"peak\":%zu},"
+	        "\"peak_per_entry\":%.1f}}\n",
+	        memtotal.current, memtotal.peak, mem_per_entry(real, stored));
+}
@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Run statistics (--stats).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct metahash;
+
+/* Measured phases of a run */
+enum stats_phase {
+	STATS_LOAD,     /* mentries_fromfile */
+	STATS_WALK,     /* mentries_recurse_path */
+	STATS_COMPARE,  /* mentries_compare for compare action */
+	STATS_APPLY,    /* mentries_compare and fixups for apply action */
+	STATS_WRITE,    /* mentries_tofile */
+	STATS_PHASES
+};
+
+/* Counted events */
+enum stats_counter {
+	STATS_LSTAT,     /* lstat/statx calls */
+	STATS_LISTXATTR, /* listxattr calls */
+	STATS_GETXATTR,  /* getxattr calls */
+	STATS_NSS,       /* owner/group lookups */
+	STATS_NSS_ENUM,  /* passwd/group database enumerations */
+	STATS_FIX,       /* syscalls changing the file system */
+	STATS_PRUNE,     /* directory entries skipped without lstat */
+	STATS_GETDENTS,  /* getdents64 calls */
+	STATS_COUNTERS
+};
+
+/* Categories of memory allocated by xmalloc() and xstrdup() */
+enum stats_mem {
+	STATS_MEM_ENTRY,  /* struct metaentry and its xattr arrays */
+	STATS_MEM_PATH,   /* paths of entries */
+	STATS_MEM_NAME,   /* owner and group names of entries */
+	STATS_MEM_XNAME,  /* xattr names */
+	STATS_MEM_XVALUE, /* xattr values */
+	STATS_MEM_HASH,   /* hash tables and the hardlink inode cache */
+	STATS_MEM_NSS,    /* cached passwd/group databases */
+	STATS_MEM_BUFFER, /* scratch buffers */
+	STATS_MEM_OTHER,  /* everything else */
+	STATS_MEMS
+};
+
+/* Event counters, use stats_count() to increment them */
+extern unsigned long stats_counters[STATS_COUNTERS];
+
+/* Increments counter c, safely also when called from multiple threads */
+#define stats_count(c) \
+	__atomic_fetch_add(&stats_counters[(c)], 1, __ATOMIC_RELAXED)
+
+/* Whether allocations are accounted, see stats_mem_enable() */
+extern bool stats_mem_enabled;
+
+/*
+ * Starts accounting allocations made by xmalloc() (for --stats)
+ * - must be called before anything is allocated, as only memory accounted
+ *   for carries a header with its size and category
+ */
+void stats_mem_enable(void);
+
+/* Accounts size bytes allocated in memory category cat */
+void stats_mem_alloc(enum stats_mem cat, size_t size);
+
+/* Accounts size bytes freed in memory category cat */
+void stats_mem_free(enum stats_mem cat, size_t size);
+
+/* Starts measuring phase */
+void stats_start(enum stats_phase phase);
+
+/* Stops measuring phase, which processed given number of entries */
+void stats_stop(enum stats_phase phase, unsigned long entries);
+
+/* Prints gathered statistics to stderr, as text or JSON */
+void stats_print(const struct metahash *real, const struct metahash *stored,
+                 bool json);
+
+#endif /* STATS_H */
@@ -28,11 +28,13 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <grp.h>
 #include <pwd.h>
 
 #include "utils.h"
+#include "stats.h"
 
 /* Controls the verbosity level for msg() */
 static int verbosity = 0;
@@ -44,6 +46,26 @@ adjust_verbosity(int adj)
 	verbosity += adj;
 }
 
+/* Should error messages be captured instead of printed? (set atomically) */
+static int msg_capture = 0;
+
+/* The last captured error message of each thread */
+static __thread char msg_error[256];
+
+/* Makes msg() capture error messages instead of printing anything */
+void
+msg_capture_errors(void)
+{
+	__atomic_store_n(&msg_capture, 1, __ATOMIC_RELAXED);
+}
+
+/* Returns the last captured error message of the calling thread */
+const char *
+msg_last_error(void)
+{
+	return msg_error;
+}
+
 /*
  * Prints messages to console according to the current verbosity
  * - see utils.h for level defines
@@ -52,8 +74,21 @@ int
 msg(int level, const char *fmt, ...)
 {
 	int ret;
+	size_t len;
 	va_list ap;
 
+	if (__atomic_load_n(&msg_capture, __ATOMIC_RELAXED)) {
+		if (level >= MSG_QUIET)
+			return 0;
+		va_start(ap, fmt);
+		ret = vsnprintf(msg_error, sizeof(msg_error), fmt, ap);
+		va_end(ap);
+		len = strlen(msg_error);
+		if (len > 0 && msg_error[len - 1] == '\n')
+			msg_error[len - 1] = '\0';
+		return ret;
+	}
+
 	if (level > verbosity)
 		return 0;
 
@@ -68,30 +103,78 @@ msg(int level, const char *fmt, ...)
 	return ret;
 }
 
-/* Malloc which either succeeds or exits */
+/* Header preceding memory returned by xmalloc when it is accounted */
+union xheader {
+	struct {
+		size_t size;
+		enum stats_mem cat;
+	} h;
+	long double align; /* Keeps returned memory suitably aligned */
+};
+
+/*
+ * Malloc which accounts memory in category cat, if enabled for --stats
+ * - reports failures and returns NULL with errno set to ENOMEM
+ * - without accounting, neither header nor shared counters are touched
+ */
 void *
-xmalloc(size_t size)
+xmalloc(size_t size, enum stats_mem cat)
 {
-        void *result = malloc(size);
-        if (!result) {
-                msg(MSG_CRITICAL, "Failed to malloc %zu bytes\n", size);
-                exit(EXIT_FAILURE);
-        }
-        return result;
+	union xheader *result = NULL;
+	void *ptr;
+
+	if (!stats_mem_enabled) {
+		ptr = malloc(size ? size : 1);
+		if (!ptr) {
+			msg(MSG_CRITICAL, "Failed to malloc %zu bytes\n", size);
+			errno = ENOMEM;
+		}
+		return ptr;
+	}
+
+	if (size <= SIZE_MAX - sizeof(union xheader))
+		result = malloc(sizeof(union xheader) + size);
+	if (!result) {
+		msg(MSG_CRITICAL, "Failed to malloc %zu bytes\n", size);
+		errno = ENOMEM;
+		return NULL;
+	}
+	result->h.size = size;
+	result->h.cat = cat;
+	stats_mem_alloc(cat, size);
+	return result + 1;
 }
 
 /* Ditto for strdup */
 char *
-xstrdup(const char *s)
+xstrdup(const char *s, enum stats_mem cat)
 {
-	char *result = strdup(s);
-	if (!result) {
-		msg(MSG_CRITICAL, "Failed to strdup %zu bytes\n", strlen(s));
-		exit(EXIT_FAILURE);
-	}
+	size_t len = strlen(s) + 1;
+	char *result = xmalloc(len, cat);
+	if (result)
+		memcpy(result, s, len);
 	return result;
 }
 
+/* Frees memory allocated by xmalloc() or xstrdup() */
+void
+xfree(void *ptr)
+{
+	union xheader *header;
+
+	if (!ptr)
+		return;
+
+	if (!stats_mem_enabled) {
+		free(ptr);
+		return;
+	}
+
+	header = (union xheader *)ptr - 1;
+	stats_mem_free(header->h.cat, header->h.size);
+	free(header);
+}
+
 /* Human-readable printout of binary data */
 void
 binary_print(const char *s, ssize_t len)
@@ -106,15 +189,15 @@ binary_print(const char *s, ssize_t len)
 	}
 }
 
-/* Writes data to a file or exits on failure */
+/*
+ * Writes data to a file
+ * - failures are sticky, callers check ferror() once they are done
+ */
 void
 xfwrite(const void *ptr, size_t size, FILE *stream)
 {
-	if (size && fwrite(ptr, size, 1, stream) != 1) {
-		msg(MSG_CRITICAL, "Failed to write to file: %s\n",
-		    strerror(errno));
-		exit(EXIT_FAILURE);
-	}
+	if (size)
+		fwrite(ptr, size, 1, stream);
 }
 
 /* Writes an int to a file, using len bytes, in little-endian order */
@@ -143,18 +226,78 @@ write_string(const char *string, FILE *to)
 	xfwrite(string, strlen(string) + 1, to);
 }
 
+/* Puts an int into memory, using len bytes, in little-endian order */
+char *
+put_int(char *to, uint64_t value, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		to[i] = ((value >> (8 * i)) & 0xff);
+	return to + len;
+}
+
+/* Puts a binary string into memory */
+char *
+put_binary_string(char *to, const char *string, size_t len)
+{
+	if (len)
+		memcpy(to, string, len);
+	return to + len;
+}
+
+/* Puts a normal C string into memory */
+char *
+put_string(char *to, const char *string)
+{
+	return put_binary_string(to, string, strlen(string) + 1);
+}
+
+/* Marks *from as failed after an attempt to read beyond max */
+static void
+read_fail(char **from)
+{
+	msg(MSG_ERROR, "Attempt to read beyond end of file, corrupt file?\n");
+	*from = NULL;
+	errno = EINVAL;
+}
+
 /* Reads an int from a file, using len bytes, in little-endian order */
 uint64_t
 read_int(char **from, size_t len, const char *max)
 {
 	uint64_t result = 0;
+	uint32_t u32;
+	uint16_t u16;
 	size_t i;
 
-	if (*from + len > max) {
-		msg(MSG_CRITICAL,
-		    "Attempt to read beyond end of file, corrupt file?\n");
-		exit(EXIT_FAILURE);
+	if (!*from)
+		return 0;
+	if (len > (size_t)(max - *from)) {
+		read_fail(from);
+		return 0;
+	}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	/* Copies of fixed size become single unaligned loads */
+	switch (len) {
+	case 8:
+		memcpy(&result, *from, 8);
+		*from += 8;
+		return result;
+	case 4:
+		memcpy(&u32, *from, 4);
+		*from += 4;
+		return u32;
+	case 2:
+		memcpy(&u16, *from, 2);
+		*from += 2;
+		return u16;
 	}
+#else
+	(void)u32;
+	(void)u16;
+#endif
 
 	for (i = 0; i < len; i++)
 		result += (((uint64_t)(*from)[i] & 0xff) << (8 * i));
@@ -164,17 +307,23 @@ read_int(char **from, size_t len, const char *max)
 
 /* Reads a binary string from a file */
 char *
-read_binary_string(char **from, size_t len, const char *max)
+read_binary_string(char **from, size_t len, const char *max,
+                   enum stats_mem cat)
 {
 	char *result;
 
-	if (*from + len > max) {
-		msg(MSG_CRITICAL,
-		    "Attempt to read beyond end of file, corrupt file?\n");
-		exit(EXIT_FAILURE);
+	if (!*from)
+		return NULL;
+	if (len > (size_t)(max - *from)) {
+		read_fail(from);
+		return NULL;
 	}
 
-	result = xmalloc(len);
+	result = xmalloc(len, cat);
+	if (!result) {
+		*from = NULL;
+		return NULL;
+	}
 	memcpy(result, *from, len);
 	*from += len;
 	return result;
@@ -182,13 +331,25 @@ read_binary_string(char **from, size_t len, const char *max)
 
 /* Reads a normal C string from a file */
 char *
-read_string(char **from, const char *max)
+read_string(char **from, const char *max, enum stats_mem cat)
 {
-	return read_binary_string(from, strlen(*from) + 1, max);
+	const char *nul;
+
+	if (!*from)
+		return NULL;
+
+	/* The terminator must be found before max, not past it */
+	nul = *from < max ? memchr(*from, '\0', max - *from) : NULL;
+	if (!nul) {
+		read_fail(from);
+		return NULL;
+	}
+	return read_binary_string(from, nul - *from + 1, max, cat);
 }
 
-/* For group caching */
+/* For group caching, the table is created once and read-only afterwards */
 static struct group *gtable = NULL;
+static pthread_once_t gtable_once = PTHREAD_ONCE_INIT;
 
 /* Initial setup of the gid table */
 static void
@@ -197,15 +358,23 @@ create_group_table(void)
 	struct group *tmp;
 	int count, index;
 
+	stats_count(STATS_NSS_ENUM);
 	for (count = 0; getgrent(); count++) /* Do nothing */;
 
-	gtable = xmalloc(sizeof(struct group) * (count + 1));
+	/* Without a table (out of memory), all lookups fail */
+	gtable = xmalloc(sizeof(struct group) * (count + 1), STATS_MEM_NSS);
+	if (!gtable) {
+		endgrent();
+		return;
+	}
 	memset(gtable, 0, sizeof(struct group) * (count + 1));
 	setgrent();
 
 	for (index = 0; (tmp = getgrent()) && index < count; index++) {
 		gtable[index].gr_gid = tmp->gr_gid;
-		gtable[index].gr_name = xstrdup(tmp->gr_name);
+		gtable[index].gr_name = xstrdup(tmp->gr_name, STATS_MEM_NSS);
+		if (!gtable[index].gr_name)
+			break;
 	}
 
 	endgrent();
@@ -217,10 +386,10 @@ xgetgrnam(const char *name)
 {
 	int i;
 
-	if (!gtable)
-		create_group_table();
+	stats_count(STATS_NSS);
+	pthread_once(&gtable_once, create_group_table);
 
-	for (i = 0; gtable[i].gr_name; i++) {
+	for (i = 0; gtable && gtable[i].gr_name; i++) {
 		if (!strcmp(name, gtable[i].gr_name))
 			return &(gtable[i]);
 	}
@@ -234,10 +403,10 @@ xgetgrgid(gid_t gid)
 {
 	int i;
 
-	if (!gtable)
-		create_group_table();
+	stats_count(STATS_NSS);
+	pthread_once(&gtable_once, create_group_table);
 
-	for (i = 0; gtable[i].gr_name; i++) {
+	for (i = 0; gtable && gtable[i].gr_name; i++) {
 		if (gtable[i].gr_gid == gid)
 			return &(gtable[i]);
 	}
@@ -245,8 +414,9 @@ xgetgrgid(gid_t gid)
 	return NULL;
 }
 
-/* For user caching */
+/* For user caching, the table is created once and read-only afterwards */
 static struct passwd *ptable = NULL;
+static pthread_once_t ptable_once = PTHREAD_ONCE_INIT;
 
 /* Initial setup of the passwd table */
 static void
@@ -255,15 +425,23 @@ create_passwd_table(void)
 	struct passwd *tmp;
 	int count, index;
 
+	stats_count(STATS_NSS_ENUM);
 	for (count = 0; getpwent(); count++) /* Do nothing */;
 
-	ptable = xmalloc(sizeof(struct passwd) * (count + 1));
+	/* Without a table (out of memory), all lookups fail */
+	ptable = xmalloc(sizeof(struct passwd) * (count + 1), STATS_MEM_NSS);
+	if (!ptable) {
+		endpwent();
+		return;
+	}
 	memset(ptable, 0, sizeof(struct passwd) * (count + 1));
 	setpwent();
 
 	for (index = 0; (tmp = getpwent()) && index < count; index++) {
 		ptable[index].pw_uid = tmp->pw_uid;
-		ptable[index].pw_name = xstrdup(tmp->pw_name);
+		ptable[index].pw_name = xstrdup(tmp->pw_name, STATS_MEM_NSS);
+		if (!ptable[index].pw_name)
+			break;
 	}
 
 	endpwent();
@@ -275,10 +453,10 @@ xgetpwnam(const char *name)
 {
 	int i;
 
-	if (!ptable)
-		create_passwd_table();
+	stats_count(STATS_NSS);
+	pthread_once(&ptable_once, create_passwd_table);
 
-	for (i = 0; ptable[i].pw_name; i++) {
+	for (i = 0; ptable && ptable[i].pw_name; i++) {
 		if (!strcmp(name, ptable[i].pw_name))
 			return &(ptable[i]);
 	}
@@ -292,10 +470,10 @@ xgetpwuid(uid_t uid)
 {
 	int i;
 
-	if (!ptable)
-		create_passwd_table();
+	stats_count(STATS_NSS);
+	pthread_once(&ptable_once, create_passwd_table);
 
-	for (i = 0; ptable[i].pw_name; i++) {
+	for (i = 0; ptable && ptable[i].pw_name; i++) {
 		if (ptable[i].pw_uid == uid)
 			return &(ptable[i]);
 	}
@@ -31,6 +31,8 @@
 #include <pwd.h>
 /* For struct group */
 #include <grp.h>
+/* For enum stats_mem */
+#include "stats.h"
 
 /* Adjusts the verbosity level for msg() */
 void adjust_verbosity(int adj);
@@ -47,16 +49,31 @@ void adjust_verbosity(int adj);
 /* Prints messages to console according to the current verbosity */
 int msg(int level, const char *fmt, ...);
 
-/* Malloc which either succeeds or exits */
-void *xmalloc(size_t size);
+/*
+ * Makes msg() remember the last error message of each thread instead of
+ * printing anything, for use as a library
+ */
+void msg_capture_errors(void);
+
+/* Returns the last captured error message of the calling thread */
+const char *msg_last_error(void);
+
+/*
+ * Malloc which accounts memory in category cat
+ * - returns NULL with errno set to ENOMEM on failure
+ */
+void *xmalloc(size_t size, enum stats_mem cat);
 
 /* Ditto for strdup */
-char *xstrdup(const char *s);
+char *xstrdup(const char *s, enum stats_mem cat);
+
+/* Frees memory allocated by xmalloc() or xstrdup() */
+void xfree(void *ptr);
 
 /* Human-readable printout of binary data */
 void binary_print(const char *s, ssize_t len);
 
-/* Writes data to a file or exits on failure */
+/* Writes data to a file, failures are left for ferror() to report */
 void xfwrite(const void *ptr, size_t size, FILE *stream);
 
 /* Writes an int to a file, using len bytes, in little-endian order */
@@ -68,14 +85,36 @@ void write_binary_string(const char *string, size_t len, FILE *to);
 /* Writes a normal C string to a file */
 void write_string(const char *string, FILE *to);
 
+/*
+ * Putting functions below store the same as writing functions above into
+ * memory at to, which must be large enough, and return pointer after it
+ */
+
+/* Puts an int into memory, using len bytes, in little-endian order */
+char *put_int(char *to, uint64_t value, size_t len);
+
+/* Puts a binary string into memory */
+char *put_binary_string(char *to, const char *string, size_t len);
+
+/* Puts a normal C string into memory */
+char *put_string(char *to, const char *string);
+
+/*
+ * Reading functions below set *from to NULL and return 0 or NULL when asked
+ * to read beyond max (with errno set to EINVAL) or out of memory (ENOMEM),
+ * and do nothing once *from is NULL, so a whole record can be read before
+ * checking for corruption
+ */
+
 /* Reads an int from a file, using len bytes, in little-endian order */
 uint64_t read_int(char **from, size_t len, const char *max);
 
 /* Reads a binary string from a file */
-char *read_binary_string(char **from, size_t len, const char *max);
+char *read_binary_string(char **from, size_t len, const char *max,
+                         enum stats_mem cat);
 
 /* Reads a normal C string from a file */
-char *read_string(char **from, const char *max);
+char *read_string(char **from, const char *max, enum stats_mem cat);
 
 /* Caching version of getgrnam */
 struct group *xgetgrnam(const char *name);
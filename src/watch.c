@@ -0,0 +1,400 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Watching a file tree for metadata changes.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+# include <sys/inotify.h>
+#endif
+
+#include "watch.h"
+#include "ignore.h"
+#include "utils.h"
+
+#ifndef PATH_MAX
+# define PATH_MAX 4096
+#endif
+
+#ifdef __linux__
+
+#define WATCH_INDEXES 1024
+
+/* Events of interest, everything which may change collected metadata */
+#define WATCH_MASK (IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | \
+                    IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+/* Watched directory */
+struct wdir {
+	struct wdir *next;
+	int wd;
+	char *path;
+};
+
+/* Watcher of directories */
+struct mwatch {
+	int fd;
+	struct wdir *dirs[WATCH_INDEXES];
+};
+
+/* Creates a watcher, returns NULL on failure */
+struct mwatch *
+mwatch_open(void)
+{
+	struct mwatch *mwatch;
+
+	mwatch = xmalloc(sizeof(struct mwatch), STATS_MEM_OTHER);
+	if (!mwatch)
+		return NULL;
+	memset(mwatch, 0, sizeof(struct mwatch));
+
+	mwatch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (mwatch->fd < 0) {
+		msg(MSG_CRITICAL, "inotify_init1 failed: %s\n",
+		    strerror(errno));
+		xfree(mwatch);
+		return NULL;
+	}
+
+	return mwatch;
+}
+
+/* Frees a watcher and all its watches */
+void
+mwatch_close(struct mwatch *mwatch)
+{
+	struct wdir *wdir, *next;
+	int key;
+
+	if (!mwatch)
+		return;
+
+	for (key = 0; key < WATCH_INDEXES; key++) {
+		for (wdir = mwatch->dirs[key]; wdir; wdir = next) {
+			next = wdir->next;
+			xfree(wdir->path);
+			xfree(wdir);
+		}
+	}
+
+	close(mwatch->fd);
+	xfree(mwatch);
+}
+
+/* Returns the file descriptor to poll for readability */
+int
+mwatch_fd(const struct mwatch *mwatch)
+{
+	return mwatch->fd;
+}
+
+/* Finds the watched directory with watch descriptor wd */
+static struct wdir **
+wdir_find(struct mwatch *mwatch, int wd)
+{
+	struct wdir **wdir;
+
+	wdir = &mwatch->dirs[(unsigned)wd % WATCH_INDEXES];
+	for (; *wdir; wdir = &(*wdir)->next) {
+		if ((*wdir)->wd == wd)
+			break;
+	}
+
+	return wdir;
+}
+
+/* Starts watching the directory at path (not recursively), -1 on failure */
+int
+mwatch_add(struct mwatch *mwatch, const char *path)
+{
+	struct wdir **wdir;
+	char *wpath;
+	int wd;
+
+	wd = inotify_add_watch(mwatch->fd, path, WATCH_MASK);
+	if (wd < 0) {
+		msg(MSG_ERROR, "inotify_add_watch failed for %s: %s%s\n",
+		    path, strerror(errno), errno == ENOSPC ?
+		    " (see fs.inotify.max_user_watches)" : "");
+		return -1;
+	}
+
+	wpath = xstrdup(path, STATS_MEM_OTHER);
+	if (!wpath)
+		return -1;
+
+	/* Directory moved within the tree keeps its watch descriptor */
+	wdir = wdir_find(mwatch, wd);
+	if (*wdir) {
+		xfree((*wdir)->path);
+		(*wdir)->path = wpath;
+		return 0;
+	}
+
+	*wdir = xmalloc(sizeof(struct wdir), STATS_MEM_OTHER);
+	if (!*wdir) {
+		xfree(wpath);
+		return -1;
+	}
+	(*wdir)->next = NULL;
+	(*wdir)->wd = wd;
+	(*wdir)->path = wpath;
+	return 0;
+}
+
+/* Translates a single inotify event, returns number of reported changes */
+static int
+mwatch_event(struct mwatch *mwatch, const struct inotify_event *event,
+             void (*cb)(const char *path, unsigned flags, void *arg),
+             void *arg)
+{
+	struct wdir **wdir, *gone;
+	char dpath[PATH_MAX];
+	char tpath[PATH_MAX];
+	unsigned flags;
+
+	if (event->mask & IN_Q_OVERFLOW) {
+		cb(NULL, 0, arg);
+		return 1;
+	}
+
+	wdir = wdir_find(mwatch, event->wd);
+	if (!*wdir)
+		return 0;
+
+	/* Watch was removed together with its directory */
+	if (event->mask & IN_IGNORED) {
+		gone = *wdir;
+		*wdir = gone->next;
+		xfree(gone->path);
+		xfree(gone);
+		return 0;
+	}
+
+	/* Callback may add watches, so do not touch wdir afterwards */
+	snprintf(dpath, PATH_MAX, "%s", (*wdir)->path);
+
+	/* Changes of directory contents change also its mtime */
+	if (!event->len || event->mask & (IN_CREATE | IN_DELETE |
+	                                  IN_MOVED_FROM | IN_MOVED_TO))
+		cb(dpath, MWATCH_CHANGED | MWATCH_DIR, arg);
+	if (!event->len)
+		return 1;
+
+	flags = 0;
+	if (event->mask & (IN_ATTRIB | IN_MODIFY))
+		flags |= MWATCH_CHANGED;
+	if (event->mask & (IN_CREATE | IN_MOVED_TO))
+		flags |= MWATCH_CREATED;
+	if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+		flags |= MWATCH_REMOVED;
+	if (event->mask & IN_ISDIR)
+		flags |= MWATCH_DIR;
+
+	if (snprintf(tpath, PATH_MAX, "%s/%s", dpath, event->name) >= PATH_MAX) {
+		msg(MSG_ERROR, "%s/%s:\tpath too long\n", dpath, event->name);
+		return 1;
+	}
+	cb(tpath, flags, arg);
+	return 2;
+}
+
+/*
+ * Reads pending changes without blocking and calls cb for each of them
+ * - returns number of changes or -1 on failure
+ */
+int
+mwatch_read(struct mwatch *mwatch,
+            void (*cb)(const char *path, unsigned flags, void *arg),
+            void *arg)
+{
+	char buf[65536]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t len;
+	char *ptr;
+	int count = 0;
+
+	while ((len = read(mwatch->fd, buf, sizeof(buf))) > 0) {
+		for (ptr = buf; ptr < buf + len;
+		     ptr += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *)ptr;
+			count += mwatch_event(mwatch, event, cb, arg);
+		}
+	}
+
+	if (len < 0 && errno != EAGAIN && errno != EINTR) {
+		msg(MSG_ERROR, "Failed to read inotify events: %s\n",
+		    strerror(errno));
+		return -1;
+	}
+
+	return count;
+}
+
+#else /* !__linux__ */
+
+/* Watching is not supported on this platform */
+struct mwatch *
+mwatch_open(void)
+{
+	msg(MSG_CRITICAL, "Watching file trees is not supported\n");
+	errno = ENOSYS;
+	return NULL;
+}
+
+void
+mwatch_close(struct mwatch *mwatch)
+{
+	(void)mwatch;
+}
+
+int
+mwatch_fd(const struct mwatch *mwatch)
+{
+	(void)mwatch;
+	return -1;
+}
+
+int
+mwatch_add(struct mwatch *mwatch, const char *path)
+{
+	(void)mwatch;
+	(void)path;
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+mwatch_read(struct mwatch *mwatch,
+            void (*cb)(const char *path, unsigned flags, void *arg),
+            void *arg)
+{
+	(void)mwatch;
+	(void)cb;
+	(void)arg;
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif /* __linux__ */
+
+/* Inserts mentry into mhash given as arg - for use in mentries_walk */
+static int
+mwatch_insert(struct metaentry *mentry, void *arg)
+{
+	struct metahash *mhash = arg;
+
+	mentry_free(mentry_remove(mentry->path, mhash));
+	mentry_insert(mentry, mhash);
+	return 0;
+}
+
+/*
+ * Checks whether walking "." gives the entry at path, i.e. whether the
+ * walk descends into "." and each mountpoint above path
+ * - an ancestor which cannot be queried (e.g. just removed) ends the check
+ */
+static bool
+mwatch_walked(const char *path, msettings *st)
+{
+	char dir[PATH_MAX];
+	struct stat sbuf;
+	dev_t rootdev, dev;
+	size_t len;
+
+	if (!st->do_onefs && !st->skip_fs)
+		return true;
+
+	if (lstat(".", &sbuf))
+		return true;
+	rootdev = dev = sbuf.st_dev;
+	if (!mentries_descend(".", dev, rootdev, st))
+		return false;
+
+	/* Directories between "." and path, from the top */
+	if (strncmp(path, "./", 2))
+		return true;
+	for (len = 2; path[len]; len++) {
+		if (path[len] != '/')
+			continue;
+		if (len >= sizeof(dir))
+			return true;
+		memcpy(dir, path, len);
+		dir[len] = '\0';
+		if (lstat(dir, &sbuf))
+			return true;
+		if (sbuf.st_dev != dev &&
+		    !mentries_descend(dir, sbuf.st_dev, rootdev, st))
+			return false;
+		dev = sbuf.st_dev;
+	}
+
+	return true;
+}
+
+/* Brings mhash up to date after a change of path */
+void
+mwatch_update(struct metahash *mhash, const char *path, unsigned flags,
+              msettings *st,
+              int (*cb)(struct metaentry *mentry, void *arg),
+              void *arg)
+{
+	struct metaentry *mentry;
+	struct stat sbuf;
+	const char *name;
+
+	/* The same entries as walking the tree would give */
+	name = strrchr(path, '/');
+	if (!st->do_git && name && !strcmp(name + 1, ".git"))
+		return;
+	if (st->ignore && mignore_excluded(st->ignore, path, -1))
+		return;
+	if (!mwatch_walked(path, st))
+		return;
+
+	mentry_free(mentry_remove(path, mhash));
+	if (flags & MWATCH_DIR && flags & (MWATCH_CREATED | MWATCH_REMOVED))
+		mentries_remove_tree(path, mhash);
+	if (flags & MWATCH_REMOVED || lstat(path, &sbuf))
+		return;
+
+	/* New directory may already have contents */
+	if (S_ISDIR(sbuf.st_mode) && flags & MWATCH_CREATED) {
+		if (!cb) {
+			cb = mwatch_insert;
+			arg = mhash;
+		}
+		if (mentries_walk(path, st, cb, arg))
+			msg(MSG_ERROR, "%s:\tfailed to scan new directory\n",
+			    path);
+		return;
+	}
+
+	mentry = mentry_create(path, st);
+	if (mentry)
+		mentry_insert(mentry, mhash);
+}
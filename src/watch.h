@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Watching a file tree for metadata changes.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "settings.h"
+#include "metaentry.h"
+
+/* Kinds of changes reported by mwatch_read */
+#define MWATCH_CHANGED  0x01 /* metadata or contents changed */
+#define MWATCH_CREATED  0x02 /* created or moved in */
+#define MWATCH_REMOVED  0x04 /* removed or moved out */
+#define MWATCH_DIR      0x08 /* path is a directory */
+
+/* Watcher of directories, opaque */
+struct mwatch;
+
+/* Creates a watcher, returns NULL on failure (ENOSYS if unsupported) */
+struct mwatch *mwatch_open(void);
+
+/* Frees a watcher and all its watches */
+void mwatch_close(struct mwatch *mwatch);
+
+/* Returns the file descriptor to poll for readability */
+int mwatch_fd(const struct mwatch *mwatch);
+
+/* Starts watching the directory at path (not recursively), -1 on failure */
+int mwatch_add(struct mwatch *mwatch, const char *path);
+
+/*
+ * Reads pending changes without blocking and calls cb for each of them with
+ * path of the changed entry and MWATCH_* flags
+ * - path is NULL if changes were lost (queue overflow), full rescan is
+ *   needed then
+ * - returns number of changes or -1 on failure
+ */
+int mwatch_read(struct mwatch *mwatch,
+                void (*cb)(const char *path, unsigned flags, void *arg),
+                void *arg);
+
+/*
+ * Brings mhash up to date after a change of path reported with MWATCH_*
+ * flags, according to the current state of path
+ * - new directories are walked and their entries passed to cb (which takes
+ *   them over, as in mentries_walk) or inserted into mhash if cb is NULL
+ */
+void mwatch_update(struct metahash *mhash, const char *path, unsigned flags,
+                   msettings *st,
+                   int (*cb)(struct metaentry *mentry, void *arg),
+                   void *arg);
+
+#endif /* WATCH_H */